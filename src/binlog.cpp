@@ -0,0 +1,574 @@
+#include "binlog.h"
+#include <stdio.h>
+
+namespace zcserver
+{
+    /*********************************
+     * struct BinLogSite
+     *********************************/
+
+    static std::atomic<uint32_t> s_site_id{0};
+
+    BinLogSite::BinLogSite(const char *fmt, const char *file, int32_t line)
+        : fmt(fmt), file(file), line(line), id(++s_site_id)
+    {
+    }
+
+    /*********************************
+     * binary records
+     *********************************/
+
+    namespace binlog
+    {
+        LogStream &Begin(LogLevel::Level level, const BinLogSite &site)
+        {
+            static thread_local LogStream t_stream;
+            const LogContext &context = LogContext::Get();
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+
+            BinLogRecord r;
+            r.len = 0;
+            r.type = BinLogRecord::EVENT;
+            r.level = level;
+            r.reserved = 0;
+            r.time = ts.tv_sec;
+            r.nsec = ts.tv_nsec;
+            r.site = site.id;
+            r.tid = context.tid;
+            r.fid = context.fid;
+            r.elapse = 0;
+            t_stream.reset();
+            t_stream.append((const char *)&r, sizeof(r));
+            return t_stream;
+        }
+
+        void End(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const BinLogSite &site, LogStream &os)
+        {
+            uint32_t len = os.size();
+            memcpy(const_cast<char *>(os.data()), &len, sizeof(len));
+            logger->logBinary(logger, level, site, os.data(), os.size());
+        }
+
+        // one argument read back from a record
+        struct Arg
+        {
+            Tag tag;
+            int64_t i;
+            uint64_t u;
+            double d;
+            const char *str;
+            uint32_t len;
+        };
+
+        class ArgReader
+        {
+        private:
+            const char *m_cur;
+            const char *m_end;
+
+            template<class V>
+            bool get(V &v)
+            {
+                if (m_end - m_cur < (ptrdiff_t)sizeof(V))
+                {
+                    return false;
+                }
+                memcpy(&v, m_cur, sizeof(V));
+                m_cur += sizeof(V);
+                return true;
+            }
+
+        public:
+            ArgReader(const char *data, size_t len) : m_cur(data), m_end(data + len) {}
+
+            bool next(Arg &a)
+            {
+                uint8_t tag;
+                if (!get(tag))
+                {
+                    return false;
+                }
+                a.tag = (Tag)tag;
+                switch (a.tag)
+                {
+                case INT32:
+                {
+                    int32_t v;
+                    if (!get(v))
+                        return false;
+                    a.i = v;
+                    return true;
+                }
+                case UINT32:
+                {
+                    uint32_t v;
+                    if (!get(v))
+                        return false;
+                    a.u = v;
+                    return true;
+                }
+                case INT64:
+                    return get(a.i);
+                case UINT64:
+                case POINTER:
+                    return get(a.u);
+                case DOUBLE:
+                    return get(a.d);
+                case STRING:
+                    if (!get(a.len) || m_end - m_cur < (ptrdiff_t)a.len)
+                    {
+                        return false;
+                    }
+                    a.str = m_cur;
+                    m_cur += a.len;
+                    return true;
+                }
+                return false;
+            }
+        };
+
+        template<class V>
+        static void Print(std::ostream &os, const char *spec, V v)
+        {
+            char buf[128];
+            int n = snprintf(buf, sizeof(buf), spec, v);
+            if (n < 0)
+            {
+                return;
+            }
+            if ((size_t)n < sizeof(buf))
+            {
+                os.write(buf, n);
+                return;
+            }
+            std::unique_ptr<char[]> big(new char[n + 1]);
+            snprintf(big.get(), n + 1, spec, v);
+            os.write(big.get(), n);
+        }
+
+        void Format(std::ostream &os, const char *fmt, const char *args, size_t len)
+        {
+            ArgReader reader(args, len);
+            const char *p = fmt;
+            while (*p)
+            {
+                const char *q = p;
+                while (*q && *q != '%')
+                {
+                    ++q;
+                }
+                os.write(p, q - p);
+                if (!*q)
+                {
+                    break;
+                }
+                p = q;
+                if (q[1] == '%')
+                {
+                    os.put('%');
+                    p = q + 2;
+                    continue;
+                }
+
+                // %[flags][width][.precision][length]conversion
+                // the length is replaced by the one of the recorded type
+                std::string spec = "%";
+                Arg a;
+                ++q;
+                while (*q && strchr("-+ #0'", *q))
+                {
+                    spec += *q++;
+                }
+                for (int part = 0; part < 2; ++part)
+                {
+                    if (part == 1)
+                    {
+                        if (*q != '.')
+                            break;
+                        spec += *q++;
+                    }
+                    if (*q == '*')
+                    {
+                        if (reader.next(a))
+                            spec += std::to_string(a.tag == INT32 || a.tag == INT64 ? a.i : (int64_t)a.u);
+                        ++q;
+                    }
+                    while (*q >= '0' && *q <= '9')
+                    {
+                        spec += *q++;
+                    }
+                }
+                std::string length;
+                while (*q && strchr("hlLqjzt", *q))
+                {
+                    length += *q++;
+                }
+                char conv = *q;
+                if (!conv)
+                {
+                    os << p;
+                    break;
+                }
+                ++q;
+                if (!reader.next(a))
+                {
+                    // keep the conversion of a missing argument as it is
+                    os.write(p, q - p);
+                    p = q;
+                    continue;
+                }
+                p = q;
+
+                bool int_conv = strchr("diouxXc", conv) != nullptr;
+                bool float_conv = strchr("fFeEgGaA", conv) != nullptr;
+                switch (a.tag)
+                {
+                case INT32:
+                case UINT32:
+                    // h and hh truncate like in the original call
+                    if (length != "h" && length != "hh")
+                        length.clear();
+                    if (!int_conv)
+                    {
+                        conv = a.tag == INT32 ? 'd' : 'u';
+                        length.clear();
+                    }
+                    spec += length + conv;
+                    if (a.tag == INT32)
+                        Print(os, spec.c_str(), (int)a.i);
+                    else
+                        Print(os, spec.c_str(), (unsigned int)a.u);
+                    break;
+                case INT64:
+                case UINT64:
+                case POINTER:
+                    if (a.tag == POINTER && (conv == 'p' || !int_conv))
+                    {
+                        Print(os, (spec + 'p').c_str(), (void *)(uintptr_t)a.u);
+                        break;
+                    }
+                    if (!int_conv || conv == 'c')
+                    {
+                        conv = a.tag == INT64 ? 'd' : 'u';
+                    }
+                    spec += std::string("ll") + conv;
+                    if (a.tag == INT64)
+                        Print(os, spec.c_str(), (long long)a.i);
+                    else
+                        Print(os, spec.c_str(), (unsigned long long)a.u);
+                    break;
+                case DOUBLE:
+                    spec += float_conv ? conv : 'g';
+                    Print(os, spec.c_str(), a.d);
+                    break;
+                case STRING:
+                    if (conv != 's' || spec == "%")
+                    {
+                        os.write(a.str, a.len);
+                    }
+                    else
+                    {
+                        Print(os, (spec + 's').c_str(), std::string(a.str, a.len).c_str());
+                    }
+                    break;
+                }
+            }
+        }
+
+        static void PutU32(std::string &out, uint32_t v)
+        {
+            out.append((const char *)&v, sizeof(v));
+        }
+
+        static void PutString(std::string &out, const char *str, uint32_t len)
+        {
+            PutU32(out, len);
+            out.append(str, len);
+        }
+
+        class BodyReader
+        {
+        private:
+            const char *m_cur;
+            const char *m_end;
+
+        public:
+            BodyReader(const std::string &body) : m_cur(body.data()), m_end(body.data() + body.size()) {}
+
+            bool u32(uint32_t &v)
+            {
+                if (m_end - m_cur < (ptrdiff_t)sizeof(v))
+                {
+                    return false;
+                }
+                memcpy(&v, m_cur, sizeof(v));
+                m_cur += sizeof(v);
+                return true;
+            }
+
+            bool str(std::string &v)
+            {
+                uint32_t len;
+                if (!u32(len) || m_end - m_cur < (ptrdiff_t)len)
+                {
+                    return false;
+                }
+                v.assign(m_cur, len);
+                m_cur += len;
+                return true;
+            }
+        };
+    }
+
+    void LogAppender::logBinary(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const BinLogSite &site, const char *data, size_t len)
+    {
+        if (level >= m_level)
+        {
+            BinLogRecord r;
+            memcpy(&r, data, sizeof(r));
+            auto event = LogEvent::Create(logger, level, site.file, site.line, r.elapse, r.tid, r.fid);
+            binlog::Format(event->getSS(), site.fmt, data + sizeof(r), len - sizeof(r));
+            log(logger, level, event);
+        }
+    }
+
+    /*********************************
+     * class BinaryLogAppender
+     *********************************/
+
+    BinaryLogAppender::BinaryLogAppender(const std::string &filename)
+        : FileLogAppender(filename, Derived())
+    {
+        LogCrashHandler::Register(this);
+    }
+
+    BinaryLogAppender::~BinaryLogAppender()
+    {
+        LogCrashHandler::Unregister(this);
+    }
+
+    void BinaryLogAppender::beginLocked()
+    {
+        writeLocked(LogLevel::UNKNOWN, binlog::MAGIC, sizeof(binlog::MAGIC));
+        m_sites.clear();
+    }
+
+    void BinaryLogAppender::log(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event)
+    {
+        if (level >= m_level)
+        {
+            BinLogRecord r;
+            r.len = 0;
+            r.type = BinLogRecord::TEXT;
+            r.level = level;
+            r.reserved = 0;
+            r.time = event->getTime();
+            r.nsec = event->getNanoseconds();
+            r.site = 0;
+            r.tid = event->getThreadId();
+            r.fid = event->getFiberId();
+            r.elapse = event->getElapse();
+
+            static thread_local std::string t_record;
+            t_record.assign((const char *)&r, sizeof(r));
+            binlog::PutU32(t_record, event->getLine());
+            binlog::PutString(t_record, logger->getName().data(), logger->getName().size());
+            const char *file = event->getFile() ? event->getFile() : "";
+            binlog::PutString(t_record, file, strlen(file));
+            binlog::PutString(t_record, event->getContentData(), event->getContentSize());
+            uint32_t len = t_record.size();
+            memcpy(&t_record[0], &len, sizeof(len));
+            formatted(len);
+
+            Mutex::Lock lock(m_mutex);
+            if (m_size == 0)
+            {
+                beginLocked();
+            }
+            writeLocked(level, t_record.data(), t_record.size());
+        }
+    }
+
+    void BinaryLogAppender::logBinary(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const BinLogSite &site, const char *data, size_t len)
+    {
+        if (level >= m_level)
+        {
+            // the record is the encoded event
+            formatted(len);
+            Mutex::Lock lock(m_mutex);
+            if (m_size == 0)
+            {
+                beginLocked();
+            }
+            if (site.id >= m_sites.size() || m_sites[site.id] != logger.get())
+            {
+                // the site is new to this file or logs to another logger
+                if (site.id >= m_sites.size())
+                {
+                    m_sites.resize(site.id + 1);
+                }
+                m_sites[site.id] = logger.get();
+
+                BinLogRecord r;
+                memset(&r, 0, sizeof(r));
+                r.type = BinLogRecord::SITE;
+                r.site = site.id;
+                std::string def((const char *)&r, sizeof(r));
+                binlog::PutU32(def, site.line);
+                binlog::PutString(def, logger->getName().data(), logger->getName().size());
+                binlog::PutString(def, site.file, strlen(site.file));
+                binlog::PutString(def, site.fmt, strlen(site.fmt));
+                uint32_t def_len = def.size();
+                memcpy(&def[0], &def_len, sizeof(def_len));
+                writeLocked(LogLevel::UNKNOWN, def.data(), def.size());
+            }
+            writeLocked(level, data, len);
+        }
+    }
+
+    void BinaryLogAppender::drainUnsafe(const char *data, size_t len)
+    {
+        // built on the stack, without the lock
+        char record[512];
+        size_t size = 0;
+        if (m_size == 0)
+        {
+            memcpy(record, binlog::MAGIC, sizeof(binlog::MAGIC));
+            size = sizeof(binlog::MAGIC);
+        }
+        if (len)
+        {
+            BinLogRecord r;
+            memset(&r, 0, sizeof(r));
+            r.type = BinLogRecord::TEXT;
+            r.level = LogLevel::FATAL;
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            r.time = ts.tv_sec;
+            r.nsec = ts.tv_nsec;
+            r.tid = GetThreadId();
+            if (data[len - 1] == '\n')
+            {
+                --len;
+            }
+            // line, logger "crash", file "" and the message
+            const char logger[] = "crash";
+            uint32_t body = sizeof(uint32_t) * 4 + sizeof(logger) - 1;
+            uint32_t msg = std::min(len, sizeof(record) - size - sizeof(r) - body);
+            r.len = sizeof(r) + body + msg;
+            uint32_t fields[] = {0, sizeof(logger) - 1};
+            memcpy(record + size, &r, sizeof(r));
+            size += sizeof(r);
+            memcpy(record + size, fields, sizeof(fields));
+            size += sizeof(fields);
+            memcpy(record + size, logger, sizeof(logger) - 1);
+            size += sizeof(logger) - 1;
+            uint32_t strs[] = {0, msg};
+            memcpy(record + size, strs, sizeof(strs));
+            size += sizeof(strs);
+            memcpy(record + size, data, msg);
+            size += msg;
+        }
+        flushLocked(record, size);
+    }
+
+    std::string BinaryLogAppender::toYamlString()
+    {
+        YAML::Node node = YAML::Load(FileLogAppender::toYamlString());
+        node["type"] = "BinaryLogAppender";
+        std::stringstream ss;
+        ss << node;
+        return ss.str();
+    }
+
+    /*********************************
+     * class BinLogDecoder
+     *********************************/
+
+    BinLogDecoder::BinLogDecoder(std::shared_ptr<LogFormatter> formatter)
+        : m_formatter(formatter)
+    {
+    }
+
+    const std::shared_ptr<Logger> &BinLogDecoder::getLogger(const std::string &name)
+    {
+        auto &logger = m_loggers[name];
+        if (!logger)
+        {
+            logger.reset(new Logger(name));
+        }
+        return logger;
+    }
+
+    bool BinLogDecoder::decode(std::istream &in, std::ostream &out)
+    {
+        char magic[sizeof(binlog::MAGIC)];
+        if (!in.read(magic, sizeof(magic)) || memcmp(magic, binlog::MAGIC, sizeof(magic)) != 0)
+        {
+            return false;
+        }
+        // the ids of the sites are only valid in one file
+        m_sites.clear();
+
+        std::string body;
+        while (true)
+        {
+            BinLogRecord r;
+            if (!in.read((char *)&r, sizeof(r)))
+            {
+                return in.gcount() == 0;
+            }
+            if (r.len < sizeof(r))
+            {
+                return false;
+            }
+            body.resize(r.len - sizeof(r));
+            if (!in.read(&body[0], body.size()))
+            {
+                return false;
+            }
+
+            binlog::BodyReader reader(body);
+            LogLevel::Level level = (LogLevel::Level)r.level;
+            if (r.type == BinLogRecord::SITE)
+            {
+                uint32_t line;
+                std::string name;
+                Site site;
+                if (!reader.u32(line) || !reader.str(name) || !reader.str(site.file) || !reader.str(site.fmt))
+                {
+                    return false;
+                }
+                site.line = line;
+                site.logger = getLogger(name);
+                m_sites[r.site] = site;
+            }
+            else if (r.type == BinLogRecord::EVENT)
+            {
+                auto it = m_sites.find(r.site);
+                if (it == m_sites.end())
+                {
+                    continue;
+                }
+                Site &site = it->second;
+                std::shared_ptr<LogEvent> event(new LogEvent(site.logger, level, site.file.c_str(), site.line, r.elapse, r.tid, r.fid, r.time, r.nsec));
+                binlog::Format(event->getSS(), site.fmt.c_str(), body.data(), body.size());
+                out << m_formatter->format(site.logger, level, event);
+            }
+            else if (r.type == BinLogRecord::TEXT)
+            {
+                uint32_t line;
+                std::string name, file, message;
+                if (!reader.u32(line) || !reader.str(name) || !reader.str(file) || !reader.str(message))
+                {
+                    return false;
+                }
+                auto &logger = getLogger(name);
+                std::shared_ptr<LogEvent> event(new LogEvent(logger, level, file.c_str(), line, r.elapse, r.tid, r.fid, r.time, r.nsec));
+                event->getSS().append(message);
+                out << m_formatter->format(logger, level, event);
+            }
+        }
+    }
+}
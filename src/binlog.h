@@ -0,0 +1,233 @@
+/*
+    Binary logging:
+        ZCSERVER_LOG_BIN_FMT_* record the id of the call site and the raw bytes of the
+        arguments instead of formatting the message. The format string, the file and
+        the line are kept once in a static BinLogSite of the call site.
+
+        - A BinaryLogAppender writes the records to a file, and a definition of every
+          call site the first time it is seen. zclog-decode turns the file back into
+          text with any LogFormatter pattern.
+        - Other appenders decode the record into a LogEvent and format it as usual.
+
+        With -DZCSERVER_LOG_BINARY the ZCSERVER_LOG_FMT_* macros use this path, the
+        format string must then be a string literal.
+*/
+
+#ifndef __ZCSERVER_BINLOG_H__
+#define __ZCSERVER_BINLOG_H__
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <type_traits>
+#include "log.h"
+
+#define ZCSERVER_LOG_BIN_FMT_LEVEL(logger, level, fmt, ...) \
+    ZCSERVER_LOG_IF_ENABLED(logger, level) \
+        zcserver::BinLog(logger, level, []() -> const zcserver::BinLogSite & { \
+            static const zcserver::BinLogSite s(fmt, __FILE__, __LINE__); return s; }(), __VA_ARGS__)
+
+#define ZCSERVER_LOG_BIN_FMT_DEBUG(logger, fmt, ...) ZCSERVER_LOG_BIN_FMT_LEVEL(logger, zcserver::LogLevel::DEBUG, fmt, __VA_ARGS__)
+#define ZCSERVER_LOG_BIN_FMT_INFO(logger, fmt, ...) ZCSERVER_LOG_BIN_FMT_LEVEL(logger, zcserver::LogLevel::INFO, fmt, __VA_ARGS__)
+#define ZCSERVER_LOG_BIN_FMT_WARN(logger, fmt, ...) ZCSERVER_LOG_BIN_FMT_LEVEL(logger, zcserver::LogLevel::WARN, fmt, __VA_ARGS__)
+#define ZCSERVER_LOG_BIN_FMT_ERROR(logger, fmt, ...) ZCSERVER_LOG_BIN_FMT_LEVEL(logger, zcserver::LogLevel::ERROR, fmt, __VA_ARGS__)
+#define ZCSERVER_LOG_BIN_FMT_FATAL(logger, fmt, ...) ZCSERVER_LOG_BIN_FMT_LEVEL(logger, zcserver::LogLevel::FATAL, fmt, __VA_ARGS__)
+
+namespace zcserver
+{
+    // the static part of a log statement
+    struct BinLogSite
+    {
+        const char *fmt;
+        const char *file;
+        int32_t line;
+        uint32_t id;                        // unique in the process, starts from 1
+
+        BinLogSite(const char *fmt, const char *file, int32_t line);
+    };
+
+    // fixed part of every record in a binary log, followed by
+    //      EVENT   the arguments, each as a Tag and its bytes
+    //      SITE    line, logger name, file, format string
+    //      TEXT    line, logger name, file, message
+    // a string is a uint32_t length and the bytes
+    struct BinLogRecord
+    {
+        enum Type
+        {
+            EVENT = 1,
+            SITE = 2,
+            TEXT = 3
+        };
+
+        uint32_t len;                       // bytes of the record including this header
+        uint8_t type;
+        uint8_t level;
+        uint16_t reserved;
+        uint64_t time;
+        uint32_t nsec;
+        uint32_t site;
+        uint32_t tid;
+        uint32_t fid;
+        uint32_t elapse;
+    };
+
+    namespace binlog
+    {
+        // the magic at the beginning of a binary log file
+        static const char MAGIC[8] = {'Z', 'C', 'L', 'O', 'G', 0, 0, 1};
+
+        enum Tag
+        {
+            INT32 = 1,
+            UINT32 = 2,
+            INT64 = 3,
+            UINT64 = 4,
+            DOUBLE = 5,
+            STRING = 6,
+            POINTER = 7
+        };
+
+        template<class V>
+        inline void Put(LogStream &os, Tag tag, V v)
+        {
+            char *p = os.prepare(1 + sizeof(V));
+            *p = (char)tag;
+            memcpy(p + 1, &v, sizeof(V));
+            os.commit(1 + sizeof(V));
+        }
+
+        inline void PutString(LogStream &os, const char *str, uint32_t len)
+        {
+            char *p = os.prepare(1 + sizeof(len) + len);
+            *p = (char)STRING;
+            memcpy(p + 1, &len, sizeof(len));
+            memcpy(p + 1 + sizeof(len), str, len);
+            os.commit(1 + sizeof(len) + len);
+        }
+
+        // integers are widened the way printf arguments are promoted
+        template<class T>
+        inline typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type Encode(LogStream &os, T v)
+        {
+            if (sizeof(T) <= sizeof(int32_t))
+            {
+                if (std::is_signed<T>::value)
+                    Put(os, INT32, (int32_t)v);
+                else
+                    Put(os, UINT32, (uint32_t)v);
+            }
+            else
+            {
+                if (std::is_signed<T>::value)
+                    Put(os, INT64, (int64_t)v);
+                else
+                    Put(os, UINT64, (uint64_t)v);
+            }
+        }
+
+        template<class T>
+        inline typename std::enable_if<std::is_floating_point<T>::value>::type Encode(LogStream &os, T v)
+        {
+            Put(os, DOUBLE, (double)v);
+        }
+
+        template<class T>
+        inline void Encode(LogStream &os, const T *v)
+        {
+            Put(os, POINTER, (uint64_t)(uintptr_t)v);
+        }
+
+        inline void Encode(LogStream &os, const char *v)
+        {
+            if (!v)
+            {
+                v = "(null)";
+            }
+            PutString(os, v, strlen(v));
+        }
+
+        inline void Encode(LogStream &os, const std::string &v)
+        {
+            PutString(os, v.data(), v.size());
+        }
+
+        inline void EncodeAll(LogStream &os) {}
+
+        template<class T, class... Args>
+        inline void EncodeAll(LogStream &os, const T &v, const Args &... args)
+        {
+            Encode(os, v);
+            EncodeAll(os, args...);
+        }
+
+        // write the fixed part of an EVENT record to the stream of the thread
+        LogStream &Begin(LogLevel::Level level, const BinLogSite &site);
+        // complete the record and hand it to the logger
+        void End(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const BinLogSite &site, LogStream &os);
+
+        // format the encoded arguments with the printf format string
+        void Format(std::ostream &os, const char *fmt, const char *args, size_t len);
+    }
+
+    template<class... Args>
+    inline void BinLog(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const BinLogSite &site, const Args &... args)
+    {
+        LogStream &os = binlog::Begin(level, site);
+        binlog::EncodeAll(os, args...);
+        binlog::End(logger, level, site, os);
+    }
+
+    /*
+        BinaryLogAppender:
+            Write the records as they are. The definition of a call site is written
+            before its first record in the file, and again when it logs to another
+            logger. Lines from ZCSERVER_LOG_* are kept as TEXT records.
+            The file is buffered and flushed like a FileLogAppender.
+    */
+    class BinaryLogAppender : public FileLogAppender
+    {
+    private:
+        std::vector<const Logger *> m_sites;  // the logger each site is defined with, by id
+
+        // start a new file with the magic, m_mutex held
+        void beginLocked();
+
+    public:
+        BinaryLogAppender(const std::string &filename);
+        ~BinaryLogAppender();
+        void log(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override;
+        // lines are kept as TEXT records of the message, not formatted
+        bool sharesFormat(const Logger &logger) const override { return false; }
+        void logBinary(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const BinLogSite &site, const char *data, size_t len) override;
+        // data is written as a TEXT record
+        void drainUnsafe(const char *data, size_t len) override;
+        std::string toYamlString() override;
+    };
+
+    // BinLogDecoder: format the records of a binary log as text
+    class BinLogDecoder
+    {
+    private:
+        struct Site
+        {
+            std::shared_ptr<Logger> logger;
+            std::string file;
+            int32_t line;
+            std::string fmt;
+        };
+
+        std::shared_ptr<LogFormatter> m_formatter;
+        std::map<uint32_t, Site> m_sites;
+        std::map<std::string, std::shared_ptr<Logger>> m_loggers;
+
+        const std::shared_ptr<Logger> &getLogger(const std::string &name);
+
+    public:
+        BinLogDecoder(std::shared_ptr<LogFormatter> formatter);
+        // false if in is not a binary log or ends in the middle of a record
+        bool decode(std::istream &in, std::ostream &out);
+    };
+}
+
+#endif
@@ -7,8 +7,9 @@ namespace zcserver
 
     ConfigVarBase::ptr Config::LookupBase(const std::string &name)
     {
-        auto it = s_datas.find(name);
-        return it == s_datas.end() ? nullptr : it->second;
+        // Lookup() registers into GetDatas(), search the same map
+        auto it = GetDatas().find(name);
+        return it == GetDatas().end() ? nullptr : it->second;
     }
 
     // List all members in a yaml node and store them to the output list
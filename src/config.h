@@ -61,6 +61,27 @@ namespace zcserver
         }
     };
 
+    // yaml writes a bool as true/false, lexical_cast only reads 1/0
+    template <>
+    class LexicalCast<std::string, bool>
+    {
+    public:
+        bool operator()(const std::string &v)
+        {
+            return YAML::Load(v).as<bool>();
+        }
+    };
+
+    template <>
+    class LexicalCast<bool, std::string>
+    {
+    public:
+        std::string operator()(const bool &v)
+        {
+            return v ? "true" : "false";
+        }
+    };
+
     // partial specification 偏特化
     // specifically transfer std::string to std::vector<T>
     template <class T>
@@ -0,0 +1,392 @@
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <new>
+#include "fiber.h"
+#include "config.h"
+#include "log.h"
+
+#if defined(__x86_64__)
+// save the callee-saved registers, mxcsr and the x87 control word on the stack,
+// store the stack pointer to *from, and resume the stack saved in to
+extern "C" void zcserver_fiber_switch(void **from, void *to);
+// the first return of a new stack lands here, r12 holds the fiber and r13 the function
+extern "C" void zcserver_fiber_start();
+
+asm(R"(
+    .text
+    .globl zcserver_fiber_switch
+    .hidden zcserver_fiber_switch
+    .type zcserver_fiber_switch, @function
+zcserver_fiber_switch:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size zcserver_fiber_switch, .-zcserver_fiber_switch
+
+    .globl zcserver_fiber_start
+    .hidden zcserver_fiber_start
+    .type zcserver_fiber_start, @function
+zcserver_fiber_start:
+    .cfi_startproc
+    .cfi_undefined rip
+    movq %r12, %rdi
+    callq *%r13
+    ud2
+    .cfi_endproc
+    .size zcserver_fiber_start, .-zcserver_fiber_start
+)");
+#endif
+
+namespace zcserver
+{
+    static std::shared_ptr<Logger> g_logger = ZCSERVER_LOG_NAME("system");
+
+    static ConfigVar<uint32_t>::ptr g_fiber_stack_size =
+        Config::Lookup("fiber.stack_size", (uint32_t)(128 * 1024), "bytes of the stack of a fiber");
+    static ConfigVar<uint32_t>::ptr g_fiber_stack_pool =
+        Config::Lookup("fiber.stack_pool", (uint32_t)64, "stacks of fiber.stack_size each thread keeps for its next fibers");
+
+    static std::atomic<uint64_t> s_fiber_id{0};
+    static std::atomic<uint64_t> s_fiber_count{0};
+    static std::atomic<size_t> s_local_keys{0};
+
+    // the running fiber
+    static thread_local Fiber *t_fiber = nullptr;
+    // the main fiber, alive as long as the thread
+    static thread_local Fiber::ptr t_thread_fiber = nullptr;
+
+    /*********************************
+     * class StackPool
+     *********************************/
+    // the stacks of the default size freed by the fibers of a thread
+    class StackPool
+    {
+    public:
+        ~StackPool()
+        {
+            t_alive = false;
+            for (auto i : m_stacks)
+            {
+                Unmap(i, m_size);
+            }
+        }
+
+        static char *Allocate(size_t size)
+        {
+            if (t_alive)
+            {
+                StackPool &pool = Get();
+                if (size == pool.m_size && !pool.m_stacks.empty())
+                {
+                    char *stack = pool.m_stacks.back();
+                    pool.m_stacks.pop_back();
+                    return stack;
+                }
+            }
+            return Map(size);
+        }
+
+        static void Release(char *stack, size_t size)
+        {
+            // the pool may be gone already when a fiber dies at the exit of the thread
+            if (t_alive && size == g_fiber_stack_size->getValue())
+            {
+                StackPool &pool = Get();
+                if (pool.m_size != size)
+                {
+                    // the default changed, the old stacks are not reused
+                    for (auto i : pool.m_stacks)
+                    {
+                        Unmap(i, pool.m_size);
+                    }
+                    pool.m_stacks.clear();
+                    pool.m_size = size;
+                }
+                if (pool.m_stacks.size() < g_fiber_stack_pool->getValue())
+                {
+                    pool.m_stacks.push_back(stack);
+                    return;
+                }
+            }
+            Unmap(stack, size);
+        }
+
+        static size_t PageSize()
+        {
+            static size_t s_page = sysconf(_SC_PAGESIZE);
+            return s_page;
+        }
+
+    private:
+        static StackPool &Get()
+        {
+            static thread_local StackPool t_pool;
+            return t_pool;
+        }
+
+        // size bytes and a guard page below them
+        static char *Map(size_t size)
+        {
+            size_t page = PageSize();
+            void *base = mmap(nullptr, size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            if (base == MAP_FAILED)
+            {
+                ZCSERVER_LOG_ERROR(g_logger) << "mmap fiber stack fail, size=" << size << " errno=" << errno;
+                throw std::bad_alloc();
+            }
+            if (mprotect(base, page, PROT_NONE))
+            {
+                ZCSERVER_LOG_ERROR(g_logger) << "mprotect fiber stack guard fail, errno=" << errno;
+            }
+            return (char *)base + page;
+        }
+
+        static void Unmap(char *stack, size_t size)
+        {
+            size_t page = PageSize();
+            munmap(stack - page, size + page);
+        }
+
+        static thread_local bool t_alive;
+
+        std::vector<char *> m_stacks;
+        size_t m_size = 0;
+    };
+
+    thread_local bool StackPool::t_alive = true;
+
+    /*********************************
+     * class Fiber
+     *********************************/
+    Fiber::Fiber()
+    {
+        m_state = EXEC;
+        SetThis(this);
+        ++s_fiber_count;
+    }
+
+    Fiber::Fiber(std::function<void()> cb, size_t stacksize)
+        : m_id(++s_fiber_id), m_cb(cb)
+    {
+        size_t page = StackPool::PageSize();
+        m_stacksize = stacksize ? stacksize : g_fiber_stack_size->getValue();
+        m_stacksize = (m_stacksize + page - 1) / page * page;
+        m_stack = StackPool::Allocate(m_stacksize);
+        makeContext();
+        ++s_fiber_count;
+    }
+
+    Fiber::~Fiber()
+    {
+        --s_fiber_count;
+        clearLocals();
+        if (m_stack)
+        {
+            if (m_state != INIT && m_state != TERM && m_state != EXCEPT)
+            {
+                // the objects on its stack are never destroyed
+                ZCSERVER_LOG_ERROR(g_logger) << "fiber destroyed while suspended, fiber_id=" << m_id << " state=" << m_state;
+            }
+            StackPool::Release(m_stack, m_stacksize);
+        }
+        else if (t_fiber == this)
+        {
+            SetThis(nullptr);
+        }
+    }
+
+    void Fiber::reset(std::function<void()> cb)
+    {
+        if (!m_stack || (m_state != INIT && m_state != TERM && m_state != EXCEPT))
+        {
+            ZCSERVER_LOG_ERROR(g_logger) << "fiber reset in a wrong state, fiber_id=" << m_id << " state=" << m_state;
+            return;
+        }
+        clearLocals();
+        m_mdc.clear();
+        m_cb = cb;
+        makeContext();
+        m_state = INIT;
+    }
+
+    void Fiber::makeContext()
+    {
+#if defined(__x86_64__)
+        // the frame zcserver_fiber_switch pops, returning into zcserver_fiber_start
+        // with the stack 16-byte aligned for its call
+        uint64_t *sp = (uint64_t *)((uintptr_t)(m_stack + m_stacksize) & ~(uintptr_t)15);
+        *--sp = (uint64_t)(uintptr_t)&zcserver_fiber_start;
+        *--sp = 0;                                  // rbp
+        *--sp = 0;                                  // rbx
+        *--sp = (uint64_t)(uintptr_t)this;          // r12
+        *--sp = (uint64_t)(uintptr_t)&MainFunc;     // r13
+        *--sp = 0;                                  // r14
+        *--sp = 0;                                  // r15
+        *--sp = 0x0000037f00001f80ul;               // default x87 control word and mxcsr
+        m_sp = sp;
+#else
+        getcontext(&m_ctx);
+        m_ctx.uc_link = nullptr;
+        m_ctx.uc_stack.ss_sp = m_stack;
+        m_ctx.uc_stack.ss_size = m_stacksize;
+        makecontext(&m_ctx, &Fiber::ContextMain, 0);
+#endif
+    }
+
+    void Fiber::switchTo(Fiber *to)
+    {
+        // the MDC goes with the fiber, swapped without a copy
+        LogContext &context = LogContext::Get();
+        m_mdc.swap(context.mdc);
+        context.mdc.swap(to->m_mdc);
+        context.fid = to->m_id;
+        SetThis(to);
+#if defined(__x86_64__)
+        zcserver_fiber_switch(&m_sp, to->m_sp);
+#else
+        swapcontext(&m_ctx, &to->m_ctx);
+#endif
+    }
+
+    void Fiber::swapIn()
+    {
+        if (!t_thread_fiber)
+        {
+            GetThis();
+        }
+        m_state = EXEC;
+        t_thread_fiber->switchTo(this);
+    }
+
+    void Fiber::swapOut()
+    {
+        switchTo(t_thread_fiber.get());
+    }
+
+    void Fiber::SetThis(Fiber *f)
+    {
+        t_fiber = f;
+    }
+
+    Fiber::ptr Fiber::GetThis()
+    {
+        if (t_fiber)
+        {
+            return t_fiber->shared_from_this();
+        }
+        t_thread_fiber.reset(new Fiber);
+        return t_thread_fiber;
+    }
+
+    void Fiber::YieldToReady()
+    {
+        Fiber *cur = t_fiber;
+        if (cur && cur != t_thread_fiber.get())
+        {
+            cur->m_state = READY;
+            cur->swapOut();
+        }
+    }
+
+    void Fiber::YieldToHold()
+    {
+        Fiber *cur = t_fiber;
+        if (cur && cur != t_thread_fiber.get())
+        {
+            cur->m_state = HOLD;
+            cur->swapOut();
+        }
+    }
+
+    uint64_t Fiber::TotalFibers()
+    {
+        return s_fiber_count;
+    }
+
+    uint64_t Fiber::GetFiberId()
+    {
+        return t_fiber ? t_fiber->m_id : 0;
+    }
+
+    void Fiber::MainFunc(Fiber *fiber)
+    {
+        try
+        {
+            fiber->m_cb();
+            fiber->m_cb = nullptr;
+            fiber->m_state = TERM;
+        }
+        catch (std::exception &ex)
+        {
+            fiber->m_cb = nullptr;
+            fiber->m_state = EXCEPT;
+            ZCSERVER_LOG_ERROR(g_logger) << "fiber except: " << ex.what() << " fiber_id=" << fiber->m_id;
+        }
+        catch (...)
+        {
+            fiber->m_cb = nullptr;
+            fiber->m_state = EXCEPT;
+            ZCSERVER_LOG_ERROR(g_logger) << "fiber except, fiber_id=" << fiber->m_id;
+        }
+        fiber->swapOut();
+        // a finished fiber is resumed only after reset()
+        abort();
+    }
+
+#if !defined(__x86_64__)
+    void Fiber::ContextMain()
+    {
+        MainFunc(t_fiber);
+    }
+#endif
+
+    size_t Fiber::NewLocalKey()
+    {
+        return s_local_keys++;
+    }
+
+    void *&Fiber::GetLocal(size_t key, void (*destroy)(void *))
+    {
+        Fiber *f = t_fiber ? t_fiber : GetThis().get();
+        if (f->m_locals.size() <= key)
+        {
+            f->m_locals.resize(key + 1, std::make_pair(nullptr, nullptr));
+        }
+        f->m_locals[key].second = destroy;
+        return f->m_locals[key].first;
+    }
+
+    void Fiber::clearLocals()
+    {
+        // a destructor may use fiber-local storage as well
+        std::vector<std::pair<void *, void (*)(void *)>> locals;
+        locals.swap(m_locals);
+        for (auto &i : locals)
+        {
+            if (i.first)
+            {
+                i.second(i.first);
+            }
+        }
+    }
+}
@@ -0,0 +1,141 @@
+/*
+    Fiber:
+        A stackful coroutine switched cooperatively on one thread.
+
+        - Each thread has a main fiber (id 0), created on the first GetThis().
+          swapIn() runs a fiber from the main fiber, swapOut() or a Yield*()
+          inside the fiber goes back to it.
+        - On x86-64 the switch saves the callee-saved registers and the stack
+          pointer only, elsewhere it is swapcontext.
+        - The stacks are mmap'd with a PROT_NONE guard page below them, an
+          overflow is a SIGSEGV instead of a corruption. Stacks of the default
+          size (fiber.stack_size) are kept in a per-thread pool for the next
+          fibers, up to fiber.stack_pool.
+        - A switch also switches the fiber id and the MDC of the LogContext of
+          the thread, so %F and %X follow the running fiber.
+*/
+
+#ifndef __ZCSERVER_FIBER_H__
+#define __ZCSERVER_FIBER_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+namespace zcserver
+{
+    class Fiber : public std::enable_shared_from_this<Fiber>
+    {
+    public:
+        typedef std::shared_ptr<Fiber> ptr;
+
+        enum State
+        {
+            INIT,           // not started
+            HOLD,           // yielded, resumed by the owner
+            EXEC,           // running
+            TERM,           // the callback returned
+            READY,          // yielded, to be resumed
+            EXCEPT          // the callback threw
+        };
+
+    private:
+        // the main fiber of a thread, running on the stack of the thread
+        Fiber();
+
+    public:
+        // stacksize 0 uses fiber.stack_size
+        Fiber(std::function<void()> cb, size_t stacksize = 0);
+        ~Fiber();
+
+        // run another callback on the stack of a fiber that is INIT, TERM or EXCEPT
+        void reset(std::function<void()> cb);
+        // switch from the main fiber of the thread to this one
+        void swapIn();
+        // switch from this fiber back to the main fiber
+        void swapOut();
+
+        uint64_t getId() const { return m_id; }
+        State getState() const { return m_state; }
+
+        // the running fiber of the thread, the main fiber if there is none
+        static Fiber::ptr GetThis();
+        // yield the running fiber as READY or HOLD
+        static void YieldToReady();
+        static void YieldToHold();
+        // fibers alive in the process, main fibers included
+        static uint64_t TotalFibers();
+        // the id of the running fiber, 0 on the main fiber or outside of fibers
+        static uint64_t GetFiberId();
+
+        // fiber-local storage, see FiberLocal
+        static size_t NewLocalKey();
+        // the slot of key in the running fiber, destroy runs on it with the fiber
+        static void *&GetLocal(size_t key, void (*destroy)(void *));
+
+    private:
+        Fiber(const Fiber &) = delete;
+        Fiber &operator=(const Fiber &) = delete;
+
+        static void SetThis(Fiber *f);
+        static void MainFunc(Fiber *fiber);
+        // MainFunc of the running fiber, the entry of makecontext
+        static void ContextMain();
+        // prepare m_stack to start in MainFunc
+        void makeContext();
+        // save this context and resume to, with the logging context of to
+        void switchTo(Fiber *to);
+        void clearLocals();
+
+        uint64_t m_id = 0;
+        size_t m_stacksize = 0;
+        State m_state = INIT;
+        char *m_stack = nullptr;            // lowest usable byte, the guard page is below
+#if defined(__x86_64__)
+        void *m_sp = nullptr;               // saved stack pointer
+#else
+        ucontext_t m_ctx;
+#endif
+        std::function<void()> m_cb;
+        // MDC of the LogContext while the fiber is not running
+        std::string m_mdc;
+        // fiber-local storage by key
+        std::vector<std::pair<void *, void (*)(void *)>> m_locals;
+    };
+
+    /*
+        FiberLocal:
+            A T for each fiber, and for the main fiber of each thread, created
+            on the first get() in that fiber and destroyed with it or when it
+            is reset().
+    */
+    template <class T>
+    class FiberLocal
+    {
+    public:
+        FiberLocal() : m_key(Fiber::NewLocalKey()) {}
+
+        T &get()
+        {
+            void *&slot = Fiber::GetLocal(m_key, &Destroy);
+            if (!slot)
+            {
+                slot = new T();
+            }
+            return *static_cast<T *>(slot);
+        }
+
+    private:
+        static void Destroy(void *p) { delete static_cast<T *>(p); }
+
+        size_t m_key;
+    };
+}
+
+#endif
@@ -3,8 +3,22 @@
 #include <map>
 #include <functional>
 #include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <execinfo.h>
+#include <glob.h>
+#include <zlib.h>
+#include <algorithm>
+#include <cmath>
 #include "util.h"
 #include "config.h"
+#include "binlog.h"
 
 namespace zcserver
 {
@@ -59,27 +73,654 @@ namespace zcserver
 #undef XX
     }
 
+    /*********************************
+     * class LogStreamBuf and LogStream
+     *********************************/
+    void LogStreamBuf::grow(size_t n)
+    {
+        size_t size = this->size();
+        size_t capacity = epptr() - pbase();
+        while (capacity < size + n)
+        {
+            capacity *= 2;
+        }
+        std::unique_ptr<char[]> heap(new char[capacity]);
+        memcpy(heap.get(), pbase(), size);
+        m_heap.swap(heap);
+        setp(m_heap.get(), m_heap.get() + capacity);
+        pbump((int)size);
+    }
+
+    char *LogStreamBuf::prepare(size_t n)
+    {
+        if ((size_t)(epptr() - pptr()) < n)
+        {
+            grow(n);
+        }
+        return pptr();
+    }
+
+    LogStreamBuf::int_type LogStreamBuf::overflow(int_type c)
+    {
+        if (traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            return traits_type::not_eof(c);
+        }
+        *prepare(1) = traits_type::to_char_type(c);
+        pbump(1);
+        return c;
+    }
+
+    std::streamsize LogStreamBuf::xsputn(const char *s, std::streamsize n)
+    {
+        memcpy(prepare(n), s, n);
+        pbump((int)n);
+        return n;
+    }
+
+    void LogStream::reset()
+    {
+        m_buf.reset();
+        clear();
+        flags(std::ios_base::skipws | std::ios_base::dec);
+        width(0);
+        precision(6);
+        fill(' ');
+    }
+
+    void LogStream::appendUInt(uint64_t v)
+    {
+        char tmp[20];
+        char *p = tmp + sizeof(tmp);
+        do
+        {
+            *--p = '0' + v % 10;
+            v /= 10;
+        } while (v);
+        append(p, tmp + sizeof(tmp) - p);
+    }
+
+    void LogStream::appendInt(int64_t v)
+    {
+        if (v < 0)
+        {
+            append("-", 1);
+            appendUInt(-(uint64_t)v);
+            return;
+        }
+        appendUInt(v);
+    }
+
+    // per-thread output of the formatters, reused by every event
+    static LogStream &FormatStream()
+    {
+        static thread_local LogStream t_stream;
+        t_stream.reset();
+        return t_stream;
+    }
+
+    // the line Logger::log() formats for the appenders sharing a formatter,
+    // apart from FormatStream() which the appenders may use while it is read
+    static LogStream &SharedFormatStream()
+    {
+        static thread_local LogStream t_stream;
+        t_stream.reset();
+        return t_stream;
+    }
+
+    /*********************************
+     * class LogContext and LogMDC
+     *********************************/
+    LogContext::LogContext()
+        : tid(GetThreadId()), fid(GetFiberId()), name(&Thread::GetName())
+    {
+    }
+
+    // the child of a fork runs in a new thread of its own, with the context of the forking one
+    static int s_context_atfork = pthread_atfork(nullptr, nullptr, []() {
+        LogContext::Get().tid = GetThreadId();
+    });
+
+    bool LogContext::Find(const char *mdc, size_t size, const char *key, size_t keyLen, const char *&value, size_t &len)
+    {
+        bool found = false;
+        ForEach(mdc, size, [&](const char *k, size_t kl, const char *v, size_t vl) {
+            if (kl == keyLen && memcmp(k, key, kl) == 0)
+            {
+                value = v;
+                len = vl;
+                found = true;
+            }
+        });
+        return found;
+    }
+
+    LogMDC::LogMDC(const char *key, size_t keyLen, const char *value, size_t len)
+    {
+        std::string &mdc = LogContext::Get().mdc;
+        m_size = mdc.size();
+        uint32_t n = keyLen;
+        mdc.append((const char *)&n, sizeof(n));
+        mdc.append(key, keyLen);
+        n = len;
+        mdc.append((const char *)&n, sizeof(n));
+        mdc.append(value, len);
+    }
+
+    LogMDC::~LogMDC()
+    {
+        LogContext::Get().mdc.resize(m_size);
+    }
+
     /*********************************
      * class LogEvent
      *********************************/
-    LogEvent::LogEvent(std::shared_ptr<Logger> logger, LogLevel::Level level, const char *file, int32_t line, uint32_t elapse, uint32_t tid, uint32_t fid, uint64_t time) : m_logger(logger), m_level(level), m_file(file), m_line(line), m_elapse(elapse), m_tid(tid), m_fid(fid), m_time(time) {}
+    LogEvent::LogEvent(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *file, int32_t line, uint32_t elapse, uint32_t tid, uint32_t fid, uint64_t time, uint32_t nsec) : m_logger(logger), m_level(level), m_file(file), m_line(line), m_elapse(elapse), m_tid(tid), m_fid(fid), m_time(time), m_nsec(nsec) {}
+
+    void LogEvent::reset(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *file, int32_t line, uint32_t elapse, uint32_t tid, uint32_t fid, uint64_t time, uint32_t nsec)
+    {
+        m_ss.reset();
+        m_threadName.clear();
+        m_fields.clear();
+        m_fieldText.clear();
+        m_mdc.clear();
+        m_logger = logger;
+        m_level = level;
+        m_file = file;
+        m_line = line;
+        m_elapse = elapse;
+        m_tid = tid;
+        m_fid = fid;
+        m_time = time;
+        m_nsec = nsec;
+    }
+
+    LogField &LogEvent::addField(LogField::Type type, const char *key)
+    {
+        size_t len = strlen(key);
+        m_fields.push_back(LogField());
+        LogField &field = m_fields.back();
+        field.type = type;
+        field.value.u = 0;
+        field.key = m_fieldText.size();
+        field.keyLen = len;
+        m_fieldText.append(key, len);
+        return field;
+    }
+
+    void LogEvent::addField(const char *key, const char *v, size_t len)
+    {
+        LogField &field = addField(LogField::STRING, key);
+        field.str = m_fieldText.size();
+        field.strLen = len;
+        m_fieldText.append(v, len);
+    }
+
+    // a few events per thread are enough
+    // more are only needed when logging while another event of the same thread is alive
+    static const size_t s_event_pool_size = 8;
+
+    std::shared_ptr<LogEvent> LogEvent::Create(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *file, int32_t line, uint32_t elapse, uint32_t tid, uint32_t fid)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+
+        // the pool holds one reference of each event
+        // use_count() == 1 means nobody else is using the event
+        static thread_local std::vector<std::shared_ptr<LogEvent>> t_pool;
+        std::shared_ptr<LogEvent> event;
+        for (auto &i : t_pool)
+        {
+            if (i.use_count() == 1)
+            {
+                // the last user may have been another thread
+                std::atomic_thread_fence(std::memory_order_acquire);
+                i->reset(logger, level, file, line, elapse, tid, fid, ts.tv_sec, ts.tv_nsec);
+                event = i;
+                break;
+            }
+        }
+        if (!event)
+        {
+            event.reset(new LogEvent(logger, level, file, line, elapse, tid, fid, ts.tv_sec, ts.tv_nsec));
+            if (t_pool.size() < s_event_pool_size)
+            {
+                t_pool.reserve(s_event_pool_size);
+                t_pool.push_back(event);
+            }
+        }
+        // copied into the storage the pooled event keeps
+        const LogContext &context = LogContext::Get();
+        event->m_threadName.assign(*context.name);
+        if (ZCSERVER_UNLIKELY(!context.mdc.empty()))
+        {
+            event->m_mdc.assign(context.mdc);
+        }
+        return event;
+    }
 
-    void LogEvent::format(const char *fmt, ...)
+    std::shared_ptr<LogEvent> LogEvent::Create(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *file, int32_t line)
     {
-        va_list al;
-        va_start(al, fmt);
-        format(fmt, al);
-        va_end(al);
+        const LogContext &context = LogContext::Get();
+        return Create(logger, level, file, line, 0, context.tid, context.fid);
     }
 
     void LogEvent::format(const char *fmt, va_list al)
     {
-        char *buf = nullptr;
-        int len = vasprintf(&buf, fmt, al);
-        if (len != -1)
+        // print straight into the content, retry once with enough room if it does not fit
+        va_list copy;
+        va_copy(copy, al);
+        size_t room = m_ss.available();
+        int len = vsnprintf(m_ss.prepare(room), room, fmt, copy);
+        va_end(copy);
+        if (len < 0)
+        {
+            return;
+        }
+        if ((size_t)len >= room)
+        {
+            vsnprintf(m_ss.prepare(len + 1), len + 1, fmt, al);
+        }
+        m_ss.commit(len);
+    }
+
+    /*********************************
+     * logfmt
+     *********************************/
+    namespace logfmt
+    {
+        // %[flags][width][.precision][length]conversion
+        struct Spec
+        {
+            bool minus = false;
+            bool plus = false;
+            bool space = false;
+            bool hash = false;
+            bool zero = false;
+            size_t width = 0;
+            int precision = -1;             // -1 if not given
+            int shorten = 0;                // 1 for h, 2 for hh
+            char conv = 0;
+        };
+
+        // [spaces][prefix][zeros][body][spaces], the field is at least spec.width wide
+        // zero padding replaces the leading spaces for numbers
+        static void Emit(LogStream &out, const Spec &spec, const char *prefix, size_t prefixLen, size_t zeros,
+                         const char *body, size_t len, bool numeric)
+        {
+            size_t total = prefixLen + zeros + len;
+            size_t fill = spec.width > total ? spec.width - total : 0;
+            if (numeric && spec.zero && !spec.minus)
+            {
+                zeros += fill;
+                fill = 0;
+            }
+            char *p = out.prepare(prefixLen + zeros + len + fill);
+            char *begin = p;
+            if (!spec.minus)
+            {
+                memset(p, ' ', fill);
+                p += fill;
+            }
+            if (prefixLen)
+                memcpy(p, prefix, prefixLen);
+            p += prefixLen;
+            memset(p, '0', zeros);
+            p += zeros;
+            memcpy(p, body, len);
+            p += len;
+            if (spec.minus)
+            {
+                memset(p, ' ', fill);
+                p += fill;
+            }
+            out.commit(p - begin);
+        }
+
+        // the sign of a signed conversion
+        static size_t Sign(const Spec &spec, bool negative, char *prefix)
+        {
+            if (negative)
+                *prefix = '-';
+            else if (spec.plus)
+                *prefix = '+';
+            else if (spec.space)
+                *prefix = ' ';
+            else
+                return 0;
+            return 1;
+        }
+
+        static void FormatInt(LogStream &out, const Spec &spec, const Arg &a)
+        {
+            char conv = spec.conv;
+            if (!strchr("diouxXc", conv))
+            {
+                conv = a.type == Arg::INT ? 'd' : 'u';
+            }
+            // the bits of the argument as printf would see them in its size
+            int bits = a.size * 8;
+            uint64_t raw = a.type == Arg::INT ? (uint64_t)a.i : a.u;
+            if (spec.shorten)
+            {
+                bits = spec.shorten == 1 ? 16 : 8;
+            }
+            if (bits < 64)
+            {
+                raw &= ((uint64_t)1 << bits) - 1;
+            }
+            if (conv == 'c')
+            {
+                char c = (char)raw;
+                Emit(out, spec, nullptr, 0, 0, &c, 1, false);
+                return;
+            }
+
+            bool negative = false;
+            uint64_t v = raw;
+            if (conv == 'd' || conv == 'i')
+            {
+                int64_t s = (int64_t)raw;
+                if (bits < 64 && (raw >> (bits - 1)) & 1)
+                {
+                    // sign extend
+                    s = (int64_t)(raw | ~(((uint64_t)1 << bits) - 1));
+                }
+                negative = s < 0;
+                v = negative ? -(uint64_t)s : (uint64_t)s;
+            }
+
+            char digits[24];
+            char *end = digits + sizeof(digits);
+            char *p = end;
+            if (v || spec.precision != 0)
+            {
+                unsigned base = conv == 'o' ? 8 : (conv == 'x' || conv == 'X') ? 16 : 10;
+                const char *chars = conv == 'X' ? "0123456789ABCDEF" : "0123456789abcdef";
+                do
+                {
+                    *--p = chars[v % base];
+                    v /= base;
+                } while (v);
+            }
+            size_t len = end - p;
+            size_t zeros = spec.precision > 0 && (size_t)spec.precision > len ? spec.precision - len : 0;
+
+            char prefix[2];
+            size_t prefixLen = 0;
+            if (conv == 'd' || conv == 'i')
+            {
+                prefixLen = Sign(spec, negative, prefix);
+            }
+            else if (spec.hash && conv == 'o' && !zeros && (len == 0 || *p != '0'))
+            {
+                zeros = 1;
+            }
+            else if (spec.hash && (conv == 'x' || conv == 'X') && raw)
+            {
+                prefix[0] = '0';
+                prefix[1] = conv;
+                prefixLen = 2;
+            }
+            // a precision turns off zero padding
+            Spec s = spec;
+            s.zero = spec.zero && spec.precision < 0;
+            Emit(out, s, prefix, prefixLen, zeros, p, len, true);
+        }
+
+        static const double POW10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+        static const uint64_t UPOW10[] = {1ul, 10ul, 100ul, 1000ul, 10000ul, 100000ul, 1000000ul,
+                                          10000000ul, 100000000ul, 1000000000ul};
+
+        // %f by integers when the rounding is certain, false to leave it to snprintf
+        // below 2^40 the product is off by at most 2^-13, so only a fraction that close
+        // to .5 may round the other way than the exact decimal value would
+        static bool FormatFixed(LogStream &out, const Spec &spec, double d)
+        {
+            int precision = spec.precision < 0 ? 6 : spec.precision;
+            if (precision > 9 || spec.hash || !std::isfinite(d))
+            {
+                return false;
+            }
+            double scaled = std::fabs(d) * POW10[precision];
+            if (scaled >= 1099511627776.0)
+            {
+                return false;
+            }
+            double whole = std::floor(scaled);
+            double frac = scaled - whole;
+            if (std::fabs(frac - 0.5) < 1.0 / 2048)
+            {
+                return false;
+            }
+            uint64_t q = (uint64_t)whole + (frac > 0.5);
+
+            char digits[32];
+            char *end = digits + sizeof(digits);
+            char *p = end;
+            uint64_t fraction = q % UPOW10[precision];
+            uint64_t integer = q / UPOW10[precision];
+            for (int i = 0; i < precision; ++i)
+            {
+                *--p = '0' + fraction % 10;
+                fraction /= 10;
+            }
+            if (precision)
+            {
+                *--p = '.';
+            }
+            do
+            {
+                *--p = '0' + integer % 10;
+                integer /= 10;
+            } while (integer);
+
+            char prefix[1];
+            size_t prefixLen = Sign(spec, std::signbit(d), prefix);
+            Emit(out, spec, prefix, prefixLen, 0, p, end - p, true);
+            return true;
+        }
+
+        // the spec again as a printf format
+        static void Rebuild(const Spec &spec, char conv, char *buf)
+        {
+            char *p = buf;
+            *p++ = '%';
+            if (spec.minus) *p++ = '-';
+            if (spec.plus) *p++ = '+';
+            if (spec.space) *p++ = ' ';
+            if (spec.hash) *p++ = '#';
+            if (spec.zero) *p++ = '0';
+            if (spec.width)
+                p += sprintf(p, "%zu", spec.width);
+            if (spec.precision >= 0)
+                p += sprintf(p, ".%d", spec.precision);
+            *p++ = conv;
+            *p = 0;
+        }
+
+        static void FormatDouble(LogStream &out, const Spec &spec, double d)
+        {
+            char conv = strchr("fFeEgGaA", spec.conv) ? spec.conv : 'g';
+            if ((conv == 'f' || conv == 'F') && FormatFixed(out, spec, d))
+            {
+                return;
+            }
+            char format[48];
+            Rebuild(spec, conv, format);
+            // most results fit, the rest is printed again with enough room
+            size_t room = 64;
+            int len = snprintf(out.prepare(room), room, format, d);
+            if (len < 0)
+            {
+                return;
+            }
+            if ((size_t)len >= room)
+            {
+                snprintf(out.prepare(len + 1), len + 1, format, d);
+            }
+            out.commit(len);
+        }
+
+        static void FormatString(LogStream &out, const Spec &spec, const char *str, size_t len)
+        {
+            if (spec.precision >= 0 && (size_t)spec.precision < len)
+            {
+                len = spec.precision;
+            }
+            Emit(out, spec, nullptr, 0, 0, str, len, false);
+        }
+
+        static void FormatPointer(LogStream &out, const Spec &spec, const void *ptr)
+        {
+            if (!ptr)
+            {
+                Emit(out, spec, nullptr, 0, 0, "(nil)", 5, false);
+                return;
+            }
+            char digits[16];
+            char *end = digits + sizeof(digits);
+            char *p = end;
+            uintptr_t v = (uintptr_t)ptr;
+            do
+            {
+                *--p = "0123456789abcdef"[v & 15];
+                v >>= 4;
+            } while (v);
+            Emit(out, spec, "0x", 2, 0, p, end - p, true);
+        }
+
+        void Format(LogStream &out, const char *fmt, const Arg *args, size_t count)
         {
-            m_ss << std::string(buf, 10);
-            free(buf);
+            size_t next = 0;
+            const char *p = fmt;
+            while (*p)
+            {
+                const char *q = strchr(p, '%');
+                if (!q)
+                {
+                    out.append(p);
+                    return;
+                }
+                out.append(p, q - p);
+                if (q[1] == '%')
+                {
+                    out.append("%", 1);
+                    p = q + 2;
+                    continue;
+                }
+
+                Spec spec;
+                const char *c = q + 1;
+                for (;; ++c)
+                {
+                    if (*c == '-')
+                        spec.minus = true;
+                    else if (*c == '+')
+                        spec.plus = true;
+                    else if (*c == ' ')
+                        spec.space = true;
+                    else if (*c == '#')
+                        spec.hash = true;
+                    else if (*c == '0')
+                        spec.zero = true;
+                    else if (*c != '\'')
+                        break;
+                }
+                if (*c == '*')
+                {
+                    ++c;
+                    if (next < count)
+                    {
+                        int64_t width = args[next].type == Arg::INT ? args[next].i : (int64_t)args[next].u;
+                        ++next;
+                        if (width < 0)
+                        {
+                            spec.minus = true;
+                            width = -width;
+                        }
+                        spec.width = width;
+                    }
+                }
+                while (*c >= '0' && *c <= '9')
+                {
+                    spec.width = spec.width * 10 + (*c++ - '0');
+                }
+                if (*c == '.')
+                {
+                    ++c;
+                    spec.precision = 0;
+                    if (*c == '*')
+                    {
+                        ++c;
+                        if (next < count)
+                        {
+                            int64_t precision = args[next].type == Arg::INT ? args[next].i : (int64_t)args[next].u;
+                            ++next;
+                            spec.precision = precision < 0 ? -1 : (int)precision;
+                        }
+                    }
+                    while (*c >= '0' && *c <= '9')
+                    {
+                        spec.precision = spec.precision * 10 + (*c++ - '0');
+                    }
+                }
+                if (c[0] == 'h')
+                {
+                    spec.shorten = c[1] == 'h' ? 2 : 1;
+                }
+                while (*c && strchr("hlLqjzt", *c))
+                {
+                    ++c;
+                }
+                spec.conv = *c;
+                if (!spec.conv)
+                {
+                    out.append(q);
+                    return;
+                }
+                p = c + 1;
+                if (next >= count)
+                {
+                    // keep the conversion of a missing argument as it is
+                    out.append(q, p - q);
+                    continue;
+                }
+
+                const Arg &a = args[next++];
+                switch (a.type)
+                {
+                case Arg::INT:
+                case Arg::UINT:
+                    FormatInt(out, spec, a);
+                    break;
+                case Arg::DOUBLE:
+                    FormatDouble(out, spec, a.d);
+                    break;
+                case Arg::STRING:
+                    if (spec.conv == 'p')
+                        FormatPointer(out, spec, a.p);
+                    else
+                        FormatString(out, spec, a.str, a.len);
+                    break;
+                case Arg::POINTER:
+                    if (strchr("diouxXc", spec.conv))
+                    {
+                        Arg u;
+                        u.type = Arg::UINT;
+                        u.size = sizeof(void *);
+                        u.u = (uintptr_t)a.p;
+                        FormatInt(out, spec, u);
+                    }
+                    else
+                    {
+                        FormatPointer(out, spec, a.p);
+                    }
+                    break;
+                case Arg::NONE:
+                    break;
+                }
+            }
         }
     }
 
@@ -111,6 +752,7 @@ namespace zcserver
                 if (m_pattern[i + 1] == '%')
                 {
                     nstr.append(1, '%');
+                    ++i;
                     continue;
                 }
             }
@@ -195,215 +837,3467 @@ namespace zcserver
             {"f", [](const std::string &fmt) { return std::shared_ptr<FormatItem>(new FilenameFormatItem(fmt)); }},
             {"l", [](const std::string &fmt) { return std::shared_ptr<FormatItem>(new LineFormatItem(fmt)); }},
             {"T", [](const std::string &fmt) { return std::shared_ptr<FormatItem>(new TabFormatItem(fmt)); }},
-            {"F", [](const std::string &fmt) { return std::shared_ptr<FormatItem>(new FiberIdFormatItem(fmt)); }}};
+            {"F", [](const std::string &fmt) { return std::shared_ptr<FormatItem>(new FiberIdFormatItem(fmt)); }},
+            {"J", [](const std::string &fmt) { return std::shared_ptr<FormatItem>(new JsonFormatItem(fmt)); }},
+            {"K", [](const std::string &fmt) { return std::shared_ptr<FormatItem>(new LogfmtFormatItem(fmt)); }},
+            {"N", [](const std::string &fmt) { return std::shared_ptr<FormatItem>(new ThreadNameFormatItem(fmt)); }},
+            {"X", [](const std::string &fmt) { return std::shared_ptr<FormatItem>(new MdcFormatItem(fmt)); }}};
+
+        // map: string -> opcode of the built-in items
+        static std::map<std::string, uint32_t> s_opcodes = {
+            {"m", OP_MESSAGE},
+            {"p", OP_LEVEL},
+            {"r", OP_ELAPSE},
+            {"c", OP_NAME},
+            {"t", OP_THREAD_ID},
+            {"d", OP_DATETIME},
+            {"f", OP_FILENAME},
+            {"l", OP_LINE},
+            {"F", OP_FIBER_ID},
+            {"J", OP_JSON},
+            {"K", OP_LOGFMT},
+            {"N", OP_THREAD_NAME},
+            {"X", OP_MDC}};
 
+        auto &custom_items = GetCustomItems();
         for (auto &i : vec)
         {
             if (std::get<2>(i) == 0)
             {
                 m_items.push_back(std::shared_ptr<FormatItem>(new StringFormatItem(std::get<0>(i))));
+                emit(OP_LITERAL, 0, std::get<0>(i));
+                continue;
+            }
+
+            auto custom = custom_items.find(std::get<0>(i));
+            if (custom != custom_items.end())
+            {
+                m_items.push_back(custom->second(std::get<1>(i)));
+                emit(OP_CUSTOM, m_items.size() - 1);
+                continue;
+            }
+
+            auto it = s_format_items.find(std::get<0>(i));
+            if (it == s_format_items.end())
+            {
+                std::string error = "<<error_format %" + std::get<0>(i) + ">>";
+                m_items.push_back(std::shared_ptr<FormatItem>(new StringFormatItem(error)));
+                emit(OP_LITERAL, 0, error);
+                m_error = true;
+                continue;
+            }
+
+            m_items.push_back(it->second(std::get<1>(i)));
+            if (std::get<0>(i) == "T")
+            {
+                emit(OP_LITERAL, 0, "\t");
+            }
+            else if (std::get<0>(i) == "n")
+            {
+                emit(OP_LITERAL, 0, "\n");
             }
             else
             {
-                auto it = s_format_items.find(std::get<0>(i));
-                if (it == s_format_items.end())
-                {
-                    m_items.push_back(std::shared_ptr<FormatItem>(new StringFormatItem("<<error_format %" + std::get<0>(i) + ">>")));
-                    m_error = true;
-                }
-                else
-                {
-                    m_items.push_back(it->second(std::get<1>(i)));
-                }
+                emit(s_opcodes[std::get<0>(i)], m_items.size() - 1);
             }
         }
     }
 
-    std::string LogFormatter::format(std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event)
+    void LogFormatter::emit(uint32_t code, uint32_t arg, const std::string &literal)
+    {
+        if (code == OP_LITERAL)
+        {
+            if (literal.empty())
+            {
+                return;
+            }
+            // extend the previous span, it always ends at the end of m_literals
+            if (!m_program.empty() && m_program.back().code == OP_LITERAL)
+            {
+                m_program.back().len += literal.size();
+            }
+            else
+            {
+                m_program.push_back(Op{OP_LITERAL, (uint32_t)m_literals.size(), (uint32_t)literal.size()});
+            }
+            m_literals.append(literal);
+            return;
+        }
+        m_program.push_back(Op{code, arg, 0});
+    }
+
+    std::map<std::string, LogFormatter::ItemFactory> &LogFormatter::GetCustomItems()
+    {
+        static std::map<std::string, ItemFactory> s_custom_items;
+        return s_custom_items;
+    }
+
+    void LogFormatter::AddFormatItem(const std::string &key, ItemFactory factory)
+    {
+        GetCustomItems()[key] = factory;
+    }
+
+    std::string LogFormatter::format(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event)
+    {
+        LogStream &out = FormatStream();
+        format(out, logger, level, event);
+        return std::string(out.data(), out.size());
+    }
+
+    void LogFormatter::format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event)
+    {
+        for (auto &i : m_items)
+        {
+            // using subclass method "format"
+            i->format(os, logger, level, event);
+        }
+    }
+
+    void LogFormatter::format(LogStream &out, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event)
+    {
+        for (auto &op : m_program)
+        {
+            switch (op.code)
+            {
+            case OP_LITERAL:
+                out.append(m_literals.data() + op.arg, op.len);
+                break;
+            case OP_MESSAGE:
+                out.append(event->getContentData(), event->getContentSize());
+                break;
+            case OP_LEVEL:
+                out.append(LogLevel::ToString(level));
+                break;
+            case OP_ELAPSE:
+                out.appendUInt(event->getElapse());
+                break;
+            case OP_NAME:
+                // the event logger, not the root logger used for the output
+                out.append(event->getLogger()->getName());
+                break;
+            case OP_THREAD_ID:
+                out.appendUInt(event->getThreadId());
+                break;
+            case OP_FIBER_ID:
+                out.appendUInt(event->getFiberId());
+                break;
+            case OP_DATETIME:
+                static_cast<DateTimeFormatItem *>(m_items[op.arg].get())->append(out, *event);
+                break;
+            case OP_FILENAME:
+                out.append(event->getFile());
+                break;
+            case OP_LINE:
+                out.appendInt(event->getLine());
+                break;
+            case OP_JSON:
+                static_cast<JsonFormatItem *>(m_items[op.arg].get())->append(out, level, *event);
+                break;
+            case OP_LOGFMT:
+                LogfmtFormatItem::Append(out, *event);
+                break;
+            case OP_THREAD_NAME:
+                out.append(event->getThreadName());
+                break;
+            case OP_MDC:
+                static_cast<MdcFormatItem *>(m_items[op.arg].get())->append(out, *event);
+                break;
+            default:
+                m_items[op.arg]->format(out, logger, level, event);
+                break;
+            }
+        }
+    }
+
+    /*********************************
+     * class MdcFormatItem
+     *********************************/
+    void MdcFormatItem::format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event)
+    {
+        LogStream &out = FormatStream();
+        append(out, *event);
+        os.write(out.data(), out.size());
+    }
+
+    void MdcFormatItem::append(LogStream &out, const LogEvent &event)
+    {
+        const std::string &mdc = event.getMdc();
+        if (!m_key.empty())
+        {
+            const char *value;
+            size_t len;
+            if (LogContext::Find(mdc.data(), mdc.size(), m_key.data(), m_key.size(), value, len))
+            {
+                out.append(value, len);
+            }
+            return;
+        }
+        bool first = true;
+        LogContext::ForEach(mdc.data(), mdc.size(), [&](const char *key, size_t keyLen, const char *value, size_t len) {
+            if (!first)
+            {
+                out.append(" ", 1);
+            }
+            first = false;
+            out.append(key, keyLen);
+            out.append("=", 1);
+            out.append(value, len);
+        });
+    }
+
+    /*********************************
+     * class JsonFormatItem and LogfmtFormatItem
+     *********************************/
+    // shortest of %.15g and %.17g that reads back as the same double
+    static void AppendDouble(LogStream &out, double v)
+    {
+        char *p = out.prepare(32);
+        int n = snprintf(p, 32, "%.15g", v);
+        if (strtod(p, nullptr) != v)
+        {
+            n = snprintf(p, 32, "%.17g", v);
+        }
+        out.commit(n);
+    }
+
+    static void AppendJsonString(LogStream &out, const char *data, size_t len)
+    {
+        static const char *s_hex = "0123456789abcdef";
+        out.append("\"", 1);
+        size_t begin = 0;
+        for (size_t i = 0; i < len; i++)
+        {
+            unsigned char c = data[i];
+            if (c >= 0x20 && c != '"' && c != '\\')
+            {
+                continue;
+            }
+            out.append(data + begin, i - begin);
+            begin = i + 1;
+            switch (c)
+            {
+            case '"': out.append("\\\"", 2); break;
+            case '\\': out.append("\\\\", 2); break;
+            case '\n': out.append("\\n", 2); break;
+            case '\r': out.append("\\r", 2); break;
+            case '\t': out.append("\\t", 2); break;
+            default:
+            {
+                char esc[6] = {'\\', 'u', '0', '0', s_hex[c >> 4], s_hex[c & 0xf]};
+                out.append(esc, 6);
+            }
+            }
+        }
+        out.append(data + begin, len - begin);
+        out.append("\"", 1);
+    }
+
+    // a json value, except a string
+    static void AppendJsonValue(LogStream &out, const LogField &field)
+    {
+        switch (field.type)
+        {
+        case LogField::INT:
+            out.appendInt(field.value.i);
+            break;
+        case LogField::UINT:
+            out.appendUInt(field.value.u);
+            break;
+        case LogField::DOUBLE:
+            // json has no nan and inf
+            if (std::isfinite(field.value.d))
+                AppendDouble(out, field.value.d);
+            else
+                out.append("null", 4);
+            break;
+        case LogField::BOOL:
+            out.append(field.value.b ? "true" : "false");
+            break;
+        default:
+            break;
+        }
+    }
+
+    void JsonFormatItem::append(LogStream &out, LogLevel::Level level, const LogEvent &event) const
+    {
+        out.append("{\"time\":\"", 9);
+        m_time.append(out, event);
+        out.append("\",\"level\":\"", 11);
+        out.append(LogLevel::ToString(level));
+        out.append("\",\"logger\":", 11);
+        const std::string &name = event.getLogger()->getName();
+        AppendJsonString(out, name.data(), name.size());
+        out.append(",\"thread\":", 10);
+        out.appendUInt(event.getThreadId());
+        out.append(",\"fiber\":", 9);
+        out.appendUInt(event.getFiberId());
+        out.append(",\"file\":", 8);
+        const char *file = event.getFile() ? event.getFile() : "";
+        AppendJsonString(out, file, strlen(file));
+        out.append(",\"line\":", 8);
+        out.appendInt(event.getLine());
+        out.append(",\"msg\":", 7);
+        AppendJsonString(out, event.getContentData(), event.getContentSize());
+        const char *text = event.getFieldText();
+        for (auto &i : event.getFields())
+        {
+            out.append(",", 1);
+            AppendJsonString(out, text + i.key, i.keyLen);
+            out.append(":", 1);
+            if (i.type == LogField::STRING)
+                AppendJsonString(out, text + i.str, i.strLen);
+            else
+                AppendJsonValue(out, i);
+        }
+        out.append("}", 1);
+    }
+
+    void LogfmtFormatItem::Append(LogStream &out, const LogEvent &event)
+    {
+        const char *text = event.getFieldText();
+        bool first = true;
+        for (auto &i : event.getFields())
+        {
+            if (!first)
+            {
+                out.append(" ", 1);
+            }
+            first = false;
+            out.append(text + i.key, i.keyLen);
+            out.append("=", 1);
+            if (i.type != LogField::STRING)
+            {
+                if (i.type == LogField::DOUBLE)
+                    AppendDouble(out, i.value.d);
+                else
+                    AppendJsonValue(out, i);
+                continue;
+            }
+            // quote an empty value and one with a space, a quote, = or a control character
+            const char *v = text + i.str;
+            bool quote = i.strLen == 0;
+            for (size_t n = 0; n < i.strLen && !quote; n++)
+            {
+                unsigned char c = v[n];
+                quote = c <= ' ' || c == '"' || c == '=' || c == '\\';
+            }
+            if (quote)
+                AppendJsonString(out, v, i.strLen);
+            else
+                out.append(v, i.strLen);
+        }
+    }
+
+    /*********************************
+     * class DateTimeFormatItem
+     *********************************/
+    // the most pieces a cached format is split into
+    static const size_t s_date_max_parts = 8;
+
+    void DateTimeFormatItem::init()
+    {
+        static std::atomic<uint64_t> s_id(0);
+        m_id = ++s_id;
+
+        // split at %N, %3N, %6N, %9N
+        Part part;
+        for (size_t i = 0; i < m_format.size(); ++i)
+        {
+            int digits = 0;
+            if (m_format[i] == '%' && i + 1 < m_format.size() && m_format[i + 1] == 'N')
+            {
+                digits = 9;
+                i += 1;
+            }
+            else if (m_format[i] == '%' && i + 2 < m_format.size() && isdigit(m_format[i + 1]) && m_format[i + 1] != '0' && m_format[i + 2] == 'N')
+            {
+                digits = m_format[i + 1] - '0';
+                i += 2;
+            }
+            else
+            {
+                part.strftime.append(1, m_format[i]);
+                // keep %% and the other conversions together
+                if (m_format[i] == '%' && i + 1 < m_format.size())
+                {
+                    part.strftime.append(1, m_format[++i]);
+                }
+                continue;
+            }
+
+            if (!part.strftime.empty())
+            {
+                m_parts.push_back(part);
+                part.strftime.clear();
+            }
+            Part sub;
+            sub.digits = digits;
+            m_parts.push_back(sub);
+        }
+        if (!part.strftime.empty())
+        {
+            m_parts.push_back(part);
+        }
+        if (m_parts.size() > s_date_max_parts)
+        {
+            // too many pieces to cache, let strftime see %N as it is
+            m_parts.clear();
+            part.strftime = m_format;
+            m_parts.push_back(part);
+        }
+    }
+
+    // the strftime pieces of one format rendered for one second
+    struct DateTimeCache
+    {
+        uint64_t id = 0;                            // DateTimeFormatItem::m_id
+        time_t sec = -1;
+        uint16_t ends[s_date_max_parts];            // end of each piece in text
+        char text[DateTimeFormatItem::MAX_SIZE];
+    };
+
+    size_t DateTimeFormatItem::render(char *buf, time_t sec, uint32_t nsec) const
+    {
+        // a thread usually switches between a few formatters (file, stdout...)
+        static const size_t s_entries = 4;
+        static thread_local DateTimeCache t_cache[s_entries];
+        static thread_local size_t t_victim = 0;
+
+        DateTimeCache *cache = nullptr;
+        for (size_t i = 0; i < s_entries; ++i)
+        {
+            if (t_cache[i].id == m_id)
+            {
+                cache = &t_cache[i];
+                break;
+            }
+        }
+        if (!cache)
+        {
+            cache = &t_cache[t_victim];
+            t_victim = (t_victim + 1) % s_entries;
+            cache->id = m_id;
+            cache->sec = -1;
+        }
+
+        if (cache->sec != sec)
+        {
+            struct tm tm;
+            localtime_r(&sec, &tm);
+            size_t len = 0;
+            for (size_t i = 0; i < m_parts.size(); ++i)
+            {
+                if (!m_parts[i].digits)
+                {
+                    len += strftime(cache->text + len, MAX_SIZE - len, m_parts[i].strftime.c_str(), &tm);
+                }
+                cache->ends[i] = len;
+            }
+            cache->sec = sec;
+        }
+
+        size_t size = 0;
+        size_t begin = 0;
+        for (size_t i = 0; i < m_parts.size(); ++i)
+        {
+            if (m_parts[i].digits)
+            {
+                int digits = m_parts[i].digits;
+                uint32_t v = nsec;
+                for (int d = digits; d < 9; ++d)
+                {
+                    v /= 10;
+                }
+                if (size + digits > MAX_SIZE)
+                {
+                    break;
+                }
+                for (int d = digits - 1; d >= 0; --d)
+                {
+                    buf[size + d] = '0' + v % 10;
+                    v /= 10;
+                }
+                size += digits;
+            }
+            else
+            {
+                size_t len = cache->ends[i] - begin;
+                if (size + len > MAX_SIZE)
+                {
+                    break;
+                }
+                memcpy(buf + size, cache->text + begin, len);
+                size += len;
+            }
+            begin = cache->ends[i];
+        }
+        return size;
+    }
+
+    void pattern::Name::Append(LogStream &out, const Logger &logger, LogLevel::Level level, const LogEvent &event)
+    {
+        out.append(event.getLogger()->getName());
+    }
+
+    static uint64_t MonotonicMS()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    static uint64_t MonotonicNS()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+    }
+
+    /*********************************
+     * class StdoutLogAppender
+     *********************************/
+    void StdoutLogAppender::log(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event)
+    {
+        if (level >= m_level)
+        {
+            LogStream &os = FormatStream();
+            formatter()->format(os, logger, level, event);
+            formatted(os.size());
+            write(level, os.data(), os.size());
+        }
+    }
+
+    void StdoutLogAppender::write(LogLevel::Level level, const char *data, size_t len)
+    {
+        // std::cout decides when to call write(2), the calls are not counted
+        std::cout.write(data, len);
+        m_counters.bytesWritten.add(len);
+    }
+
+    void StdoutLogAppender::flush()
+    {
+        uint64_t begin = MonotonicNS();
+        std::cout.flush();
+        m_counters.flushLatency.record(MonotonicNS() - begin);
+    }
+
+    void StdoutLogAppender::drainUnsafe(const char *data, size_t len)
+    {
+        // what std::cout holds is lost
+        while (len)
+        {
+            ssize_t rt = ::write(STDOUT_FILENO, data, len);
+            if (rt < 0 && errno == EINTR)
+                continue;
+            if (rt <= 0)
+                break;
+            data += rt;
+            len -= rt;
+        }
+    }
+
+    std::string StdoutLogAppender::toYamlString()
+    {
+        YAML::Node node;
+        node["type"] = "StdoutLogAppender";
+        if (m_level != LogLevel::UNKNOWN)
+            node["level"] = LogLevel::ToString(m_level);
+        std::shared_ptr<LogFormatter> formatter = getFormatter();
+        if (hasFormatter() && formatter)
+        {
+            node["formatter"] = formatter->getPattern();
+        }
+        std::stringstream ss;
+        ss << node;
+        return ss.str();
+    }
+
+    std::shared_ptr<LogFormatter> LogAppender::swapFormatter(std::shared_ptr<LogFormatter> val, bool own)
+    {
+        Mutex::Lock lock(m_formatterMutex);
+        m_formatter.swap(val);
+        m_format.store(m_formatter.get(), std::memory_order_release);
+        m_hasFormatter.store(own, std::memory_order_relaxed);
+        return val;
+    }
+
+    std::shared_ptr<LogFormatter> LogAppender::getFormatter() const
+    {
+        Mutex::Lock lock(m_formatterMutex);
+        return m_formatter;
+    }
+
+    void LogAppender::setFormatter(std::shared_ptr<LogFormatter> val)
+    {
+        std::shared_ptr<LogFormatter> old = swapFormatter(val, val != nullptr);
+        if (m_attached.load(std::memory_order_relaxed))
+        {
+            // the loggers format with the formatter in their snapshots
+            Logger::Refresh();
+        }
+        if (old)
+        {
+            Epoch::Retire([old]() mutable { old.reset(); });
+        }
+    }
+
+    LogAppenderMetrics LogAppender::getMetrics()
+    {
+        LogAppenderMetrics metrics;
+        YAML::Node node = YAML::Load(toYamlString());
+        if (node["type"].IsDefined())
+            metrics.type = node["type"].as<std::string>();
+        if (node["file"].IsDefined())
+            metrics.file = node["file"].as<std::string>();
+        metrics.events = m_counters.events.get();
+        metrics.bytesFormatted = m_counters.bytesFormatted.get();
+        metrics.bytesWritten = m_counters.bytesWritten.get();
+        metrics.writeCalls = m_counters.writeCalls.get();
+        metrics.queueHighWatermark = m_counters.queueDepth.getMax();
+        metrics.flushLatency = m_counters.flushLatency.get();
+        return metrics;
+    }
+
+    /*********************************
+     * class LogCounter
+     *********************************/
+    uint64_t LogCounter::get() const
+    {
+        uint64_t sum = 0;
+        for (auto &i : m_stripes)
+        {
+            sum += i.value.load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    uint64_t LogCounter::getMax() const
+    {
+        uint64_t max = 0;
+        for (auto &i : m_stripes)
+        {
+            max = std::max(max, i.value.load(std::memory_order_relaxed));
+        }
+        return max;
+    }
+
+    void LogHistogram::record(uint64_t ns)
+    {
+        uint64_t us = ns / 1000;
+        size_t bucket = 0;
+        while (us && bucket + 1 < BUCKETS)
+        {
+            us >>= 1;
+            ++bucket;
+        }
+        m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    std::vector<uint64_t> LogHistogram::get() const
+    {
+        std::vector<uint64_t> buckets;
+        for (auto &i : m_buckets)
+        {
+            buckets.push_back(i.load(std::memory_order_relaxed));
+        }
+        return buckets;
+    }
+
+
+    /*********************************
+     * class LogTimer
+     *********************************/
+    LogTimer::LogTimer()
+    {
+        m_thread.reset(new Thread(std::bind(&LogTimer::run, this), "log_timer"));
+    }
+
+    LogTimer::~LogTimer()
+    {
+        {
+            Mutex::Lock lock(m_mutex);
+            m_stop = true;
+        }
+        m_semaphore.notify();
+        m_thread->join();
+    }
+
+    void LogTimer::add(const void *owner, uint32_t period, std::function<void(uint64_t now)> cb)
+    {
+        {
+            Mutex::Lock lock(m_mutex);
+            auto it = std::find_if(m_entries.begin(), m_entries.end(), [owner](const Entry &i) { return i.owner == owner; });
+            if (it == m_entries.end())
+            {
+                it = m_entries.insert(m_entries.end(), Entry());
+            }
+            it->owner = owner;
+            it->period = period;
+            it->cb = cb;
+        }
+        // the period may be shorter now
+        m_semaphore.notify();
+    }
+
+    void LogTimer::del(const void *owner)
+    {
+        // the callbacks run with the mutex held, owner is not used after this
+        Mutex::Lock lock(m_mutex);
+        m_entries.erase(std::remove_if(m_entries.begin(), m_entries.end(), [owner](const Entry &i) { return i.owner == owner; }),
+                        m_entries.end());
+    }
+
+    void LogTimer::run()
+    {
+        uint32_t period = 1000;
+        while (true)
+        {
+            m_semaphore.timedWait(period);
+            Mutex::Lock lock(m_mutex);
+            if (m_stop)
+            {
+                break;
+            }
+            uint64_t now = MonotonicMS();
+            period = 1000;
+            for (auto &i : m_entries)
+            {
+                if (i.period)
+                {
+                    i.cb(now);
+                    period = std::min(period, i.period);
+                }
+            }
+        }
+    }
+
+    /*********************************
+     * class FileLogAppender
+     *********************************/
+    FileLogAppender::FileLogAppender(const std::string &filename)
+        : FileLogAppender(filename, Derived())
+    {
+        LogCrashHandler::Register(this);
+    }
+
+    FileLogAppender::FileLogAppender(const std::string &filename, Derived)
+        : m_filename(filename)
+    {
+        m_buffer.reserve(m_flushBytes);
+        m_lastFlush = MonotonicMS();
+        reopen();
+        m_timer = LogTimerMgr::GetInstance();
+        m_timer->add(this, m_flushInterval, [this](uint64_t now) { expire(now); });
+    }
+
+    FileLogAppender::~FileLogAppender()
+    {
+        // a no-op for the subclasses, they are unregistered already
+        LogCrashHandler::Unregister(this);
+        m_timer->del(this);
+        Mutex::Lock lock(m_mutex);
+        flushLocked();
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+        }
+    }
+
+    void FileLogAppender::drainUnsafe(const char *data, size_t len)
+    {
+        // writev and a clear of the buffer only, without m_mutex
+        flushLocked(data, len);
+    }
+
+    bool FileLogAppender::reopen()
+    {
+        Mutex::Lock lock(m_mutex);
+        return reopenLocked();
+    }
+
+    bool FileLogAppender::reopenLocked()
+    {
+        flushLocked();
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+        }
+        m_fd = open(m_filename.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        struct stat st;
+        m_size = (m_fd >= 0 && fstat(m_fd, &st) == 0) ? st.st_size : 0;
+        return m_fd >= 0;
+    }
+
+    void FileLogAppender::setFlushPolicy(size_t bytes, uint32_t interval, LogLevel::Level level)
+    {
+        {
+            Mutex::Lock lock(m_mutex);
+            m_flushBytes = bytes;
+            m_flushInterval = interval;
+            m_flushLevel = level;
+            m_buffer.reserve(m_flushBytes);
+        }
+        // the timer runs the callbacks with its mutex held, it is not taken under m_mutex
+        m_timer->add(this, interval, [this](uint64_t now) { expire(now); });
+    }
+
+    void FileLogAppender::expire(uint64_t now)
+    {
+        Mutex::Lock lock(m_mutex);
+        // a quiet logger does not keep its last lines in the buffer
+        if (!m_buffer.empty() && now - m_lastFlush >= m_flushInterval)
+        {
+            flushLocked();
+        }
+    }
+
+    void FileLogAppender::log(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event)
+    {
+        if (level >= m_level)
+        {
+            LogStream &os = FormatStream();
+            formatter()->format(os, logger, level, event);
+            formatted(os.size());
+            write(level, os.data(), os.size());
+        }
+    }
+
+    void FileLogAppender::write(LogLevel::Level level, const char *data, size_t len)
+    {
+        Mutex::Lock lock(m_mutex);
+        writeLocked(level, data, len);
+    }
+
+    void FileLogAppender::writeLocked(LogLevel::Level level, const char *data, size_t len)
+    {
+        m_size += len;
+        if (m_buffer.size() + len >= m_flushBytes)
+        {
+            // one writev for the buffer and the new data, no copy of data
+            flushLocked(data, len);
+            return;
+        }
+        m_buffer.append(data, len);
+        if ((m_flushLevel != LogLevel::UNKNOWN && level >= m_flushLevel) || MonotonicMS() - m_lastFlush >= m_flushInterval)
+        {
+            flushLocked();
+        }
+    }
+
+    void FileLogAppender::flush()
+    {
+        Mutex::Lock lock(m_mutex);
+        flushLocked();
+    }
+
+    void FileLogAppender::flushLocked(const char *data, size_t len)
+    {
+        m_lastFlush = MonotonicMS();
+        struct iovec iov[2];
+        int count = 0;
+        if (!m_buffer.empty())
+        {
+            iov[count].iov_base = (void *)m_buffer.data();
+            iov[count].iov_len = m_buffer.size();
+            ++count;
+        }
+        if (len)
+        {
+            iov[count].iov_base = (void *)data;
+            iov[count].iov_len = len;
+            ++count;
+        }
+        if (!count)
+        {
+            return;
+        }
+        uint64_t begin = MonotonicNS();
+        struct iovec *vec = iov;
+        while (count && m_fd >= 0)
+        {
+            ssize_t rt = writev(m_fd, vec, count);
+            m_counters.writeCalls.add();
+            if (rt < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                break;
+            }
+            m_counters.bytesWritten.add(rt);
+            // partial write, skip what has been written
+            while (count && (size_t)rt >= vec->iov_len)
+            {
+                rt -= vec->iov_len;
+                ++vec;
+                --count;
+            }
+            if (count)
+            {
+                vec->iov_base = (char *)vec->iov_base + rt;
+                vec->iov_len -= rt;
+            }
+        }
+        m_buffer.clear();
+        m_counters.flushLatency.record(MonotonicNS() - begin);
+    }
+
+    std::string FileLogAppender::toYamlString()
+    {
+        YAML::Node node;
+        node["type"] = "FileLogAppender";
+        node["file"] = m_filename;
+        if (m_level != LogLevel::UNKNOWN)
+            node["level"] = LogLevel::ToString(m_level);
+        node["flush"]["bytes"] = m_flushBytes;
+        node["flush"]["interval"] = m_flushInterval;
+        if (m_flushLevel != LogLevel::UNKNOWN)
+            node["flush"]["level"] = LogLevel::ToString(m_flushLevel);
+        std::shared_ptr<LogFormatter> formatter = getFormatter();
+        if (hasFormatter() && formatter)
+        {
+            node["formatter"] = formatter->getPattern();
+        }
+
+        std::stringstream ss;
+        ss << node;
+        return ss.str();
+    }
+
+    /*********************************
+     * class RollingFileLogAppender
+     *********************************/
+
+    RollingFileLogAppender::RollingFileLogAppender(const std::string &filename, const std::string &pattern, uint64_t max_size, uint32_t max_archives, bool compress)
+        : FileLogAppender(filename, Derived()), m_pattern(pattern), m_maxSize(max_size), m_maxArchives(max_archives), m_compress(compress)
+    {
+        for (size_t i = 0; i + 1 < m_pattern.size(); ++i)
+        {
+            if (m_pattern[i] != '%')
+            {
+                continue;
+            }
+            Period p = NONE;
+            switch (m_pattern[++i])
+            {
+            case 'M':
+                p = MINUTE;
+                break;
+            case 'H':
+                p = HOUR;
+                break;
+            case 'd':
+            case 'e':
+            case 'j':
+            case 'F':
+                p = DAY;
+                break;
+            }
+            // the smallest unit in the pattern
+            if (p != NONE && (m_period == NONE || p < m_period))
+            {
+                m_period = p;
+            }
+        }
+        // an existing file belongs to the period it was last written in
+        time_t now = time(nullptr);
+        struct stat st;
+        if (stat(m_filename.c_str(), &st) == 0 && st.st_size > 0 && st.st_mtime < now)
+        {
+            now = st.st_mtime;
+        }
+        m_periodStart = periodStart(now);
+        m_nextRoll = nextBoundary(now);
+        LogCrashHandler::Register(this);
+    }
+
+    RollingFileLogAppender::~RollingFileLogAppender()
+    {
+        LogCrashHandler::Unregister(this);
+        if (m_thread)
+        {
+            {
+                Mutex::Lock lock(m_taskMutex);
+                m_stop = true;
+            }
+            m_semaphore.notify();
+            m_thread->join();
+        }
+    }
+
+    time_t RollingFileLogAppender::periodStart(time_t t) const
+    {
+        if (m_period == NONE)
+        {
+            return t;
+        }
+        struct tm tm;
+        localtime_r(&t, &tm);
+        tm.tm_sec = 0;
+        if (m_period >= HOUR)
+            tm.tm_min = 0;
+        if (m_period >= DAY)
+            tm.tm_hour = 0;
+        tm.tm_isdst = -1;
+        return mktime(&tm);
+    }
+
+    time_t RollingFileLogAppender::nextBoundary(time_t t) const
+    {
+        if (m_period == NONE)
+        {
+            return 0;
+        }
+        struct tm tm;
+        localtime_r(&t, &tm);
+        tm.tm_sec = 0;
+        if (m_period == MINUTE)
+        {
+            ++tm.tm_min;
+        }
+        else if (m_period == HOUR)
+        {
+            tm.tm_min = 0;
+            ++tm.tm_hour;
+        }
+        else
+        {
+            tm.tm_min = 0;
+            tm.tm_hour = 0;
+            ++tm.tm_mday;
+        }
+        // mktime normalizes the overflowed field and the dst change
+        tm.tm_isdst = -1;
+        return mktime(&tm);
+    }
+
+    std::string RollingFileLogAppender::archiveName(uint32_t index) const
+    {
+        std::string fmt;
+        bool has_index = false;
+        for (size_t i = 0; i < m_pattern.size(); ++i)
+        {
+            if (m_pattern[i] == '%' && i + 1 < m_pattern.size())
+            {
+                if (m_pattern[i + 1] == 'i')
+                {
+                    fmt += std::to_string(index);
+                    has_index = true;
+                    ++i;
+                    continue;
+                }
+                fmt += m_pattern[i++];
+            }
+            fmt += m_pattern[i];
+        }
+        struct tm tm;
+        localtime_r(&m_periodStart, &tm);
+        char buf[512];
+        size_t n = strftime(buf, sizeof(buf), fmt.c_str(), &tm);
+        std::string name(buf, n);
+        if (!has_index && index)
+        {
+            name += "." + std::to_string(index);
+        }
+        return name;
+    }
+
+    void RollingFileLogAppender::write(LogLevel::Level level, const char *data, size_t len)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+        Mutex::Lock lock(m_mutex);
+        if ((m_nextRoll && ts.tv_sec >= m_nextRoll) || (m_maxSize && m_size && m_size + len > m_maxSize))
+        {
+            rollLocked(ts.tv_sec);
+        }
+        writeLocked(level, data, len);
+    }
+
+    void RollingFileLogAppender::rollLocked(time_t now)
+    {
+        flushLocked();
+        struct stat st;
+        std::string name;
+        // skip the archives left by an earlier run
+        for (;; ++m_index)
+        {
+            name = archiveName(m_index);
+            if (stat(name.c_str(), &st) != 0 && stat((name + ".gz").c_str(), &st) != 0)
+            {
+                break;
+            }
+        }
+        if (rename(m_filename.c_str(), name.c_str()) != 0)
+        {
+            std::cout << "RollingFileLogAppender: rename " << m_filename << " to " << name << " failed: " << strerror(errno) << std::endl;
+        }
+        reopenLocked();
+        if (m_nextRoll && now >= m_nextRoll)
+        {
+            m_periodStart = periodStart(now);
+            m_nextRoll = nextBoundary(now);
+            m_index = 0;
+        }
+        else
+        {
+            ++m_index;
+        }
+
+        if (!m_compress && !m_maxArchives)
+        {
+            return;
+        }
+        {
+            Mutex::Lock lock(m_taskMutex);
+            m_tasks.push_back(name);
+        }
+        if (!m_thread)
+        {
+            m_thread.reset(new Thread(std::bind(&RollingFileLogAppender::run, this), "log_roll"));
+        }
+        m_semaphore.notify();
+    }
+
+    static bool GzipFile(const std::string &name)
+    {
+        int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return false;
+        }
+        std::string gz_name = name + ".gz";
+        gzFile gz = gzopen(gz_name.c_str(), "wb");
+        if (!gz)
+        {
+            close(fd);
+            return false;
+        }
+        char buf[64 * 1024];
+        ssize_t n;
+        bool ok = true;
+        while ((n = read(fd, buf, sizeof(buf))) != 0)
+        {
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                ok = false;
+                break;
+            }
+            if (gzwrite(gz, buf, n) != n)
+            {
+                ok = false;
+                break;
+            }
+        }
+        close(fd);
+        ok = gzclose(gz) == Z_OK && ok;
+        unlink(ok ? name.c_str() : gz_name.c_str());
+        return ok;
+    }
+
+    void RollingFileLogAppender::prune()
+    {
+        // the pattern as a glob, only the compressed archives are counted when
+        // compressing, the renamed files in the queue are not done yet
+        std::string expr;
+        for (size_t i = 0; i < m_pattern.size(); ++i)
+        {
+            if (m_pattern[i] == '%' && i + 1 < m_pattern.size())
+            {
+                expr += m_pattern[++i] == '%' ? "%" : "*";
+                continue;
+            }
+            expr += m_pattern[i];
+        }
+        if (m_compress)
+        {
+            expr += ".gz";
+        }
+        glob_t g;
+        if (glob(expr.c_str(), 0, nullptr, &g) != 0)
+        {
+            return;
+        }
+        // oldest first, the index in the names does not sort as a string
+        std::vector<std::pair<uint64_t, std::string>> archives;
+        for (size_t i = 0; i < g.gl_pathc; ++i)
+        {
+            struct stat st;
+            if (g.gl_pathv[i] != m_filename && stat(g.gl_pathv[i], &st) == 0)
+            {
+                uint64_t mtime = (uint64_t)st.st_mtim.tv_sec * 1000000000ul + st.st_mtim.tv_nsec;
+                archives.push_back(std::make_pair(mtime, std::string(g.gl_pathv[i])));
+            }
+        }
+        globfree(&g);
+        if (archives.size() <= m_maxArchives)
+        {
+            return;
+        }
+        std::sort(archives.begin(), archives.end());
+        for (size_t i = 0; i < archives.size() - m_maxArchives; ++i)
+        {
+            unlink(archives[i].second.c_str());
+        }
+    }
+
+    void RollingFileLogAppender::run()
+    {
+        while (true)
+        {
+            m_semaphore.wait();
+            std::vector<std::string> tasks;
+            bool stop;
+            {
+                Mutex::Lock lock(m_taskMutex);
+                tasks.swap(m_tasks);
+                stop = m_stop;
+            }
+            for (auto &i : tasks)
+            {
+                if (m_compress && !GzipFile(i))
+                {
+                    std::cout << "RollingFileLogAppender: compress " << i << " failed" << std::endl;
+                }
+            }
+            if (m_maxArchives && !tasks.empty())
+            {
+                prune();
+            }
+            if (stop)
+            {
+                break;
+            }
+        }
+    }
+
+    std::string RollingFileLogAppender::toYamlString()
+    {
+        YAML::Node node = YAML::Load(FileLogAppender::toYamlString());
+        node["type"] = "RollingFileLogAppender";
+        node["pattern"] = m_pattern;
+        if (m_maxSize)
+            node["max_size"] = m_maxSize;
+        if (m_maxArchives)
+            node["max_archives"] = m_maxArchives;
+        node["compress"] = m_compress;
+        std::stringstream ss;
+        ss << node;
+        return ss.str();
+    }
+
+
+    /*********************************
+     * class MmapFileLogAppender
+     *********************************/
+    MmapFileLogAppender::MmapFileLogAppender(const std::string &filename, size_t segment_size)
+        : m_filename(filename)
+    {
+        // a whole number of pages, the mappings start at page boundaries
+        size_t page = sysconf(_SC_PAGESIZE);
+        m_segmentSize = segment_size ? segment_size : (size_t)DEFAULT_SEGMENT_SIZE;
+        m_segmentSize = std::max(m_segmentSize, (size_t)64 * 1024);
+        m_segmentSize = (m_segmentSize + page - 1) / page * page;
+
+        m_fd = open(m_filename.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        struct stat st;
+        if (m_fd < 0 || fstat(m_fd, &st) != 0)
+        {
+            std::cout << "MmapFileLogAppender open file=" << m_filename << " error=" << strerror(errno) << std::endl;
+            return;
+        }
+        // the end of the lines, before the preallocated zeros a crash may have left
+        uint64_t end = st.st_size;
+        m_end = end;
+        char buf[4096];
+        while (end > 0)
+        {
+            size_t n = std::min(end, (uint64_t)sizeof(buf));
+            if (pread(m_fd, buf, n, end - n) != (ssize_t)n)
+            {
+                break;
+            }
+            size_t i = n;
+            while (i > 0 && buf[i - 1] == 0)
+            {
+                --i;
+            }
+            end -= n - i;
+            if (i > 0)
+            {
+                break;
+            }
+        }
+        if (end != (uint64_t)st.st_size && ftruncate(m_fd, end) != 0)
+        {
+            return;
+        }
+
+        m_end = end;
+        uint64_t offset = end / page * page;
+        m_segment.store(mapSegment(offset, end - offset), std::memory_order_release);
+        if (!m_segment.load(std::memory_order_relaxed))
+        {
+            // the lines are dropped until the background thread maps it
+            truncate();
+        }
+        m_thread.reset(new Thread(std::bind(&MmapFileLogAppender::run, this), "log_mmap"));
+        LogCrashHandler::Register(this);
+    }
+
+    MmapFileLogAppender::~MmapFileLogAppender()
+    {
+        LogCrashHandler::Unregister(this);
+        if (m_thread)
+        {
+            {
+                Mutex::Lock lock(m_mutex);
+                m_stop = true;
+            }
+            m_semaphore.notify();
+            m_thread->join();
+        }
+        // nobody writes any more, cut off the preallocated rest
+        Segment *seg = m_segment.load(std::memory_order_acquire);
+        if (seg)
+        {
+            m_end = seg->offset + std::min(seg->cursor.load(std::memory_order_relaxed), m_segmentSize);
+            unmapSegment(seg);
+        }
+        if (m_next)
+        {
+            unmapSegment(m_next);
+        }
+        if (m_fd >= 0)
+        {
+            // the segment mapped ahead is beyond m_end as well
+            truncate();
+            close(m_fd);
+        }
+    }
+
+    void MmapFileLogAppender::truncate()
+    {
+        if (ftruncate(m_fd, m_end) != 0)
+        {
+            std::cout << "MmapFileLogAppender truncate file=" << m_filename << " error=" << strerror(errno) << std::endl;
+        }
+    }
+
+    MmapFileLogAppender::Segment *MmapFileLogAppender::mapSegment(uint64_t offset, size_t cursor)
+    {
+        // reserve the blocks, fall back to a sparse file where fallocate is not supported
+        if (fallocate(m_fd, 0, offset, m_segmentSize) != 0)
+        {
+            struct stat st;
+            if (fstat(m_fd, &st) != 0 || ((uint64_t)st.st_size < offset + m_segmentSize && ftruncate(m_fd, offset + m_segmentSize) != 0))
+            {
+                std::cout << "MmapFileLogAppender allocate file=" << m_filename << " error=" << strerror(errno) << std::endl;
+                return nullptr;
+            }
+        }
+        void *base = mmap(nullptr, m_segmentSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, offset);
+        if (base == MAP_FAILED)
+        {
+            std::cout << "MmapFileLogAppender mmap file=" << m_filename << " error=" << strerror(errno) << std::endl;
+            return nullptr;
+        }
+        Segment *seg = new Segment;
+        seg->base = (char *)base;
+        seg->offset = offset;
+        seg->cursor.store(cursor, std::memory_order_relaxed);
+        return seg;
+    }
+
+    void MmapFileLogAppender::unmapSegment(Segment *seg)
+    {
+        munmap(seg->base, m_segmentSize);
+        delete seg;
+    }
+
+    void MmapFileLogAppender::log(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event)
+    {
+        if (level >= m_level)
+        {
+            LogStream &os = FormatStream();
+            formatter()->format(os, logger, level, event);
+            formatted(os.size());
+            write(level, os.data(), os.size());
+        }
+    }
+
+    void MmapFileLogAppender::write(LogLevel::Level level, const char *data, size_t len)
+    {
+        if (len == 0)
+        {
+            return;
+        }
+        // the segment is unmapped only after the writers inside it are gone
+        Epoch::ReadGuard guard;
+        for (;;)
+        {
+            Segment *seg = m_segment.load(std::memory_order_acquire);
+            if (!seg)
+            {
+                // the last map failed, the background thread tries again
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+            size_t pos = seg->cursor.fetch_add(len, std::memory_order_relaxed);
+            if (pos + len <= m_segmentSize)
+            {
+                // copied into the mapping, the page cache writes it without a call
+                memcpy(seg->base + pos, data, len);
+                m_counters.bytesWritten.add(len);
+                return;
+            }
+            // exactly one line crosses the end
+            if (pos <= m_segmentSize)
+            {
+                switchSegment(seg, pos, data, len);
+                return;
+            }
+            // the writer of that line is switching, sleep until it is done
+            Mutex::Lock lock(m_mutex);
+            while (m_segment.load(std::memory_order_acquire) == seg)
+            {
+                m_switched.wait(m_mutex);
+            }
+        }
+    }
+
+    void MmapFileLogAppender::switchSegment(Segment *seg, size_t pos, const char *data, size_t len)
+    {
+        uint64_t begin = seg->offset + pos;
+        size_t first = m_segmentSize - pos;
+        memcpy(seg->base + pos, data, first);
+        m_counters.bytesWritten.add(first);
+        data += first;
+        len -= first;
+
+        Mutex::Lock lock(m_mutex);
+        // a line longer than a segment fills some of them alone
+        while (len > 0)
+        {
+            Segment *next = m_next;
+            m_next = nullptr;
+            if (!next)
+            {
+                next = mapSegment(seg->offset + m_segmentSize);
+            }
+            m_retired.push_back(seg);
+            if (!next)
+            {
+                // the file ends before this line, the lines are dropped until the background thread maps it
+                m_end = begin;
+                m_segment.store(nullptr, std::memory_order_release);
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                truncate();
+                break;
+            }
+            size_t n = std::min(len, m_segmentSize);
+            // past the end while this line is not done, the others wait for the next switch
+            next->cursor.store(len > m_segmentSize ? m_segmentSize + 1 : n, std::memory_order_relaxed);
+            m_segment.store(next, std::memory_order_release);
+            memcpy(next->base, data, n);
+            m_counters.bytesWritten.add(n);
+            data += n;
+            len -= n;
+            seg = next;
+        }
+        // the writers past the end go on with the new segment, or drop their lines
+        m_switched.notifyAll();
+        // map the next one ahead, unmap the old one
+        m_semaphore.notify();
+    }
+
+    void MmapFileLogAppender::drainUnsafe(const char *data, size_t len)
+    {
+        // the lines are in the mapping already, a switch would need the lock
+        Segment *seg = m_segment.load(std::memory_order_acquire);
+        if (seg && len)
+        {
+            size_t pos = seg->cursor.fetch_add(len, std::memory_order_relaxed);
+            if (pos + len <= m_segmentSize)
+            {
+                memcpy(seg->base + pos, data, len);
+            }
+        }
+    }
+
+    void MmapFileLogAppender::flush()
+    {
+        // only the background thread unmaps, keep it from doing so meanwhile
+        Mutex::Lock lock(m_mutex);
+        Segment *seg = m_segment.load(std::memory_order_acquire);
+        if (seg)
+        {
+            uint64_t begin = MonotonicNS();
+            msync(seg->base, m_segmentSize, MS_ASYNC);
+            m_counters.flushLatency.record(MonotonicNS() - begin);
+        }
+    }
+
+    void MmapFileLogAppender::run()
+    {
+        while (true)
+        {
+            m_semaphore.timedWait(1000);
+            bool stop;
+            Segment *current;
+            std::vector<Segment *> retired;
+            {
+                Mutex::Lock lock(m_mutex);
+                stop = m_stop;
+                current = m_segment.load(std::memory_order_acquire);
+                retired.swap(m_retired);
+                if (current)
+                {
+                    msync(current->base, m_segmentSize, MS_ASYNC);
+                }
+            }
+            for (auto i : retired)
+            {
+                // waits for the writers still copying into it
+                Epoch::Retire([this, i]() {
+                    msync(i->base, m_segmentSize, MS_ASYNC);
+                    unmapSegment(i);
+                });
+            }
+            if (stop)
+            {
+                break;
+            }
+
+            if (!current)
+            {
+                remap();
+                continue;
+            }
+
+            bool ahead;
+            {
+                Mutex::Lock lock(m_mutex);
+                ahead = !m_next && m_segment.load(std::memory_order_relaxed) == current;
+            }
+            if (!ahead)
+            {
+                continue;
+            }
+            // mapping may take a while, the writers go on meanwhile
+            Segment *next = mapSegment(current->offset + m_segmentSize);
+            if (next)
+            {
+                Mutex::Lock lock(m_mutex);
+                if (!m_next && m_segment.load(std::memory_order_relaxed) == current)
+                {
+                    m_next = next;
+                    next = nullptr;
+                }
+            }
+            if (next)
+            {
+                // a writer switched in between and mapped it itself
+                unmapSegment(next);
+                m_semaphore.notify();
+            }
+        }
+    }
+
+    void MmapFileLogAppender::remap()
+    {
+        // only this thread maps while there is no segment, the writers just drop
+        uint64_t end;
+        {
+            Mutex::Lock lock(m_mutex);
+            end = m_end;
+        }
+        size_t page = sysconf(_SC_PAGESIZE);
+        uint64_t offset = end / page * page;
+        Segment *seg = mapSegment(offset, end - offset);
+        if (seg)
+        {
+            Mutex::Lock lock(m_mutex);
+            m_segment.store(seg, std::memory_order_release);
+        }
+    }
+
+    std::string MmapFileLogAppender::toYamlString()
+    {
+        YAML::Node node;
+        node["type"] = "MmapFileLogAppender";
+        node["file"] = m_filename;
+        node["segment_size"] = m_segmentSize;
+        if (m_level != LogLevel::UNKNOWN)
+            node["level"] = LogLevel::ToString(m_level);
+        std::shared_ptr<LogFormatter> formatter = getFormatter();
+        if (hasFormatter() && formatter)
+        {
+            node["formatter"] = formatter->getPattern();
+        }
+        std::stringstream ss;
+        ss << node;
+        return ss.str();
+    }
+
+    LogAppenderMetrics MmapFileLogAppender::getMetrics()
+    {
+        LogAppenderMetrics metrics = LogAppender::getMetrics();
+        metrics.dropped = getDropped();
+        return metrics;
+    }
+
+    /*********************************
+     * class LogRing
+     *********************************/
+    // a record header is written at the end of the ring to tell the consumer to wrap
+    static const uint32_t s_ring_wrap = 0xFFFFFFFF;
+
+    static size_t RingAlign(size_t n)
+    {
+        return (n + 7) & ~(size_t)7;
+    }
+
+    LogRing::LogRing(size_t capacity, pid_t tid)
+        : m_tid(tid), m_head(0), m_dropped(0), m_retired(false), m_tail(0)
+    {
+        m_capacity = 4096;
+        while (m_capacity < capacity)
+        {
+            m_capacity <<= 1;
+        }
+        m_buffer = new char[m_capacity];
+    }
+
+    LogRing::~LogRing()
+    {
+        delete[] m_buffer;
+    }
+
+    bool LogRing::push(LogAppender *sink, LogLevel::Level level, uint64_t time, const char *data, size_t len)
+    {
+        size_t need = RingAlign(sizeof(Record) + len);
+        uint64_t head = m_head.load(std::memory_order_relaxed);
+        size_t offset = head & (m_capacity - 1);
+        size_t contiguous = m_capacity - offset;
+        // a record never wraps, the end of the ring is skipped instead
+        size_t total = contiguous < need ? contiguous + need : need;
+        if (need > m_capacity || head + total - m_cachedTail > m_capacity)
+        {
+            m_cachedTail = m_tail.load(std::memory_order_acquire);
+            if (need > m_capacity || head + total - m_cachedTail > m_capacity)
+            {
+                return false;
+            }
+        }
+        if (contiguous < need)
+        {
+            if (contiguous >= sizeof(Record))
+            {
+                ((Record *)(m_buffer + offset))->len = s_ring_wrap;
+            }
+            head += contiguous;
+            offset = 0;
+        }
+        Record *rec = (Record *)(m_buffer + offset);
+        rec->time = time;
+        rec->sink = sink;
+        rec->len = len;
+        rec->level = level;
+        memcpy(rec + 1, data, len);
+        m_head.store(head + need, std::memory_order_release);
+        return true;
+    }
+
+    const LogRing::Record *LogRing::front()
+    {
+        uint64_t tail = m_tail.load(std::memory_order_relaxed);
+        while (true)
+        {
+            if (tail == m_cachedHead)
+            {
+                m_cachedHead = m_head.load(std::memory_order_acquire);
+                if (tail == m_cachedHead)
+                {
+                    return nullptr;
+                }
+            }
+            size_t offset = tail & (m_capacity - 1);
+            size_t contiguous = m_capacity - offset;
+            if (contiguous < sizeof(Record) || ((Record *)(m_buffer + offset))->len == s_ring_wrap)
+            {
+                // skipped by the producer, continue at the beginning of the ring
+                tail += contiguous;
+                m_tail.store(tail, std::memory_order_release);
+                continue;
+            }
+            return (Record *)(m_buffer + offset);
+        }
+    }
+
+    void LogRing::pop()
+    {
+        uint64_t tail = m_tail.load(std::memory_order_relaxed);
+        const Record *rec = (Record *)(m_buffer + (tail & (m_capacity - 1)));
+        m_tail.store(tail + RingAlign(sizeof(Record) + rec->len), std::memory_order_release);
+    }
+
+    bool LogRing::fits(size_t len) const
+    {
+        return RingAlign(sizeof(Record) + len) <= m_capacity;
+    }
+
+    void LogRing::prepareWait()
+    {
+        m_waiting.store(true, std::memory_order_relaxed);
+        // pairs with the fence in wakeup(): either the consumer sees the flag,
+        // or the next push() sees the room the consumer made
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+    }
+
+    void LogRing::wakeup()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_waiting.load(std::memory_order_relaxed) && m_waiting.exchange(false, std::memory_order_relaxed))
+        {
+            m_space.notify();
+        }
+    }
+
+    /*********************************
+     * class LogRingConsumer
+     *********************************/
+    static ConfigVar<uint32_t>::ptr g_log_ring_size = Config::Lookup("log.ring_size", (uint32_t)(256 * 1024), "bytes of the per-thread asynchronous log ring");
+
+    LogRingConsumer::LogRingConsumer()
+    {
+        m_thread.reset(new Thread(std::bind(&LogRingConsumer::run, this), "log_ring"));
+        LogCrashHandler::SetRingConsumer(this);
+    }
+
+    LogRingConsumer::~LogRingConsumer()
+    {
+        LogCrashHandler::SetRingConsumer(nullptr);
+        {
+            Mutex::Lock lock(m_mutex);
+            m_stop = true;
+        }
+        m_semaphore.notify();
+        m_thread->join();
+        for (auto &i : m_rings)
+        {
+            delete i;
+        }
+    }
+
+    LogRing *LogRingConsumer::registerRing(pid_t tid)
+    {
+        LogRing *ring = new LogRing(g_log_ring_size->getValue(), tid);
+        Mutex::Lock lock(m_mutex);
+        m_rings.push_back(ring);
+        return ring;
+    }
+
+    size_t LogRingConsumer::getRingCount()
+    {
+        Mutex::Lock lock(m_mutex);
+        return m_rings.size();
+    }
+
+    void LogRingConsumer::flush()
+    {
+        drain();
+        flushSinks();
+    }
+
+    void LogRingConsumer::drainUnsafe()
+    {
+        // wait a moment for a thread in drain(), unless it is the one crashing
+        m_crashing.store(true);
+        pid_t tid = GetThreadId();
+        for (int i = 0; i < 100; i++)
+        {
+            pid_t drainer = m_drainer.load();
+            if (drainer == 0 || drainer == tid)
+            {
+                break;
+            }
+            struct timespec ts = {0, 1000000};
+            nanosleep(&ts, nullptr);
+        }
+        for (auto &ring : m_rings)
+        {
+            while (const LogRing::Record *rec = ring->front())
+            {
+                rec->sink->drainUnsafe(rec->data(), rec->len);
+                ring->pop();
+            }
+        }
+    }
+
+    void LogRingConsumer::flushSinks()
+    {
+        // forget the sinks once flushed, their appenders may be destroyed right after
+        Mutex::Lock lock(m_drainMutex);
+        for (auto &i : m_sinks)
+        {
+            i->flush();
+        }
+        m_sinks.clear();
+    }
+
+    size_t LogRingConsumer::drain()
+    {
+        Mutex::Lock drain_lock(m_drainMutex);
+        {
+            Mutex::Lock lock(m_mutex);
+            m_active = m_rings;
+        }
+
+        // the crash handler pops the records itself once this thread is out
+        m_drainer.store(GetThreadId());
+        size_t count = 0;
+        while (true)
+        {
+            if (m_crashing.load())
+            {
+                m_drainer.store(0);
+                return count;
+            }
+            // k-way merge: write the oldest head record of all rings
+            LogRing *oldest = nullptr;
+            const LogRing::Record *rec = nullptr;
+            for (auto &i : m_active)
+            {
+                const LogRing::Record *r = i->front();
+                if (r && (!rec || r->time < rec->time))
+                {
+                    oldest = i;
+                    rec = r;
+                }
+            }
+            if (!rec)
+            {
+                break;
+            }
+
+            if (std::find(m_sinks.begin(), m_sinks.end(), rec->sink) == m_sinks.end())
+            {
+                m_sinks.push_back(rec->sink);
+            }
+            uint64_t dropped = oldest->getDropped();
+            if (dropped != oldest->m_reportedDrops)
+            {
+                std::stringstream ss;
+                ss << "log ring of thread " << oldest->getThreadId() << " overflowed, "
+                   << dropped - oldest->m_reportedDrops << " records dropped" << std::endl;
+                std::string str = ss.str();
+                rec->sink->write(LogLevel::WARN, str.data(), str.size());
+                oldest->m_reportedDrops = dropped;
+            }
+            rec->sink->write((LogLevel::Level)rec->level, rec->data(), rec->len);
+            oldest->pop();
+            ++count;
+        }
+        for (auto &i : m_active)
+        {
+            i->wakeup();
+        }
+
+        // free the rings of the exited threads
+        // retired is checked before emptiness, nothing can be pushed after that
+        Mutex::Lock lock(m_mutex);
+        for (auto it = m_rings.begin(); it != m_rings.end();)
+        {
+            if ((*it)->isRetired() && !(*it)->front())
+            {
+                delete *it;
+                it = m_rings.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+        m_drainer.store(0);
+        return count;
+    }
+
+    void LogRingConsumer::run()
+    {
+        // poll the rings, producers never signal the consumer
+        // back off up to 10ms while the rings stay empty
+        uint32_t idle = 0;
+        while (true)
+        {
+            bool stop;
+            {
+                Mutex::Lock lock(m_mutex);
+                stop = m_stop;
+            }
+            if (drain())
+            {
+                idle = 0;
+                continue;
+            }
+            flushSinks();
+            if (stop)
+            {
+                break;
+            }
+            idle = idle < 10 ? idle + 1 : 10;
+            m_semaphore.timedWait(idle);
+        }
+    }
+
+    /*********************************
+     * class AsyncLogAppender
+     *********************************/
+    AsyncLogAppender::AsyncLogAppender(std::shared_ptr<LogAppender> appender, size_t buffer_size, uint32_t flush_interval, Queue queue)
+        : m_appender(appender), m_bufferSize(buffer_size), m_flushInterval(flush_interval), m_queue(queue)
+    {
+        if (m_bufferSize == 0)
+        {
+            m_bufferSize = 4 * 1024 * 1024;
+        }
+        if (m_flushInterval == 0)
+        {
+            m_flushInterval = 1000;
+        }
+        // the wrapper takes the place of the wrapped appender in the logger
+        // so it inherits the level and the formatter set on it
+        m_level = appender->getLevel();
+        if (appender->hasFormatter())
+        {
+            setFormatter(appender->getFormatter());
+        }
+        // started here rather than by the first drop, which must not allocate
+        LogDropReporterMgr::GetInstance();
+        if (m_queue == RING)
+        {
+            m_consumer = LogRingConsumerMgr::GetInstance();
+            return;
+        }
+        m_front.bytes.reserve(m_bufferSize);
+        m_back.bytes.reserve(m_bufferSize);
+        m_thread.reset(new Thread(std::bind(&AsyncLogAppender::run, this), "log_async"));
+        LogCrashHandler::Register(this, true);
+    }
+
+    AsyncLogAppender::~AsyncLogAppender()
+    {
+        LogCrashHandler::Unregister(this);
+        if (m_queue == RING)
+        {
+            // the rings may still hold records pointing to m_appender
+            m_consumer->flush();
+            return;
+        }
+        {
+            Mutex::Lock lock(m_mutex);
+            m_stop = true;
+        }
+        m_semaphore.notify();
+        m_thread->join();
+    }
+
+    void AsyncLogAppender::drainUnsafe(const char *data, size_t len)
+    {
+        // the back buffer is with the writer thread, what it has not written yet is lost
+        // so are the deferred events, formatting them is not async-signal-safe
+        if (m_queue == BUFFER && !m_front.bytes.empty())
+        {
+            m_appender->drainUnsafe(m_front.bytes.data(), m_front.bytes.size());
+            m_front.bytes.clear();
+        }
+    }
+
+    void AsyncLogAppender::log(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event)
+    {
+        if (level < m_level)
+        {
+            return;
+        }
+        if (m_queue == BUFFER && logger->getFormatOn() == Logger::CONSUMER)
+        {
+            // copy the event by value, the writer formats it
+            const std::string &name = event->getThreadName();
+            const std::string &mdc = event->getMdc();
+            size_t len = name.size() + event->getContentSize() + event->getFieldTextSize() + mdc.size();
+            bool wakeup = false;
+            {
+                Mutex::Lock lock(m_mutex);
+                if (!reserveLocked(lock, level, len))
+                {
+                    lock.unlock();
+                    if (m_overflow == SPILL)
+                    {
+                        LogStream &os = FormatStream();
+                        formatter()->format(os, logger, level, event);
+                        formatted(os.size());
+                        overflowed(logger, level, os.data(), os.size());
+                    }
+                    else
+                    {
+                        dropped(logger.get());
+                    }
+                    return;
+                }
+                m_front.events.push_back(Deferred{m_front.bytes.size(), logger, level, event->getFile(), event->getLine(),
+                    event->getElapse(), event->getThreadId(), event->getFiberId(), event->getTime(), event->getNanoseconds(),
+                    (uint32_t)name.size(), (uint32_t)event->getContentSize(), (uint32_t)event->getFieldTextSize(),
+                    (uint32_t)event->getFields().size(), (uint32_t)mdc.size()});
+                m_front.data.append(name);
+                m_front.data.append(event->getContentData(), event->getContentSize());
+                m_front.data.append(event->getFieldText(), event->getFieldTextSize());
+                m_front.data.append(mdc);
+                m_front.fields.insert(m_front.fields.end(), event->getFields().begin(), event->getFields().end());
+                markLocked(logger);
+                wakeup = queuedLocked(level);
+            }
+            if (wakeup)
+            {
+                m_semaphore.notify();
+            }
+        }
+        else
+        {
+            // format in the producer thread, outside of the lock
+            LogStream &os = FormatStream();
+            formatter()->format(os, logger, level, event);
+            formatted(os.size());
+            push(logger, level, os.data(), os.size());
+        }
+    }
+
+    bool AsyncLogAppender::sharesFormat(const Logger &logger) const
+    {
+        return m_queue != BUFFER || logger.getFormatOn() != Logger::CONSUMER;
+    }
+
+    void AsyncLogAppender::logFormatted(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *data, size_t len)
+    {
+        formatted(len);
+        push(logger, level, data, len);
+    }
+
+    void AsyncLogAppender::write(LogLevel::Level level, const char *data, size_t len)
+    {
+        push(nullptr, level, data, len);
+    }
+
+    void AsyncLogAppender::push(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *data, size_t len)
+    {
+        if (m_queue == RING)
+        {
+            LogRing *ring = Thread::GetLogRing();
+            uint64_t time = MonotonicNS();
+            if (ZCSERVER_LIKELY(ring->push(m_appender.get(), level, time, data, len)))
+            {
+                m_counters.queueDepth.max(ring->getUsed());
+                return;
+            }
+            if ((m_overflow == BLOCK || (m_overflow == DROP_BELOW && level >= m_overflowLevel)) && ring->fits(len))
+            {
+                // the consumer polls the rings, wake it up and sleep until it drained this one
+                do
+                {
+                    ring->prepareWait();
+                    m_consumer->notify();
+                    if (ring->push(m_appender.get(), level, time, data, len))
+                    {
+                        break;
+                    }
+                    ring->wait();
+                } while (!ring->push(m_appender.get(), level, time, data, len));
+            }
+            else if (m_overflow == SPILL)
+            {
+                overflowed(logger, level, data, len);
+            }
+            else
+            {
+                ring->drop();
+                dropped(logger.get());
+            }
+            return;
+        }
+        bool wakeup = false;
+        {
+            Mutex::Lock lock(m_mutex);
+            if (!reserveLocked(lock, level, len))
+            {
+                lock.unlock();
+                overflowed(logger, level, data, len);
+                return;
+            }
+            m_front.bytes.append(data, len);
+            markLocked(logger);
+            wakeup = queuedLocked(level);
+        }
+        if (wakeup)
+        {
+            m_semaphore.notify();
+        }
+    }
+
+    bool AsyncLogAppender::queuedLocked(LogLevel::Level level)
+    {
+        if (level > m_frontLevel)
+        {
+            m_frontLevel = level;
+        }
+        m_counters.queueDepth.max(m_front.size());
+        // only the first producer that fills the buffer wakes up the writer
+        if (m_front.size() >= m_bufferSize && !m_notified)
+        {
+            m_notified = true;
+            return true;
+        }
+        return false;
+    }
+
+    bool AsyncLogAppender::reserveLocked(Mutex::Lock &lock, LogLevel::Level level, size_t len)
+    {
+        if (ZCSERVER_LIKELY(!m_maxBytes || m_front.size() + len <= m_maxBytes))
+        {
+            return true;
+        }
+        switch (m_overflow)
+        {
+        case BLOCK:
+            // a line larger than the bound goes into an empty buffer
+            while (!m_front.bytes.empty() || !m_front.events.empty())
+            {
+                if (m_front.size() + len <= m_maxBytes || m_stop)
+                {
+                    break;
+                }
+                ++m_blocked;
+                m_notified = true;
+                lock.unlock();
+                m_semaphore.notify();
+                m_space.wait();
+                lock.lock();
+            }
+            return true;
+        case DROP_OLDEST:
+            dropOldestLocked(len);
+            return true;
+        case DROP_BELOW:
+            return level >= m_overflowLevel;
+        default:
+            return false;
+        }
+    }
+
+    void AsyncLogAppender::markLocked(const std::shared_ptr<Logger> &logger)
+    {
+        if (m_overflow == DROP_OLDEST && m_maxBytes)
+        {
+            Logger *ptr = logger.get();
+            std::vector<Mark> &marks = m_front.marks;
+            std::vector<std::shared_ptr<Logger>> &loggers = m_front.loggers;
+            // a reference once per logger and buffer, not per line
+            if (ptr && (marks.empty() || marks.back().logger != ptr)
+                && std::find_if(loggers.begin(), loggers.end(), [ptr](const std::shared_ptr<Logger> &i) { return i.get() == ptr; }) == loggers.end())
+            {
+                loggers.push_back(logger);
+            }
+            marks.push_back(Mark{m_front.bytes.size(), m_front.events.size(), m_front.data.size(), m_front.fields.size(), ptr});
+        }
+    }
+
+    void AsyncLogAppender::dropOldestLocked(size_t len)
+    {
+        std::vector<Mark> &marks = m_front.marks;
+        if (marks.empty())
+        {
+            return;
+        }
+        // make room for an eighth of the bound more, the rest of the buffer is moved once
+        size_t need = m_front.size() + len - m_maxBytes + m_maxBytes / 8;
+        size_t count = 0;
+        while (count + 1 < marks.size() && marks[count].bytes + marks[count].data < need)
+        {
+            ++count;
+        }
+        ++count;
+        Mark cut = marks[count - 1];
+        for (size_t i = 0; i < count; i++)
+        {
+            dropped(marks[i].logger);
+        }
+        marks.erase(marks.begin(), marks.begin() + count);
+        for (auto &i : marks)
+        {
+            i.bytes -= cut.bytes;
+            i.events -= cut.events;
+            i.data -= cut.data;
+            i.fields -= cut.fields;
+        }
+        m_front.bytes.erase(0, cut.bytes);
+        m_front.events.erase(m_front.events.begin(), m_front.events.begin() + cut.events);
+        for (auto &i : m_front.events)
+        {
+            i.offset -= cut.bytes;
+        }
+        m_front.data.erase(0, cut.data);
+        m_front.fields.erase(m_front.fields.begin(), m_front.fields.begin() + cut.fields);
+    }
+
+    void AsyncLogAppender::overflowed(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *data, size_t len)
+    {
+        if (m_overflow == SPILL)
+        {
+            m_spill->write(level, data, len);
+            m_spilled.fetch_add(1, std::memory_order_relaxed);
+        }
+        else
+        {
+            dropped(logger.get());
+        }
+    }
+
+    void AsyncLogAppender::dropped(Logger *logger)
+    {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        if (logger)
+        {
+            logger->addDropped(1);
+        }
+    }
+
+    const char *AsyncLogAppender::ToString(Overflow overflow)
+    {
+        switch (overflow)
+        {
+        case BLOCK:
+            return "block";
+        case DROP_NEWEST:
+            return "drop_newest";
+        case DROP_OLDEST:
+            return "drop_oldest";
+        case DROP_BELOW:
+            return "drop_below";
+        case SPILL:
+            return "spill";
+        }
+        return "drop_newest";
+    }
+
+    bool AsyncLogAppender::FromString(const std::string &str, Overflow &overflow)
+    {
+        for (int i = BLOCK; i <= SPILL; i++)
+        {
+            if (str == ToString((Overflow)i))
+            {
+                overflow = (Overflow)i;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void AsyncLogAppender::setOverflow(size_t max_bytes, Overflow overflow, LogLevel::Level level, const std::string &file)
+    {
+        Mutex::Lock lock(m_mutex);
+        if (overflow == DROP_OLDEST && m_queue == RING)
+        {
+            // only the consumer pops a ring
+            std::cout << "AsyncLogAppender setOverflow drop_oldest is not supported by queue ring, drop_newest is used" << std::endl;
+            overflow = DROP_NEWEST;
+        }
+        m_maxBytes = m_queue == RING ? 0 : max_bytes;
+        m_overflow = overflow;
+        m_overflowLevel = level;
+        m_overflowFile = file;
+        m_spill.reset();
+        if (overflow == SPILL)
+        {
+            m_spill.reset(new FileLogAppender(file));
+        }
+    }
+
+    void AsyncLogAppender::flush()
+    {
+        if (m_spill)
+        {
+            m_spill->flush();
+        }
+        if (m_queue == RING)
+        {
+            m_consumer->flush();
+            return;
+        }
+        drain();
+        m_appender->flush();
+    }
+
+    void AsyncLogAppender::drain()
+    {
+        Mutex::Lock write_lock(m_writeMutex);
+        LogLevel::Level level;
+        size_t blocked;
+        {
+            Mutex::Lock lock(m_mutex);
+            m_front.swap(m_back);
+            level = m_frontLevel;
+            m_frontLevel = LogLevel::UNKNOWN;
+            m_notified = false;
+            blocked = m_blocked;
+            m_blocked = 0;
+        }
+        // the loggers of the marks are released in the writer thread
+        m_back.marks.clear();
+        m_back.loggers.clear();
+        while (blocked--)
+        {
+            m_space.notify();
+        }
+        if (!m_back.events.empty())
+        {
+            formatDeferred();
+            m_back.bytes.swap(m_formatted);
+        }
+        if (!m_back.bytes.empty())
+        {
+            // the time the writer spends on a buffer
+            uint64_t begin = MonotonicNS();
+            m_appender->write(level, m_back.bytes.data(), m_back.bytes.size());
+            m_counters.bytesWritten.add(m_back.bytes.size());
+            m_counters.flushLatency.record(MonotonicNS() - begin);
+            m_back.bytes.clear();
+        }
+    }
+
+    void AsyncLogAppender::formatDeferred()
+    {
+        if (!m_event)
+        {
+            m_event.reset(new LogEvent(nullptr, LogLevel::UNKNOWN, nullptr, 0, 0, 0, 0, 0));
+        }
+        LogEvent &event = *m_event;
+        // the events go between the bytes queued before and after them
+        m_formatted.clear();
+        size_t pos = 0;
+        const char *data = m_back.data.data();
+        const LogField *fields = m_back.fields.data();
+        LogStream &os = FormatStream();
+        // the formatter may be replaced while the writer uses it
+        Epoch::ReadGuard guard;
+        LogFormatter *formatter = this->formatter();
+        for (auto &i : m_back.events)
+        {
+            m_formatted.append(m_back.bytes, pos, i.offset - pos);
+            pos = i.offset;
+
+            event.reset(i.logger, i.level, i.file, i.line, i.elapse, i.tid, i.fid, i.time, i.nsec);
+            event.m_threadName.assign(data, i.nameLen);
+            data += i.nameLen;
+            event.m_ss.write(data, i.contentLen);
+            data += i.contentLen;
+            event.m_fieldText.assign(data, i.fieldTextLen);
+            data += i.fieldTextLen;
+            event.m_mdc.assign(data, i.mdcLen);
+            data += i.mdcLen;
+            event.m_fields.assign(fields, fields + i.fieldCount);
+            fields += i.fieldCount;
+
+            os.reset();
+            formatter->format(os, i.logger, i.level, m_event);
+            formatted(os.size());
+            m_formatted.append(os.data(), os.size());
+        }
+        m_formatted.append(m_back.bytes, pos, std::string::npos);
+        m_back.events.clear();
+        m_back.data.clear();
+        m_back.fields.clear();
+        // the last logger is not kept alive by the event
+        event.m_logger.reset();
+    }
+
+    void AsyncLogAppender::Queued::swap(Queued &oth)
+    {
+        bytes.swap(oth.bytes);
+        events.swap(oth.events);
+        data.swap(oth.data);
+        fields.swap(oth.fields);
+        marks.swap(oth.marks);
+        loggers.swap(oth.loggers);
+    }
+
+    void AsyncLogAppender::run()
+    {
+        while (true)
+        {
+            m_semaphore.timedWait(m_flushInterval);
+            bool stop;
+            {
+                Mutex::Lock lock(m_mutex);
+                stop = m_stop;
+            }
+            drain();
+            m_appender->flush();
+            if (m_spill)
+            {
+                m_spill->flush();
+            }
+            if (stop)
+            {
+                break;
+            }
+        }
+    }
+
+    std::string AsyncLogAppender::toYamlString()
+    {
+        YAML::Node node = YAML::Load(m_appender->toYamlString());
+        node["async"] = true;
+        if (m_queue == RING)
+        {
+            node["queue"] = "ring";
+        }
+        else
+        {
+            node["buffer_size"] = m_bufferSize;
+            node["flush_interval"] = m_flushInterval;
+        }
+        if (m_maxBytes || m_overflow != DROP_NEWEST)
+        {
+            node["overflow"]["policy"] = ToString(m_overflow);
+            if (m_maxBytes)
+                node["overflow"]["max_bytes"] = m_maxBytes;
+            if (m_overflow == DROP_BELOW)
+                node["overflow"]["level"] = LogLevel::ToString(m_overflowLevel);
+            if (m_overflow == SPILL)
+                node["overflow"]["file"] = m_overflowFile;
+        }
+        std::stringstream ss;
+        ss << node;
+        return ss.str();
+    }
+
+    LogAppenderMetrics AsyncLogAppender::getMetrics()
+    {
+        LogAppenderMetrics metrics = LogAppender::getMetrics();
+        metrics.type = "AsyncLogAppender";
+        metrics.file.clear();
+        metrics.dropped = getDropped();
+        metrics.wrapped.push_back(m_appender->getMetrics());
+        if (m_spill)
+        {
+            metrics.wrapped.push_back(m_spill->getMetrics());
+        }
+        return metrics;
+    }
+
+    /*********************************
+     * class LogDropReporter
+     *********************************/
+    static ConfigVar<uint32_t>::ptr g_log_drop_report_interval =
+        Config::Lookup("log.drop_report_interval", (uint32_t)10000, "ms between two reports of the dropped log lines");
+
+    LogDropReporter::LogDropReporter()
+        : m_lastReport(MonotonicMS())
+    {
+        m_thread.reset(new Thread(std::bind(&LogDropReporter::run, this), "log_drops"));
+    }
+
+    LogDropReporter::~LogDropReporter()
+    {
+        {
+            Mutex::Lock lock(m_mutex);
+            m_stop = true;
+        }
+        m_semaphore.notify();
+        m_thread->join();
+    }
+
+    uint64_t LogDropReporter::report()
+    {
+        uint64_t total = 0;
+        uint64_t elapsed;
+        std::stringstream ss;
+        {
+            Mutex::Lock lock(m_mutex);
+            uint64_t now = MonotonicMS();
+            elapsed = now - m_lastReport;
+            m_lastReport = now;
+            Mutex::Lock loggers_lock(Logger::GetMutex());
+            for (auto logger : Logger::GetLoggers())
+            {
+                uint64_t dropped = logger->getDropped();
+                if (dropped != logger->m_reported)
+                {
+                    ss << (total ? " " : "") << logger->getName() << "=" << dropped - logger->m_reported;
+                    total += dropped - logger->m_reported;
+                    logger->m_reported = dropped;
+                }
+            }
+        }
+        if (total)
+        {
+            // outside of the locks, the line may be dropped and counted again
+            ZCSERVER_LOG_WARN(ZCSERVER_LOG_NAME("system")).kv("dropped", total)
+                << "log queues dropped " << total << " lines in " << elapsed << "ms: " << ss.str();
+        }
+        return total;
+    }
+
+    void LogDropReporter::run()
+    {
+        while (true)
+        {
+            m_semaphore.timedWait(g_log_drop_report_interval->getValue());
+            {
+                Mutex::Lock lock(m_mutex);
+                if (m_stop)
+                {
+                    break;
+                }
+            }
+            report();
+        }
+    }
+
+    /*********************************
+     * class LogCrashHandler
+     *********************************/
+    // fixed slots, the handler reads them without a lock
+    static const size_t s_crash_slots = 1024;
+    static std::atomic<LogAppender *> s_crash_appenders[s_crash_slots];
+    static std::atomic<bool> s_crash_wrappers[s_crash_slots];
+    static std::atomic<LogRingConsumer *> s_crash_consumer{nullptr};
+    // the thread id in the handler, a second crash of it skips the drain
+    static std::atomic<pid_t> s_crash_tid{0};
+
+    static const int s_crash_signals[] = {SIGSEGV, SIGABRT, SIGBUS, SIGFPE};
+    static struct sigaction s_crash_old[sizeof(s_crash_signals) / sizeof(s_crash_signals[0])];
+    static bool s_crash_installed = false;
+
+    // registration and FlushAll
+    static Mutex &CrashMutex()
+    {
+        static Mutex s_mutex;
+        return s_mutex;
+    }
+
+    static void CrashHandler(int sig)
+    {
+        LogCrashHandler::Drain(sig);
+        // back to the previous action, it runs when the signal is raised again
+        for (size_t i = 0; i < sizeof(s_crash_signals) / sizeof(s_crash_signals[0]); i++)
+        {
+            if (s_crash_signals[i] == sig)
+            {
+                sigaction(sig, &s_crash_old[i], nullptr);
+            }
+        }
+        raise(sig);
+    }
+
+    void LogCrashHandler::Install()
+    {
+        Mutex::Lock lock(CrashMutex());
+        if (s_crash_installed)
+        {
+            return;
+        }
+        s_crash_installed = true;
+        // backtrace() loads libgcc the first time, not in the handler
+        void *frames[1];
+        backtrace(frames, 1);
+        // a stack overflow of the installing thread still reaches the handler,
+        // an alternate stack the application set up is kept
+        static char s_altstack[64 * 1024];
+        stack_t old;
+        if (sigaltstack(nullptr, &old) == 0 && (old.ss_flags & SS_DISABLE))
+        {
+            stack_t ss;
+            ss.ss_sp = s_altstack;
+            ss.ss_size = sizeof(s_altstack);
+            ss.ss_flags = 0;
+            sigaltstack(&ss, nullptr);
+        }
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = CrashHandler;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_ONSTACK;
+        for (size_t i = 0; i < sizeof(s_crash_signals) / sizeof(s_crash_signals[0]); i++)
+        {
+            sigaction(s_crash_signals[i], &sa, &s_crash_old[i]);
+        }
+    }
+
+    void LogCrashHandler::Uninstall()
+    {
+        Mutex::Lock lock(CrashMutex());
+        if (!s_crash_installed)
+        {
+            return;
+        }
+        s_crash_installed = false;
+        for (size_t i = 0; i < sizeof(s_crash_signals) / sizeof(s_crash_signals[0]); i++)
+        {
+            sigaction(s_crash_signals[i], &s_crash_old[i], nullptr);
+        }
+    }
+
+    static ConfigVar<bool>::ptr g_log_crash_handler =
+        Config::Lookup("log.crash_handler", false, "install the LogCrashHandler for SIGSEGV, SIGABRT, SIGBUS and SIGFPE");
+
+    struct LogCrashHandlerIniter
+    {
+        LogCrashHandlerIniter()
+        {
+            if (g_log_crash_handler->getValue())
+            {
+                LogCrashHandler::Install();
+            }
+            g_log_crash_handler->addListener(0xC4A540, [](const bool &old_value, const bool &new_value) {
+                if (new_value)
+                    LogCrashHandler::Install();
+                else
+                    LogCrashHandler::Uninstall();
+            });
+        }
+    };
+
+    static LogCrashHandlerIniter s_log_crash_handler_initer;
+
+    void LogCrashHandler::Register(LogAppender *appender, bool wrapper)
+    {
+        Mutex::Lock lock(CrashMutex());
+        for (size_t i = 0; i < s_crash_slots; i++)
+        {
+            if (!s_crash_appenders[i].load(std::memory_order_relaxed))
+            {
+                s_crash_wrappers[i].store(wrapper, std::memory_order_relaxed);
+                s_crash_appenders[i].store(appender, std::memory_order_release);
+                return;
+            }
+        }
+    }
+
+    void LogCrashHandler::Unregister(LogAppender *appender)
+    {
+        Mutex::Lock lock(CrashMutex());
+        for (size_t i = 0; i < s_crash_slots; i++)
+        {
+            if (s_crash_appenders[i].load(std::memory_order_relaxed) == appender)
+            {
+                s_crash_appenders[i].store(nullptr, std::memory_order_release);
+                return;
+            }
+        }
+    }
+
+    void LogCrashHandler::SetRingConsumer(LogRingConsumer *consumer)
+    {
+        s_crash_consumer.store(consumer, std::memory_order_release);
+    }
+
+    void LogCrashHandler::FlushAll()
+    {
+        LogRingConsumer *consumer = s_crash_consumer.load(std::memory_order_acquire);
+        if (consumer)
+        {
+            consumer->flush();
+        }
+        // an appender unregisters before it is destroyed, it waits for this
+        Mutex::Lock lock(CrashMutex());
+        for (int wrappers = 1; wrappers >= 0; wrappers--)
+        {
+            for (size_t i = 0; i < s_crash_slots; i++)
+            {
+                LogAppender *appender = s_crash_appenders[i].load(std::memory_order_acquire);
+                if (appender && s_crash_wrappers[i].load(std::memory_order_relaxed) == (bool)wrappers)
+                {
+                    appender->flush();
+                }
+            }
+        }
+    }
+
+    // async-signal-safe formatting into a fixed buffer
+    struct CrashBuffer
+    {
+        char data[256];
+        size_t size = 0;
+
+        void append(const char *str)
+        {
+            while (*str && size < sizeof(data))
+            {
+                data[size++] = *str++;
+            }
+        }
+        void append(uint64_t v, int width = 0)
+        {
+            char digits[20];
+            int n = 0;
+            do
+            {
+                digits[n++] = '0' + v % 10;
+                v /= 10;
+            } while (v);
+            while (n < width && size < sizeof(data))
+            {
+                data[size++] = '0';
+                --width;
+            }
+            while (n > 0 && size < sizeof(data))
+            {
+                data[size++] = digits[--n];
+            }
+        }
+    };
+
+    void LogCrashHandler::Drain(int sig)
+    {
+        pid_t tid = GetThreadId();
+        pid_t expected = 0;
+        if (!s_crash_tid.compare_exchange_strong(expected, tid))
+        {
+            if (expected == tid)
+            {
+                // crashed again while draining
+                return;
+            }
+            // another thread is draining and ends the process
+            while (true)
+            {
+                pause();
+            }
+        }
+
+        // 2024-01-01 12:00:00 UTC	tid	[FATAL]	[crash]	signal 11 (SIGSEGV)
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t days = ts.tv_sec / 86400;
+        uint64_t secs = ts.tv_sec % 86400;
+        // civil date from days since 1970-01-01
+        uint64_t z = days + 719468;
+        uint64_t era = z / 146097;
+        uint64_t doe = z - era * 146097;
+        uint64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        uint64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        uint64_t mp = (5 * doy + 2) / 153;
+        uint64_t day = doy - (153 * mp + 2) / 5 + 1;
+        uint64_t month = mp < 10 ? mp + 3 : mp - 9;
+        uint64_t year = yoe + era * 400 + (month <= 2);
+        const char *name = sig == SIGSEGV ? "SIGSEGV" : sig == SIGABRT ? "SIGABRT" : sig == SIGBUS ? "SIGBUS" : sig == SIGFPE ? "SIGFPE" : "?";
+
+        CrashBuffer record;
+        record.append(year);
+        record.append("-");
+        record.append(month, 2);
+        record.append("-");
+        record.append(day, 2);
+        record.append(" ");
+        record.append(secs / 3600, 2);
+        record.append(":");
+        record.append(secs / 60 % 60, 2);
+        record.append(":");
+        record.append(secs % 60, 2);
+        record.append(" UTC\t");
+        record.append(tid);
+        record.append("\t[FATAL]\t[crash]\tsignal ");
+        record.append(sig);
+        record.append(" (");
+        record.append(name);
+        record.append(")\n");
+
+        // the rings and the wrappers write into the appenders they wrap
+        LogRingConsumer *consumer = s_crash_consumer.load(std::memory_order_acquire);
+        if (consumer)
+        {
+            consumer->drainUnsafe();
+        }
+        for (int wrappers = 1; wrappers >= 0; wrappers--)
+        {
+            for (size_t i = 0; i < s_crash_slots; i++)
+            {
+                LogAppender *appender = s_crash_appenders[i].load(std::memory_order_acquire);
+                if (appender && s_crash_wrappers[i].load(std::memory_order_relaxed) == (bool)wrappers)
+                {
+                    if (wrappers)
+                        appender->drainUnsafe(nullptr, 0);
+                    else
+                        appender->drainUnsafe(record.data, record.size);
+                }
+            }
+        }
+
+        ssize_t rt = ::write(STDERR_FILENO, record.data, record.size);
+        (void)rt;
+        void *frames[64];
+        int count = backtrace(frames, 64);
+        backtrace_symbols_fd(frames, count, STDERR_FILENO);
+    }
+
+    /*********************************
+     * class CoalescingLogAppender
+     *********************************/
+    // FNV-1a
+    static uint64_t HashBytes(uint64_t hash, const void *data, size_t len)
+    {
+        const unsigned char *p = (const unsigned char *)data;
+        for (size_t i = 0; i < len; i++)
+        {
+            hash ^= p[i];
+            hash *= 1099511628211ul;
+        }
+        return hash;
+    }
+
+    CoalescingLogAppender::CoalescingLogAppender(std::shared_ptr<LogAppender> appender, uint32_t window)
+        : m_appender(appender), m_window(window)
+    {
+        if (m_window == 0)
+        {
+            m_window = 1000;
+        }
+        // takes the place of the wrapped appender like AsyncLogAppender
+        m_level = appender->getLevel();
+        if (appender->hasFormatter())
+        {
+            setFormatter(appender->getFormatter());
+        }
+        m_nameLogger.reset(new Logger("", Logger::NameOnly()));
+        m_timer = LogTimerMgr::GetInstance();
+        m_timer->add(this, m_window, [this](uint64_t now) { expire(now); });
+    }
+
+    CoalescingLogAppender::~CoalescingLogAppender()
+    {
+        m_timer->del(this);
+        Mutex::Lock lock(m_mutex);
+        repeatedLocked();
+    }
+
+    void CoalescingLogAppender::log(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event)
+    {
+        if (level < m_level)
+        {
+            return;
+        }
+        // the file is a literal of the call site, its address is enough
+        const Logger *ptr = logger.get();
+        const char *file = event->getFile();
+        int32_t line = event->getLine();
+        static thread_local std::string t_key;
+        t_key.clear();
+        t_key.append((const char *)&ptr, sizeof(ptr));
+        t_key.append((const char *)&level, sizeof(level));
+        t_key.append((const char *)&file, sizeof(file));
+        t_key.append((const char *)&line, sizeof(line));
+        t_key.append(event->getContentData(), event->getContentSize());
+        for (auto &i : event->getFields())
+        {
+            t_key.append((const char *)&i.type, sizeof(i.type));
+            if (i.type != LogField::STRING)
+                t_key.append((const char *)&i.value.u, sizeof(i.value.u));
+        }
+        t_key.append(event->getFieldText(), event->getFieldTextSize());
+        uint64_t hash = HashBytes(14695981039346656037ul, t_key.data(), t_key.size());
+
+        uint64_t now = MonotonicMS();
+        Mutex::Lock lock(m_mutex);
+        // the bytes decide, two messages with the same hash are not merged
+        if (hash == m_hash && m_lastLevel != LogLevel::UNKNOWN && t_key == m_key)
+        {
+            ++m_repeats;
+            if (now - m_lastWrite >= m_window)
+            {
+                repeatedLocked();
+                m_lastWrite = now;
+            }
+            return;
+        }
+        repeatedLocked();
+        m_hash = hash;
+        m_key.assign(t_key);
+        m_lastWrite = now;
+        m_logger = logger;
+        m_loggerName = logger->getName();
+        m_lastLevel = level;
+        m_file = file;
+        m_line = line;
+
+        LogStream &os = FormatStream();
+        formatter()->format(os, logger, level, event);
+        formatted(os.size());
+        m_appender->write(level, os.data(), os.size());
+    }
+
+    void CoalescingLogAppender::repeatedLocked()
+    {
+        if (m_repeats == 0)
+        {
+            return;
+        }
+        std::shared_ptr<Logger> logger = m_logger.lock();
+        if (!logger)
+        {
+            // only the name is formatted, only used under m_mutex
+            m_nameLogger->m_name = m_loggerName;
+            logger = m_nameLogger;
+        }
+        auto event = LogEvent::Create(logger, m_lastLevel, m_file, m_line);
+        event->getSS() << "last message repeated " << m_repeats << " times";
+        m_repeats = 0;
+        LogStream &os = FormatStream();
+        // also called from flush(), outside of the read section of Logger::log
+        Epoch::ReadGuard guard;
+        formatter()->format(os, logger, m_lastLevel, event);
+        formatted(os.size());
+        m_appender->write(m_lastLevel, os.data(), os.size());
+    }
+
+    void CoalescingLogAppender::expire(uint64_t now)
+    {
+        Mutex::Lock lock(m_mutex);
+        if (m_repeats && now - m_lastWrite >= m_window)
+        {
+            repeatedLocked();
+            m_lastWrite = now;
+        }
+    }
+
+    void CoalescingLogAppender::write(LogLevel::Level level, const char *data, size_t len)
+    {
+        Mutex::Lock lock(m_mutex);
+        repeatedLocked();
+        m_lastLevel = LogLevel::UNKNOWN;
+        m_appender->write(level, data, len);
+    }
+
+    void CoalescingLogAppender::flush()
+    {
+        {
+            Mutex::Lock lock(m_mutex);
+            repeatedLocked();
+            m_lastWrite = MonotonicMS();
+        }
+        m_appender->flush();
+    }
+
+    std::string CoalescingLogAppender::toYamlString()
+    {
+        YAML::Node node = YAML::Load(m_appender->toYamlString());
+        node["coalesce"] = m_window;
+        std::stringstream ss;
+        ss << node;
+        return ss.str();
+    }
+
+    LogAppenderMetrics CoalescingLogAppender::getMetrics()
+    {
+        LogAppenderMetrics metrics = LogAppender::getMetrics();
+        metrics.type = "CoalescingLogAppender";
+        metrics.file.clear();
+        metrics.wrapped.push_back(m_appender->getMetrics());
+        return metrics;
+    }
+
+    /*********************************
+     * class LogLimiter
+     *********************************/
+    bool LogLimiter::everyN(uint64_t n, uint64_t &suppressed)
+    {
+        uint64_t count = m_count.fetch_add(1, std::memory_order_relaxed);
+        if (n <= 1 || count % n == 0)
+        {
+            suppressed = count == 0 || n <= 1 ? 0 : n - 1;
+            return true;
+        }
+        return false;
+    }
+
+    bool LogLimiter::firstN(uint64_t n)
+    {
+        // no more writes to the shared line once the site is done
+        if (m_count.load(std::memory_order_relaxed) >= n)
+        {
+            return false;
+        }
+        return m_count.fetch_add(1, std::memory_order_relaxed) < n;
+    }
+
+    bool LogLimiter::everyMs(uint64_t ms, uint64_t &suppressed)
+    {
+        uint64_t now = MonotonicNS();
+        uint64_t last = m_time.load(std::memory_order_relaxed);
+        while (last == 0 || now - last >= ms * 1000000ul)
+        {
+            if (m_time.compare_exchange_weak(last, now, std::memory_order_relaxed))
+            {
+                suppressed = m_suppressed.exchange(0, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        m_suppressed.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    bool LogLimiter::rate(double per_sec, uint64_t &suppressed)
+    {
+        if (per_sec <= 0)
+        {
+            return true;
+        }
+        // every message moves the theoretical arrival time by one interval,
+        // a message is dropped when that would run more than a burst ahead of now
+        uint64_t interval = (uint64_t)(1e9 / per_sec);
+        uint64_t limit = (uint64_t)(interval * std::max(per_sec, 1.0));
+        uint64_t now = MonotonicNS();
+        uint64_t tat = m_time.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            uint64_t next = std::max(tat, now) + interval;
+            if (next - now > limit)
+            {
+                m_suppressed.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            if (m_time.compare_exchange_weak(tat, next, std::memory_order_relaxed))
+            {
+                suppressed = m_suppressed.exchange(0, std::memory_order_relaxed);
+                return true;
+            }
+        }
+    }
+
+    /*********************************
+     * class Logger
+     *********************************/
+    static std::atomic<uint64_t> s_generation{0};
+
+    std::atomic<bool> Logger::s_countFiltered{false};
+
+    // the striped counter is a shared write, kept off the disabled statements unless asked for
+    static ConfigVar<bool>::ptr g_log_count_filtered =
+        Config::Lookup("log.count_filtered", false, "count the statements below the level of their logger in the metrics");
+
+    struct LogCountFilteredIniter
+    {
+        LogCountFilteredIniter()
+        {
+            Logger::SetCountFiltered(g_log_count_filtered->getValue());
+            g_log_count_filtered->addListener(0xF1E232, [](const bool &old_value, const bool &new_value) {
+                Logger::SetCountFiltered(new_value);
+            });
+        }
+    };
+
+    static LogCountFilteredIniter s_log_count_filtered_initer;
+
+    Logger::Logger(const std::string &name, NameOnly)
+        : m_name(name), m_level(LogLevel::DEBUG), m_effectiveLevel(LogLevel::DEBUG), m_effective(new Snapshot), m_generation(0),
+          m_rateLimit(0), m_formatOn(PRODUCER), m_dropped(0)
+    {
+        // %d{%Y-%m-%d %H:%M:%S}%T%t%T%F%T[%p]%T[%c]%T%f:%l%T%m%n
+        m_formatter.reset(new DefaultLogFormatter);
+    }
+
+    Logger::Logger(const std::string &name)
+        : Logger(name, NameOnly())
+    {
+        Mutex::Lock lock(GetMutex());
+        GetLoggers().push_back(this);
+    }
+
+    Logger::~Logger()
     {
-        std::stringstream ss;
-        for (auto &i : m_items)
         {
-            // using subclass method "format"
-            i->format(ss, logger, level, event);
+            Mutex::Lock lock(GetMutex());
+            auto &loggers = GetLoggers();
+            loggers.erase(std::remove(loggers.begin(), loggers.end(), this), loggers.end());
+            if (m_parent)
+            {
+                auto &children = m_parent->m_children;
+                children.erase(std::remove(children.begin(), children.end(), this), children.end());
+            }
         }
-        return ss.str();
+        // nobody logs to a logger that is being destroyed
+        delete m_effective.load();
     }
 
-    /*********************************
-     * class StdoutLogAppender
-     *********************************/
-    void StdoutLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event)
+    Mutex &Logger::GetMutex()
     {
-        if (level >= m_level)
+        static Mutex s_mutex;
+        return s_mutex;
+    }
+
+    std::vector<Logger *> &Logger::GetLoggers()
+    {
+        static std::vector<Logger *> s_loggers;
+        return s_loggers;
+    }
+
+    void Logger::Retire(Retired &retired)
+    {
+        if (retired.snapshots.empty() && retired.formatters.empty())
         {
-            std::cout << m_formatter->format(logger, level, event);
+            return;
         }
+        std::shared_ptr<Retired> batch(new Retired);
+        batch->snapshots.swap(retired.snapshots);
+        batch->formatters.swap(retired.formatters);
+        // one grace period for everything the change replaced
+        Epoch::Retire([batch]()
+        {
+            for (auto i : batch->snapshots)
+            {
+                delete i;
+            }
+            batch->snapshots.clear();
+            batch->formatters.clear();
+        });
     }
 
-    std::string StdoutLogAppender::toYamlString()
+    void Logger::resolveLocked(uint64_t generation, Retired &retired)
     {
-        YAML::Node node;
-        node["type"] = "StdoutLogAppender";
-        if (m_level != LogLevel::UNKNOWN)
-            node["level"] = LogLevel::ToString(m_level);
-        if (m_hasFormatter && m_formatter)
+        LogLevel::Level level = m_level;
+        if (level == LogLevel::UNKNOWN && m_parent)
         {
-            node["formatter"] = m_formatter->getPattern();
+            level = m_parent->getLevel();
+        }
+        m_effectiveLevel.store(level, std::memory_order_relaxed);
+
+        Snapshot *snapshot = new Snapshot;
+        if (!m_appenders.empty() || !m_parent)
+            snapshot->appenders = m_appenders;
+        else
+            snapshot->appenders = m_parent->m_effective.load(std::memory_order_relaxed)->appenders;
+        for (auto &i : snapshot->appenders)
+        {
+            snapshot->formatters.push_back(i->getFormatter());
+            snapshot->shares.push_back(i->sharesFormat(*this));
+        }
+        retired.snapshots.push_back(m_effective.exchange(snapshot, std::memory_order_seq_cst));
+        m_generation.store(generation, std::memory_order_relaxed);
+
+        for (auto i : m_children)
+        {
+            i->resolveLocked(generation, retired);
         }
-        std::stringstream ss;
-        ss << node;
-        return ss.str();
     }
 
-    void LogAppender::setFormatter(std::shared_ptr<LogFormatter> val) 
+    void Logger::changedLocked(Retired &retired)
     {
-        m_formatter = val;
-        if (m_formatter)
-            m_hasFormatter = true;
-        else
-            m_hasFormatter = false;
+        resolveLocked(++s_generation, retired);
     }
 
+    void Logger::Refresh()
+    {
+        Retired retired;
+        {
+            Mutex::Lock lock(GetMutex());
+            uint64_t generation = ++s_generation;
+            for (auto i : GetLoggers())
+            {
+                // the others are resolved with their parents
+                if (!i->m_parent)
+                {
+                    i->resolveLocked(generation, retired);
+                }
+            }
+        }
+        Retire(retired);
+    }
 
-    /*********************************
-     * class FileLogAppender
-     *********************************/
-    FileLogAppender::FileLogAppender(const std::string &filename)
-        : m_filename(filename)
+    void Logger::addDropped(uint64_t count)
     {
-        reopen();
+        // the LogDropReporter polls the counter
+        m_dropped.fetch_add(count, std::memory_order_relaxed);
     }
 
-    bool FileLogAppender::reopen()
+    LoggerMetrics Logger::getMetrics()
     {
-        if (m_filestream)
+        LoggerMetrics metrics;
+        metrics.name = m_name;
+        metrics.events = m_events.get();
+        metrics.filtered = m_filtered.get();
+        metrics.dropped = getDropped();
+        Appenders appenders;
+        {
+            Mutex::Lock lock(GetMutex());
+            appenders = m_appenders;
+        }
+        for (auto &i : appenders)
         {
-            m_filestream.close();
+            metrics.appenders.push_back(i->getMetrics());
         }
-        m_filestream.open(m_filename, std::ios::app);
-        return !!m_filestream;
+        return metrics;
     }
 
-    void FileLogAppender::log(std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event)
+    void Logger::setParent(std::shared_ptr<Logger> parent)
     {
-        if (level >= m_level)
+        Retired retired;
+        Mutex::Lock lock(GetMutex());
+        m_parent = parent;
+        parent->m_children.push_back(this);
+        changedLocked(retired);
+        // a new logger, not yet returned by getLogger: nobody has read the snapshot it replaces,
+        // and the lookups do not wait for a grace period under the shard lock
+        for (auto i : retired.snapshots)
         {
-            m_filestream << m_formatter->format(logger, level, event);
+            delete i;
         }
     }
 
-    std::string FileLogAppender::toYamlString()
+    void Logger::log(LogLevel::Level level, const std::shared_ptr<LogEvent> &event)
     {
-        YAML::Node node;
-        node["type"] = "FileLogAppender";
-        node["file"] = m_filename;
-        if (m_level != LogLevel::UNKNOWN)
-            node["level"] = LogLevel::ToString(m_level);
-        if (m_hasFormatter && m_formatter)
+        if (!filter(level))
         {
-            node["formatter"] = m_formatter->getPattern();
+            uint64_t suppressed = 0;
+            uint32_t limit = getRateLimit();
+            if (limit && !m_limiter.rate(limit, suppressed))
+            {
+                return;
+            }
+            m_events.add();
+            if (ZCSERVER_UNLIKELY(suppressed))
+            {
+                // in front of the message of this event
+                LogStream &ss = event->getSS();
+                std::string content(ss.data(), ss.size());
+                ss.reset();
+                ss << LogSuppressed{suppressed};
+                ss.append(content);
+            }
+            // the event holds the logger it was created for, no reference is taken here
+            std::shared_ptr<Logger> holder;
+            const std::shared_ptr<Logger> &self = event->getLogger().get() == this ? event->getLogger() : (holder = shared_from_this());
+            Epoch::ReadGuard guard;
+            // one snapshot for the whole event, a change in between does not split the appenders
+            const Snapshot &snapshot = *m_effective.load(std::memory_order_acquire);
+            const Appenders &appenders = snapshot.appenders;
+            for (size_t i = 0; i < appenders.size(); ++i)
+            {
+                LogAppender *appender = appenders[i].get();
+                if (!snapshot.shares[i])
+                {
+                    appender->log(self, level, event);
+                    continue;
+                }
+                if (level < appender->m_level || Shared(snapshot, i, level))
+                {
+                    continue;
+                }
+                // format once, the line goes to this appender and the later ones with the same formatter
+                LogFormatter *formatter = snapshot.formatters[i].get();
+                LogStream &os = SharedFormatStream();
+                formatter->format(os, self, level, event);
+                for (size_t j = i; j < appenders.size(); ++j)
+                {
+                    if (snapshot.shares[j] && snapshot.formatters[j].get() == formatter && level >= appenders[j]->m_level)
+                    {
+                        appenders[j]->logFormatted(self, level, os.data(), os.size());
+                    }
+                }
+            }
+            if (level >= LogLevel::FATAL)
+            {
+                // the process may not live to the next flush
+                LogCrashHandler::FlushAll();
+            }
         }
-
-        std::stringstream ss;
-        ss << node;
-        return ss.str();
     }
 
-
-    /*********************************
-     * class Logger
-     *********************************/
-    Logger::Logger(const std::string &name) : m_name(name), m_level(LogLevel::DEBUG)
+    bool Logger::Shared(const Snapshot &snapshot, size_t i, LogLevel::Level level)
     {
-        m_formatter.reset(new LogFormatter("%d{%Y-%m-%d %H:%M:%S}%T%t%T%F%T[%p]%T[%c]%T%f:%l%T%m%n"));
+        const LogFormatter *formatter = snapshot.formatters[i].get();
+        for (size_t j = 0; j < i; ++j)
+        {
+            if (snapshot.shares[j] && snapshot.formatters[j].get() == formatter && level >= snapshot.appenders[j]->m_level)
+            {
+                return true;
+            }
+        }
+        return false;
     }
 
-    void Logger::log(LogLevel::Level level, std::shared_ptr<LogEvent> event)
+    void Logger::logBinary(const std::shared_ptr<Logger> &self, LogLevel::Level level, const BinLogSite &site, const char *data, size_t len)
     {
-        if (level >= m_level)
+        if (!filter(level))
         {
-            auto self = shared_from_this();
-            if (!m_appenders.empty())
+            uint64_t suppressed = 0;
+            uint32_t limit = getRateLimit();
+            if (limit && !m_limiter.rate(limit, suppressed))
+            {
+                return;
+            }
+            m_events.add();
+            Epoch::ReadGuard guard;
+            const Appenders &appenders = m_effective.load(std::memory_order_acquire)->appenders;
+            if (ZCSERVER_UNLIKELY(suppressed))
             {
-                for (auto &i : m_appenders)
+                // the arguments of a record can not be prefixed, report in a line of its own
+                auto event = LogEvent::Create(self, level, site.file, site.line);
+                event->getSS() << LogSuppressed{suppressed};
+                for (auto &i : appenders)
                 {
                     i->log(self, level, event);
                 }
             }
-            // if logAppender is empty, use m_root
-            else if (m_root)
+            for (auto &i : appenders)
+            {
+                i->logBinary(self, level, site, data, len);
+            }
+            if (level >= LogLevel::FATAL)
             {
-                m_root->log(level, event);
+                LogCrashHandler::FlushAll();
             }
         }
     }
 
-    void Logger::debug(std::shared_ptr<LogEvent> event)
+    void Logger::debug(const std::shared_ptr<LogEvent> &event)
     {
         log(LogLevel::DEBUG, event);
     }
 
-    void Logger::info(std::shared_ptr<LogEvent> event)
+    void Logger::info(const std::shared_ptr<LogEvent> &event)
     {
         log(LogLevel::INFO, event);
     }
-    void Logger::warn(std::shared_ptr<LogEvent> event)
+    void Logger::warn(const std::shared_ptr<LogEvent> &event)
     {
         log(LogLevel::WARN, event);
     }
-    void Logger::error(std::shared_ptr<LogEvent> event)
+    void Logger::error(const std::shared_ptr<LogEvent> &event)
     {
         log(LogLevel::ERROR, event);
     }
 
-    void Logger::fatal(std::shared_ptr<LogEvent> event)
+    void Logger::fatal(const std::shared_ptr<LogEvent> &event)
     {
         log(LogLevel::FATAL, event);
     }
 
     void Logger::addAppender(std::shared_ptr<LogAppender> appender)
     {
-        if (!appender->getFormatter())
+        Retired retired;
         {
-            // friend class
-            // set appender without setting the m_hasFormatter
-            appender->m_formatter = m_formatter;
+            Mutex::Lock lock(GetMutex());
+            if (!appender->getFormatter())
+            {
+                // friend class
+                // set appender without setting the m_hasFormatter
+                appender->swapFormatter(m_formatter, false);
+            }
+            appender->m_attached.store(true, std::memory_order_relaxed);
+            m_appenders.push_back(appender);
+            changedLocked(retired);
         }
-        m_appenders.push_back(appender);
+        Retire(retired);
     }
 
     void Logger::delAppender(std::shared_ptr<LogAppender> appender)
     {
-        for (auto it = m_appenders.begin(); it != m_appenders.end(); ++it)
+        Retired retired;
         {
-            if (*it == appender)
+            Mutex::Lock lock(GetMutex());
+            for (auto it = m_appenders.begin(); it != m_appenders.end(); ++it)
             {
-                m_appenders.erase(it);
-                break;
+                if (*it == appender)
+                {
+                    m_appenders.erase(it);
+                    break;
+                }
             }
+            changedLocked(retired);
         }
+        Retire(retired);
     }
 
     void Logger::clearAppenders()
     {
-        m_appenders.clear();
+        Retired retired;
+        {
+            Mutex::Lock lock(GetMutex());
+            m_appenders.clear();
+            changedLocked(retired);
+        }
+        Retire(retired);
+    }
+
+    void Logger::setAppenders(const Appenders &appenders, std::shared_ptr<LogFormatter> formatter)
+    {
+        Retired retired;
+        {
+            Mutex::Lock lock(GetMutex());
+            if (formatter)
+            {
+                m_formatter = formatter;
+            }
+            for (auto &i : appenders)
+            {
+                if (!i->getFormatter())
+                {
+                    i->swapFormatter(m_formatter, false);
+                }
+                i->m_attached.store(true, std::memory_order_relaxed);
+            }
+            m_appenders = appenders;
+            changedLocked(retired);
+        }
+        Retire(retired);
+    }
+
+    void Logger::setLevel(LogLevel::Level val)
+    {
+        Retired retired;
+        {
+            Mutex::Lock lock(GetMutex());
+            m_level = val;
+            changedLocked(retired);
+        }
+        Retire(retired);
+    }
+
+    void Logger::setFormatOn(FormatOn val)
+    {
+        Retired retired;
+        {
+            Mutex::Lock lock(GetMutex());
+            m_formatOn.store(val, std::memory_order_relaxed);
+            // which appenders take the formatted line depends on it
+            changedLocked(retired);
+        }
+        Retire(retired);
     }
 
     void Logger::setFormatter(std::shared_ptr<LogFormatter> val)
     {
-        m_formatter = val;
-        
-        // if there is no formatter set in advance,
-        // it will use root formatter
-        // so when modifying the formatter, it should influence the formatter of appenders
-        for (auto &i : m_appenders)
+        Retired retired;
         {
-            if (!i->m_hasFormatter)
+            Mutex::Lock lock(GetMutex());
+            m_formatter = val;
+
+            // if there is no formatter set in advance,
+            // it will use root formatter
+            // so when modifying the formatter, it should influence the formatter of appenders
+            // the logging threads may be using the replaced one, it is retired with the others
+            for (auto &i : m_appenders)
             {
-                i->m_formatter = m_formatter;
+                if (!i->hasFormatter())
+                {
+                    retired.formatters.push_back(i->swapFormatter(m_formatter, false));
+                }
             }
+            // the snapshots carry the formatters, all of them change at once
+            changedLocked(retired);
         }
+        Retire(retired);
     }
 
     void Logger::setFormatter(const std::string &val)
@@ -421,6 +4315,7 @@ namespace zcserver
 
     std::shared_ptr<LogFormatter> Logger::getFormatter()
     {
+        Mutex::Lock lock(GetMutex());
         return m_formatter;
     }
 
@@ -428,10 +4323,16 @@ namespace zcserver
     {
         YAML::Node node;
         node["name"] = m_name;
+        Mutex::Lock lock(GetMutex());
+        // the configuration, not what is inherited
         if (m_level != LogLevel::UNKNOWN)
             node["level"] = LogLevel::ToString(m_level);
         if (m_formatter)
             node["formatter"] = m_formatter->getPattern();
+        if (getRateLimit())
+            node["rate_limit"] = getRateLimit();
+        if (getFormatOn() == CONSUMER)
+            node["format_on"] = "consumer";
         
         for (auto &i : m_appenders)
         {
@@ -445,14 +4346,14 @@ namespace zcserver
     /*********************************
      * class LogEventWrap
      *********************************/
-    LogEventWrap::LogEventWrap(std::shared_ptr<LogEvent> event) : m_event(event) {}
+    LogEventWrap::LogEventWrap(const std::shared_ptr<LogEvent> &event) : m_event(event) {}
 
     LogEventWrap::~LogEventWrap()
     {
         m_event->getLogger()->log(m_event->getLevel(), m_event);
     }
 
-    std::stringstream &LogEventWrap::getSS()
+    LogStream &LogEventWrap::getSS()
     {
         return m_event->getSS();
     }
@@ -465,13 +4366,20 @@ namespace zcserver
         m_root.reset(new Logger);
         m_root->addAppender(std::shared_ptr<LogAppender>(new StdoutLogAppender));
 
-        m_loggers[m_root->m_name] = m_root;
+        getShard(m_root->m_name).loggers[m_root->m_name] = m_root;
     }
 
     std::string LoggerManager::toYamlString()
     {
+        // by name, as the loggers are listed in the config
+        std::map<std::string, std::shared_ptr<Logger>> loggers;
+        for (auto &i : m_shards)
+        {
+            RWMutex::ReadLock lock(i.mutex);
+            loggers.insert(i.loggers.begin(), i.loggers.end());
+        }
         YAML::Node node;
-        for (auto &i : m_loggers)
+        for (auto &i : loggers)
         {
             node.push_back(YAML::Load(i.second->toYamlString()));
         }
@@ -480,20 +4388,119 @@ namespace zcserver
         return ss.str();
     }
 
+    std::vector<LoggerMetrics> LoggerManager::getMetrics()
+    {
+        std::map<std::string, std::shared_ptr<Logger>> loggers;
+        for (auto &i : m_shards)
+        {
+            RWMutex::ReadLock lock(i.mutex);
+            loggers.insert(i.loggers.begin(), i.loggers.end());
+        }
+        std::vector<LoggerMetrics> metrics;
+        for (auto &i : loggers)
+        {
+            metrics.push_back(i.second->getMetrics());
+        }
+        return metrics;
+    }
+
+    static YAML::Node MetricsToYaml(const LogAppenderMetrics &metrics)
+    {
+        YAML::Node node;
+        node["type"] = metrics.type;
+        if (!metrics.file.empty())
+        {
+            node["file"] = metrics.file;
+        }
+        node["events"] = metrics.events;
+        node["bytes_formatted"] = metrics.bytesFormatted;
+        node["bytes_written"] = metrics.bytesWritten;
+        node["write_calls"] = metrics.writeCalls;
+        node["dropped"] = metrics.dropped;
+        node["queue_high_watermark"] = metrics.queueHighWatermark;
+        // keyed by the upper bound in us of the bucket, empty buckets left out
+        for (size_t i = 0; i < metrics.flushLatency.size(); i++)
+        {
+            if (metrics.flushLatency[i])
+            {
+                node["flush_latency_us"][(uint64_t)1 << i] = metrics.flushLatency[i];
+            }
+        }
+        for (auto &i : metrics.wrapped)
+        {
+            node["wrapped"].push_back(MetricsToYaml(i));
+        }
+        return node;
+    }
+
+    std::string LoggerManager::metricsToYamlString()
+    {
+        YAML::Node node;
+        for (auto &i : getMetrics())
+        {
+            YAML::Node n;
+            n["name"] = i.name;
+            n["events"] = i.events;
+            n["filtered"] = i.filtered;
+            n["dropped"] = i.dropped;
+            for (auto &a : i.appenders)
+            {
+                n["appenders"].push_back(MetricsToYaml(a));
+            }
+            node.push_back(n);
+        }
+        std::stringstream ss;
+        ss << node;
+        return ss.str();
+    }
+
 
     // config items from yaml
     struct LogAppenderDefine
     {
         // 1 Fileout
         // 2 Stdout
+        // 3 RollingFile
+        // 4 BinaryFile
+        // 5 MmapFile
         int type = 0;
         LogLevel::Level level = LogLevel::UNKNOWN;
         std::string formatter;
         std::string file;
+        // wrap the appender with an AsyncLogAppender
+        bool async = false;
+        uint32_t buffer_size = 0;
+        uint32_t flush_interval = 0;
+        // 0 double buffer, 1 per-thread rings
+        int queue = 0;
+        // window of a CoalescingLogAppender in ms, 0 no coalescing
+        uint32_t coalesce = 0;
+        // what the async queue does when it is full, see AsyncLogAppender::Overflow
+        int overflow = AsyncLogAppender::DROP_NEWEST;
+        uint64_t max_bytes = 0;
+        LogLevel::Level overflow_level = LogLevel::ERROR;
+        std::string overflow_file;
+        // flush policy of FileLogAppender, 0 and UNKNOWN keep the defaults
+        uint32_t flush_bytes = 0;
+        uint32_t flush_interval_ms = 0;
+        LogLevel::Level flush_level = LogLevel::UNKNOWN;
+        // rolling of RollingFileLogAppender
+        std::string pattern;
+        uint64_t max_size = 0;
+        uint32_t max_archives = 0;
+        bool compress = true;
+        // segments of MmapFileLogAppender, 0 keeps the default
+        uint64_t segment_size = 0;
 
         bool operator==(const LogAppenderDefine &oth) const
         {
-            return type == oth.type && level == oth.level && formatter == oth.formatter && file == oth.file;
+            return type == oth.type && level == oth.level && formatter == oth.formatter && file == oth.file
+                && async == oth.async && buffer_size == oth.buffer_size && flush_interval == oth.flush_interval
+                && queue == oth.queue && coalesce == oth.coalesce && overflow == oth.overflow && max_bytes == oth.max_bytes
+                && overflow_level == oth.overflow_level && overflow_file == oth.overflow_file
+                && flush_bytes == oth.flush_bytes && flush_interval_ms == oth.flush_interval_ms
+                && flush_level == oth.flush_level && pattern == oth.pattern && max_size == oth.max_size
+                && max_archives == oth.max_archives && compress == oth.compress && segment_size == oth.segment_size;
         }
     };
 
@@ -505,11 +4512,16 @@ namespace zcserver
         std::string name;
         LogLevel::Level level = LogLevel::UNKNOWN;
         std::string formatter;
+        // messages per second, 0 unlimited
+        uint32_t rate_limit = 0;
+        // 0 producer, 1 consumer
+        int format_on = 0;
         std::vector<LogAppenderDefine> appenders;
 
         bool operator==(const LogDefine &oth) const
         {
-            return name == oth.name && level == oth.level && formatter == oth.formatter && appenders == oth.appenders;
+            return name == oth.name && level == oth.level && formatter == oth.formatter && rate_limit == oth.rate_limit
+                && format_on == oth.format_on && appenders == oth.appenders;
         }
 
         bool operator<(const LogDefine &oth) const
@@ -546,6 +4558,22 @@ namespace zcserver
                 {
                     ld.formatter = n["formatter"].as<std::string>();
                 }
+                if (n["rate_limit"].IsDefined())
+                {
+                    ld.rate_limit = n["rate_limit"].as<uint32_t>();
+                }
+                if (n["format_on"].IsDefined())
+                {
+                    std::string format_on = n["format_on"].as<std::string>();
+                    if (format_on == "consumer")
+                    {
+                        ld.format_on = 1;
+                    }
+                    else if (format_on != "producer")
+                    {
+                        std::cout << "log config error: logger format_on is invalid, node at " << n << std::endl;
+                    }
+                }
 
                 if (n["appenders"].IsDefined())
                 {
@@ -563,9 +4591,60 @@ namespace zcserver
                         {
                             lad.level = LogLevel::FromString(a["level"].as<std::string>());
                         }
-                        if (type == "FileLogAppender")
+                        if (type == "FileLogAppender" || type == "RollingFileLogAppender" || type == "BinaryLogAppender")
+                        {
+                            lad.type = type == "FileLogAppender" ? 1 : type == "RollingFileLogAppender" ? 3 : 4;
+                            if (!a["file"].IsDefined())
+                            {
+                                std::cout << "log config error: file is null, node at " << a << std::endl;
+                                continue;
+                            }
+                            lad.file = a["file"].as<std::string>();
+                            if (a["formatter"].IsDefined())
+                            {
+                                lad.formatter = a["formatter"].as<std::string>();
+                            }
+                            auto f = a["flush"];
+                            if (f.IsDefined())
+                            {
+                                if (f["bytes"].IsDefined())
+                                {
+                                    lad.flush_bytes = f["bytes"].as<uint32_t>();
+                                }
+                                if (f["interval"].IsDefined())
+                                {
+                                    lad.flush_interval_ms = f["interval"].as<uint32_t>();
+                                }
+                                if (f["level"].IsDefined())
+                                {
+                                    lad.flush_level = LogLevel::FromString(f["level"].as<std::string>());
+                                }
+                            }
+                            if (lad.type == 3)
+                            {
+                                if (!a["pattern"].IsDefined())
+                                {
+                                    std::cout << "log config error: pattern is null, node at " << a << std::endl;
+                                    continue;
+                                }
+                                lad.pattern = a["pattern"].as<std::string>();
+                                if (a["max_size"].IsDefined())
+                                {
+                                    lad.max_size = a["max_size"].as<uint64_t>();
+                                }
+                                if (a["max_archives"].IsDefined())
+                                {
+                                    lad.max_archives = a["max_archives"].as<uint32_t>();
+                                }
+                                if (a["compress"].IsDefined())
+                                {
+                                    lad.compress = a["compress"].as<bool>();
+                                }
+                            }
+                        }
+                        else if (type == "MmapFileLogAppender")
                         {
-                            lad.type = 1;
+                            lad.type = 5;
                             if (!a["file"].IsDefined())
                             {
                                 std::cout << "log config error: file is null, node at " << a << std::endl;
@@ -576,6 +4655,10 @@ namespace zcserver
                             {
                                 lad.formatter = a["formatter"].as<std::string>();
                             }
+                            if (a["segment_size"].IsDefined())
+                            {
+                                lad.segment_size = a["segment_size"].as<uint64_t>();
+                            }
                         }
                         else if (type == "StdoutLogAppender")
                         {
@@ -586,6 +4669,70 @@ namespace zcserver
                             std::cout << "log config error: appender type is invalid, node at " << a << std::endl;
                             continue;
                         }
+                        if (a["async"].IsDefined())
+                        {
+                            lad.async = a["async"].as<bool>();
+                        }
+                        if (a["buffer_size"].IsDefined())
+                        {
+                            lad.buffer_size = a["buffer_size"].as<uint32_t>();
+                        }
+                        if (a["flush_interval"].IsDefined())
+                        {
+                            lad.flush_interval = a["flush_interval"].as<uint32_t>();
+                        }
+                        if (a["queue"].IsDefined())
+                        {
+                            std::string queue = a["queue"].as<std::string>();
+                            if (queue == "ring")
+                            {
+                                lad.queue = 1;
+                            }
+                            else if (queue != "buffer")
+                            {
+                                std::cout << "log config error: appender queue is invalid, node at " << a << std::endl;
+                            }
+                        }
+                        if (a["coalesce"].IsDefined())
+                        {
+                            lad.coalesce = a["coalesce"].as<uint32_t>();
+                        }
+                        if (a["overflow"].IsDefined())
+                        {
+                            auto o = a["overflow"];
+                            AsyncLogAppender::Overflow overflow;
+                            if (o["policy"].IsDefined() && !AsyncLogAppender::FromString(o["policy"].as<std::string>(), overflow))
+                            {
+                                std::cout << "log config error: appender overflow policy is invalid, node at " << a << std::endl;
+                            }
+                            else if (o["policy"].IsDefined())
+                            {
+                                lad.overflow = overflow;
+                            }
+                            if (o["max_bytes"].IsDefined())
+                            {
+                                lad.max_bytes = o["max_bytes"].as<uint64_t>();
+                            }
+                            if (o["level"].IsDefined())
+                            {
+                                lad.overflow_level = LogLevel::FromString(o["level"].as<std::string>());
+                            }
+                            if (o["file"].IsDefined())
+                            {
+                                lad.overflow_file = o["file"].as<std::string>();
+                            }
+                            if (lad.overflow == AsyncLogAppender::SPILL && lad.overflow_file.empty())
+                            {
+                                std::cout << "log config error: appender overflow spill needs a file, node at " << a << std::endl;
+                                lad.overflow = AsyncLogAppender::DROP_NEWEST;
+                            }
+                            if (lad.queue == 1 && lad.overflow == AsyncLogAppender::DROP_OLDEST)
+                            {
+                                // only the consumer pops a ring
+                                std::cout << "log config error: appender overflow drop_oldest is not supported by queue ring, node at " << a << std::endl;
+                                lad.overflow = AsyncLogAppender::DROP_NEWEST;
+                            }
+                        }
                         ld.appenders.push_back(lad);
                     }
                 }
@@ -614,14 +4761,44 @@ namespace zcserver
                 {
                     n["formatter"] = i.formatter;
                 }
+                if (i.rate_limit)
+                {
+                    n["rate_limit"] = i.rate_limit;
+                }
+                if (i.format_on == 1)
+                {
+                    n["format_on"] = "consumer";
+                }
 
                 for (auto &a : i.appenders)
                 {
                     YAML::Node na;
-                    if (a.type == 1)
+                    if (a.type == 1 || a.type == 3 || a.type == 4)
+                    {
+                        na["type"] = a.type == 1 ? "FileLogAppender" : a.type == 3 ? "RollingFileLogAppender" : "BinaryLogAppender";
+                        na["file"] = a.file;
+                        if (a.flush_bytes)
+                            na["flush"]["bytes"] = a.flush_bytes;
+                        if (a.flush_interval_ms)
+                            na["flush"]["interval"] = a.flush_interval_ms;
+                        if (a.flush_level != LogLevel::UNKNOWN)
+                            na["flush"]["level"] = LogLevel::ToString(a.flush_level);
+                        if (a.type == 3)
+                        {
+                            na["pattern"] = a.pattern;
+                            if (a.max_size)
+                                na["max_size"] = a.max_size;
+                            if (a.max_archives)
+                                na["max_archives"] = a.max_archives;
+                            na["compress"] = a.compress;
+                        }
+                    }
+                    else if (a.type == 5)
                     {
-                        na["type"] = "FileLogAppender";
+                        na["type"] = "MmapFileLogAppender";
                         na["file"] = a.file;
+                        if (a.segment_size)
+                            na["segment_size"] = a.segment_size;
                     }
                     else if (a.type == 2)
                     {
@@ -636,6 +4813,30 @@ namespace zcserver
                     {
                         na["formatter"] = a.formatter;
                     }
+                    if (a.async)
+                    {
+                        na["async"] = true;
+                        if (a.buffer_size)
+                            na["buffer_size"] = a.buffer_size;
+                        if (a.flush_interval)
+                            na["flush_interval"] = a.flush_interval;
+                        if (a.queue == 1)
+                            na["queue"] = "ring";
+                        if (a.max_bytes || a.overflow != AsyncLogAppender::DROP_NEWEST)
+                        {
+                            na["overflow"]["policy"] = AsyncLogAppender::ToString((AsyncLogAppender::Overflow)a.overflow);
+                            if (a.max_bytes)
+                                na["overflow"]["max_bytes"] = a.max_bytes;
+                            if (a.overflow == AsyncLogAppender::DROP_BELOW)
+                                na["overflow"]["level"] = LogLevel::ToString(a.overflow_level);
+                            if (a.overflow == AsyncLogAppender::SPILL)
+                                na["overflow"]["file"] = a.overflow_file;
+                        }
+                    }
+                    if (a.coalesce)
+                    {
+                        na["coalesce"] = a.coalesce;
+                    }
 
                     n["appenders"].push_back(na);
                 }
@@ -677,23 +4878,50 @@ namespace zcserver
                         if (!(i == *it))
                             logger = ZCSERVER_LOG_NAME(i.name);
                     }
+                    if (!logger)
+                    {
+                        // unchanged logger
+                        continue;
+                    }
 
                     // common operator
                     // setLevel, setFormatter, setAppenders
                     logger->setLevel(i.level);
+                    logger->setRateLimit(i.rate_limit);
+                    logger->setFormatOn((Logger::FormatOn)i.format_on);
+                    std::shared_ptr<LogFormatter> formatter;
                     if (!i.formatter.empty())
                     {
-                        logger->setFormatter(i.formatter);
+                        formatter.reset(new LogFormatter(i.formatter));
+                        if (formatter->isError())
+                        {
+                            std::cout << "log.name=" << i.name << " formatter=" << i.formatter << " is invalid" << std::endl;
+                            formatter.reset();
+                        }
                     }
 
-                    // add appenders
-                    logger->clearAppenders();
+                    // build the appenders, then replace the old ones at once
+                    Logger::Appenders appenders;
                     for (auto &a : i.appenders)
                     {
                         std::shared_ptr<LogAppender> ap;
-                        if (a.type == 1)
+                        if (a.type == 1 || a.type == 3 || a.type == 4)
+                        {
+                            std::shared_ptr<FileLogAppender> fap;
+                            if (a.type == 1)
+                                fap.reset(new FileLogAppender(a.file));
+                            else if (a.type == 3)
+                                fap.reset(new RollingFileLogAppender(a.file, a.pattern, a.max_size, a.max_archives, a.compress));
+                            else
+                                fap.reset(new BinaryLogAppender(a.file));
+                            fap->setFlushPolicy(a.flush_bytes ? a.flush_bytes : fap->getFlushBytes(),
+                                                a.flush_interval_ms ? a.flush_interval_ms : fap->getFlushInterval(),
+                                                a.flush_level != LogLevel::UNKNOWN ? a.flush_level : fap->getFlushLevel());
+                            ap = fap;
+                        }
+                        else if (a.type == 5)
                         {
-                            ap.reset(new FileLogAppender(a.file));
+                            ap.reset(new MmapFileLogAppender(a.file, a.segment_size));
                         }
                         else if (a.type == 2)
                         {
@@ -712,8 +4940,29 @@ namespace zcserver
                                 std::cout << "log.name=" << i.name << " appender type=" << a.type << " formatter=" << a.formatter << " is invalid" << std::endl;
                             }
                         }
-                        logger->addAppender(ap);
+                        if (a.async && a.type == 4)
+                        {
+                            // the async wrapper passes formatted text
+                            std::cout << "log.name=" << i.name << " appender type=" << a.type << " async is not supported" << std::endl;
+                        }
+                        else if (a.async)
+                        {
+                            std::shared_ptr<AsyncLogAppender> async(new AsyncLogAppender(ap, a.buffer_size, a.flush_interval, (AsyncLogAppender::Queue)a.queue));
+                            async->setOverflow(a.max_bytes, (AsyncLogAppender::Overflow)a.overflow, a.overflow_level, a.overflow_file);
+                            ap = async;
+                        }
+                        if (a.coalesce && a.type == 4)
+                        {
+                            std::cout << "log.name=" << i.name << " appender type=" << a.type << " coalesce is not supported" << std::endl;
+                        }
+                        else if (a.coalesce)
+                        {
+                            // outside of the async wrapper, a duplicate never reaches the queue
+                            ap.reset(new CoalescingLogAppender(ap, a.coalesce));
+                        }
+                        appenders.push_back(ap);
                     }
+                    logger->setAppenders(appenders, formatter);
                 }
 
                 // delete a logger
@@ -722,11 +4971,12 @@ namespace zcserver
                     auto it = new_value.find(i);
                     if (it == new_value.end())
                     {
-                        // delete all appenders
-                        // set LogLevel to a highest level
-                        // equivalent to delete the logger
+                        // delete all appenders and the level
+                        // equivalent to delete the logger, it inherits from the parent again
                         auto logger = ZCSERVER_LOG_NAME(i.name);
-                        logger->setLevel((LogLevel::Level)100);
+                        logger->setLevel(LogLevel::UNKNOWN);
+                        logger->setRateLimit(0);
+                        logger->setFormatOn(Logger::PRODUCER);
                         logger->clearAppenders();
                     }
                 }
@@ -738,14 +4988,28 @@ namespace zcserver
 
     std::shared_ptr<Logger> LoggerManager::getLogger(const std::string &name)
     {
-        auto it = m_loggers.find(name);
-        if (it != m_loggers.end())
-            return it->second;
-        // if not exist, create a new logger
-        std::shared_ptr<Logger> logger(new Logger(name));
-        // empty logAppender, using root instead
-        logger->m_root = m_root;
-        m_loggers[name] = logger;
+        Shard &shard = getShard(name);
+        {
+            RWMutex::ReadLock lock(shard.mutex);
+            auto it = shard.loggers.find(name);
+            if (it != shard.loggers.end())
+                return it->second;
+        }
+        // net.http.client is a child of net.http, a name without a dot is a child of root
+        // the parent is looked up before the lock, it may be in the same shard
+        size_t pos = name.rfind('.');
+        std::shared_ptr<Logger> parent = pos == std::string::npos || pos == 0 ? m_root : getLogger(name.substr(0, pos));
+        RWMutex::WriteLock lock(shard.mutex);
+        // another thread may have created it in between
+        auto &logger = shard.loggers[name];
+        if (!logger)
+        {
+            // if not exist, create a new logger
+            // it inherits the level and the appenders of the parent until it is configured
+            logger.reset(new Logger(name));
+            logger->m_level = LogLevel::UNKNOWN;
+            logger->setParent(parent);
+        }
         return logger;
     }
 }
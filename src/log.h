@@ -12,26 +12,43 @@
 #define __ZCSERVER_LOG_H__
 
 #include <memory>
+#include <atomic>
 #include <string>
 #include <vector>
 #include <list>
 #include <sstream>
 #include <ctime>
 #include <map>
+#include <unordered_map>
 #include <fstream>
 #include <iostream>
+#include <functional>
+#include <type_traits>
+#include <string.h>
 #include <yaml-cpp/yaml.h>
 #include "util.h"
 #include "singleton.h"
+#include "thread.h"
 
 /*********************************
  * output definitions
  *********************************/
 
+// statements below this level are compiled away together with their arguments
+// 1 DEBUG, 2 INFO, 3 WARN, 4 ERROR, 5 FATAL, 6 none
+#ifndef ZCSERVER_ACTIVE_LEVEL
+#define ZCSERVER_ACTIVE_LEVEL 1
+#endif
+
+// the whole statement is `if (...) {} else ...`, so a following else is not captured
+// a level known at compile time below ZCSERVER_ACTIVE_LEVEL leaves `if (true) {}`
+// a statement below the level of the logger is counted as filtered if log.count_filtered is on
+#define ZCSERVER_LOG_IF_ENABLED(logger, level) \
+    if ((level) < ZCSERVER_ACTIVE_LEVEL || ZCSERVER_LIKELY((logger)->filter(level))) {} else
+
 #define ZCSERVER_LOG_LEVEL(logger, level)   \
-    if (logger->getLevel() <= level)        \
-        zcserver::LogEventWrap(std::shared_ptr<zcserver::LogEvent>(new zcserver::LogEvent(logger, level,                     \
-        __FILE__, __LINE__, 0, zcserver::GetFiberId(), zcserver::GetFiberId(), time(0)))).getSS() 
+    ZCSERVER_LOG_IF_ENABLED(logger, level)  \
+        zcserver::LogEventWrap(zcserver::LogEvent::Create(logger, level, __FILE__, __LINE__))
 
 #define ZCSERVER_LOG_DEBUG(logger) ZCSERVER_LOG_LEVEL(logger, zcserver::LogLevel::DEBUG)
 #define ZCSERVER_LOG_INFO(logger) ZCSERVER_LOG_LEVEL(logger, zcserver::LogLevel::INFO)
@@ -39,11 +56,18 @@
 #define ZCSERVER_LOG_ERROR(logger) ZCSERVER_LOG_LEVEL(logger, zcserver::LogLevel::ERROR)
 #define ZCSERVER_LOG_FATAL(logger) ZCSERVER_LOG_LEVEL(logger, zcserver::LogLevel::FATAL)
 
+#ifdef ZCSERVER_LOG_BINARY
+// record the arguments instead of formatting them, see binlog.h
+#define ZCSERVER_LOG_FMT_LEVEL(logger, level, fmt, ...) ZCSERVER_LOG_BIN_FMT_LEVEL(logger, level, fmt, __VA_ARGS__)
+#else
+// fmt must be a string literal, it is checked against the types of the arguments at compile time
 #define ZCSERVER_LOG_FMT_LEVEL(logger, level, fmt, ...) \
-    if(logger->getLevel() <= level) \
-        zcserver::LogEventWrap(std::shared_ptr<zcserver::LogEvent>(new zcserver::LogEvent(logger, level, \
-        __FILE__, __LINE__, 0, zcserver::GetThreadId(),\
-        zcserver::GetFiberId(), time(0)))).getEvent()->format(fmt, __VA_ARGS__)
+    ZCSERVER_LOG_IF_ENABLED(logger, level) \
+        (void)sizeof(zcserver::logfmt::Checked<zcserver::logfmt::Check(fmt, \
+            decltype(zcserver::logfmt::Classify(__VA_ARGS__))::list)>), \
+        zcserver::LogEventWrap(zcserver::LogEvent::Create(logger, level, \
+        __FILE__, __LINE__)).getEvent()->format(fmt, __VA_ARGS__)
+#endif
 
 #define ZCSERVER_LOG_FMT_DEBUG(logger, fmt, ...) ZCSERVER_LOG_FMT_LEVEL(logger, zcserver::LogLevel::DEBUG, fmt, __VA_ARGS__)
 #define ZCSERVER_LOG_FMT_INFO(logger, fmt, ...) ZCSERVER_LOG_FMT_LEVEL(logger, zcserver::LogLevel::INFO, fmt, __VA_ARGS__)
@@ -51,13 +75,39 @@
 #define ZCSERVER_LOG_FMT_ERROR(logger, fmt, ...) ZCSERVER_LOG_FMT_LEVEL(logger, zcserver::LogLevel::ERROR, fmt, __VA_ARGS__)
 #define ZCSERVER_LOG_FMT_FATAL(logger, fmt, ...) ZCSERVER_LOG_FMT_LEVEL(logger, zcserver::LogLevel::FATAL, fmt, __VA_ARGS__)
 
+// sampled and rate limited statements, the state is a static of the call site
+// the first statement that logs after some were dropped starts with "[suppressed N] "
+#define ZCSERVER_LOG_LIMITED(logger, level, pass) \
+    ZCSERVER_LOG_IF_ENABLED(logger, level) \
+    if (uint64_t zcserver_suppressed = 0) {} \
+    else if (!([]() -> zcserver::LogLimiter & { static zcserver::LogLimiter s_limiter; return s_limiter; }() \
+                 .pass)) {} \
+    else ZCSERVER_LOG_LEVEL(logger, level) << zcserver::LogSuppressed{zcserver_suppressed}
+
+// the 1st, the n+1th, the 2n+1th ... time
+#define ZCSERVER_LOG_EVERY_N(logger, level, n) ZCSERVER_LOG_LIMITED(logger, level, everyN(n, zcserver_suppressed))
+// the first n times only
+#define ZCSERVER_LOG_FIRST_N(logger, level, n) ZCSERVER_LOG_LIMITED(logger, level, firstN(n))
+// at most once in ms milliseconds
+#define ZCSERVER_LOG_EVERY_MS(logger, level, ms) ZCSERVER_LOG_LIMITED(logger, level, everyMs(ms, zcserver_suppressed))
+// per_sec statements per second on average, bursts of up to per_sec
+#define ZCSERVER_LOG_RATE_LIMITED(logger, level, per_sec) ZCSERVER_LOG_LIMITED(logger, level, rate(per_sec, zcserver_suppressed))
+
 #define ZCSERVER_LOG_ROOT() zcserver::LoggerMgr::GetInstance()->getRoot()
 #define ZCSERVER_LOG_NAME(name) zcserver::LoggerMgr::GetInstance()->getLogger(name)
 
+// the logger of a call site, looked up the first time the statement runs
+// name must be a constant, e.g. ZCSERVER_LOG_INFO(ZCSERVER_LOG_STATIC("system")) << ...
+#define ZCSERVER_LOG_STATIC(name) \
+    ([]() -> const std::shared_ptr<zcserver::Logger> & { \
+        static const std::shared_ptr<zcserver::Logger> s_logger = ZCSERVER_LOG_NAME(name); return s_logger; }())
+
 namespace zcserver
 {
     class Logger;
     class LoggerManager;
+    class LogTimer;
+    struct BinLogSite;
 
     // log level
     class LogLevel
@@ -79,12 +129,341 @@ namespace zcserver
         static LogLevel::Level FromString(const std::string &str);
     };
 
+    /*
+        LogStreamBuf:
+            A stream buffer writing into an inline array.
+            It spills over to the heap only when a message outgrows the array,
+            and keeps the heap block for the next messages, so a reused buffer
+            stops allocating once it has seen its biggest message.
+    */
+    class LogStreamBuf : public std::streambuf
+    {
+    public:
+        static const size_t INLINE_SIZE = 512;
+
+        LogStreamBuf() { setp(m_inline, m_inline + INLINE_SIZE); }
+
+        const char *data() const { return pbase(); }
+        size_t size() const { return pptr() - pbase(); }
+        // bytes that can be written without growing
+        size_t available() const { return epptr() - pptr(); }
+        // drop the content, keep the storage
+        void reset() { setp(pbase(), epptr()); }
+
+        // make room for n more bytes and return where they go
+        char *prepare(size_t n);
+        // n bytes written at prepare() are part of the content
+        void commit(size_t n) { pbump((int)n); }
+
+    protected:
+        int_type overflow(int_type c) override;
+        std::streamsize xsputn(const char *s, std::streamsize n) override;
+
+    private:
+        void grow(size_t n);
+
+        char m_inline[INLINE_SIZE];
+        std::unique_ptr<char[]> m_heap;
+    };
+
+    // std::ostream over a LogStreamBuf
+    class LogStream : public std::ostream
+    {
+    public:
+        LogStream() : std::ostream(nullptr) { rdbuf(&m_buf); }
+
+        const char *data() const { return m_buf.data(); }
+        size_t size() const { return m_buf.size(); }
+        size_t available() const { return m_buf.available(); }
+        // clear the content and restore the default stream state
+        void reset();
+
+        char *prepare(size_t n) { return m_buf.prepare(n); }
+        void commit(size_t n) { m_buf.commit(n); }
+
+        // raw appends, bypassing the formatting of std::ostream
+        void append(const char *data, size_t len)
+        {
+            memcpy(m_buf.prepare(len), data, len);
+            m_buf.commit(len);
+        }
+        void append(const char *str) { append(str, strlen(str)); }
+        void append(const std::string &str) { append(str.data(), str.size()); }
+        void appendUInt(uint64_t v);
+        void appendInt(int64_t v);
+
+    private:
+        LogStreamBuf m_buf;
+    };
+
+    /*
+        logfmt:
+            printf style formatting of ZCSERVER_LOG_FMT_*. The arguments keep their
+            types instead of going through varargs, each is converted by a routine
+            for its kind straight into the LogStream, with no allocation while the
+            message fits the inline buffer of the stream.
+            The conversions and flags are those of printf. The length modifiers
+            (l, ll, z, ...) are optional, the type of the argument decides; h and
+            hh still truncate. %n is not supported.
+    */
+    namespace logfmt
+    {
+        // an argument by kind
+        struct Arg
+        {
+            enum Type
+            {
+                NONE = 0,
+                INT = 1,
+                UINT = 2,
+                DOUBLE = 3,
+                STRING = 4,
+                POINTER = 5
+            };
+
+            Type type = NONE;
+            uint8_t size = 0;               // bytes of an integer in the call
+            union
+            {
+                int64_t i;
+                uint64_t u;
+                double d;
+                const void *p;
+            };
+            const char *str = nullptr;
+            size_t len = 0;
+
+            Arg() : u(0) {}
+            template<class T>
+            Arg(T v, typename std::enable_if<(std::is_integral<T>::value || std::is_enum<T>::value) && std::is_signed<T>::value>::type * = 0)
+                : type(INT), size(sizeof(T)), i((int64_t)v) {}
+            template<class T>
+            Arg(T v, typename std::enable_if<(std::is_integral<T>::value || std::is_enum<T>::value) && !std::is_signed<T>::value>::type * = 0)
+                : type(UINT), size(sizeof(T)), u((uint64_t)v) {}
+            template<class T>
+            Arg(T v, typename std::enable_if<std::is_floating_point<T>::value>::type * = 0)
+                : type(DOUBLE), d((double)v) {}
+            Arg(const char *v) : type(STRING), p(v), str(v ? v : "(null)"), len(strlen(str)) {}
+            Arg(const std::string &v) : type(STRING), p(v.data()), str(v.data()), len(v.size()) {}
+            template<class T>
+            Arg(const T *v) : type(POINTER), p(v) {}
+            Arg(std::nullptr_t) : type(POINTER), p(nullptr) {}
+        };
+
+        // write fmt with the count arguments to out
+        // a runtime format string may not match: a missing argument leaves its
+        // conversion as it is, an argument of another kind is written as with %g, %d, %s or %p
+        void Format(LogStream &out, const char *fmt, const Arg *args, size_t count);
+
+        /*
+            compile time check:
+                every argument is classified as i (integer), f (floating point), s (string),
+                p (pointer) or ? (none of them). Check() walks the conversions of the format
+                string and matches them to the classes in order, the number must agree too.
+                The text between conversions is searched by halves, so that the recursion
+                of constexpr stays shallow for long format strings.
+        */
+        template<class T, class Enable = void>
+        struct Kind { static const char value = '?'; };
+        template<class T>
+        struct Kind<T, typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type> { static const char value = 'i'; };
+        template<class T>
+        struct Kind<T, typename std::enable_if<std::is_floating_point<T>::value>::type> { static const char value = 'f'; };
+        template<class T>
+        struct Kind<T *, void> { static const char value = 'p'; };
+        template<>
+        struct Kind<std::nullptr_t, void> { static const char value = 'p'; };
+        template<>
+        struct Kind<const char *, void> { static const char value = 's'; };
+        template<>
+        struct Kind<char *, void> { static const char value = 's'; };
+        template<>
+        struct Kind<std::string, void> { static const char value = 's'; };
+
+        template<char... C>
+        struct Classes
+        {
+            static constexpr char list[] = {C..., 0};
+        };
+        template<char... C>
+        constexpr char Classes<C...>::list[];
+
+        // only for decltype
+        template<class... Args>
+        Classes<Kind<typename std::decay<Args>::type>::value...> Classify(const Args &...);
+
+        // the first '%' in [lo, hi) or hi
+        constexpr size_t Find(const char *f, size_t lo, size_t hi);
+        constexpr size_t FindLinear(const char *f, size_t lo, size_t hi)
+        {
+            return lo == hi || f[lo] == '%' ? lo : FindLinear(f, lo + 1, hi);
+        }
+        constexpr size_t FindRight(size_t left, const char *f, size_t mid, size_t hi)
+        {
+            return left != mid ? left : Find(f, mid, hi);
+        }
+        constexpr size_t Find(const char *f, size_t lo, size_t hi)
+        {
+            return hi - lo <= 16 ? FindLinear(f, lo, hi) : FindRight(Find(f, lo, lo + (hi - lo) / 2), f, lo + (hi - lo) / 2, hi);
+        }
+
+        constexpr bool In(char c, const char *set)
+        {
+            return *set && (*set == c || In(c, set + 1));
+        }
+        constexpr size_t Skip(const char *f, size_t i, const char *set)
+        {
+            return f[i] && In(f[i], set) ? Skip(f, i + 1, set) : i;
+        }
+        constexpr bool Matches(char conv, char cls)
+        {
+            return cls == 'i' ? In(conv, "diouxXc")
+                 : cls == 'f' ? In(conv, "fFeEgGaA")
+                 : cls == 's' ? conv == 's' || conv == 'p'
+                 : cls == 'p' ? conv == 'p'
+                 : false;
+        }
+
+        constexpr bool Scan(const char *f, size_t n, size_t i, const char *args, size_t a);
+        constexpr bool Convert(const char *f, size_t n, size_t i, const char *args, size_t a)
+        {
+            return i < n && args[a] && Matches(f[i], args[a]) && Scan(f, n, i + 1, args, a + 1);
+        }
+        constexpr bool Precision(const char *f, size_t n, size_t i, const char *args, size_t a)
+        {
+            return f[i] != '.' ? Convert(f, n, Skip(f, i, "hlLqjzt"), args, a)
+                 : f[i + 1] == '*' ? args[a] == 'i' && Convert(f, n, Skip(f, i + 2, "hlLqjzt"), args, a + 1)
+                 : Convert(f, n, Skip(f, Skip(f, i + 1, "0123456789"), "hlLqjzt"), args, a);
+        }
+        constexpr bool Width(const char *f, size_t n, size_t i, const char *args, size_t a)
+        {
+            return f[i] == '*' ? args[a] == 'i' && Precision(f, n, i + 1, args, a + 1)
+                 : Precision(f, n, Skip(f, i, "0123456789"), args, a);
+        }
+        constexpr bool Conversion(const char *f, size_t n, size_t i, const char *args, size_t a)
+        {
+            return i == n ? !args[a]
+                 : f[i + 1] == '%' ? Scan(f, n, i + 2, args, a)
+                 : Width(f, n, Skip(f, i + 1, "-+ #0'"), args, a);
+        }
+        constexpr bool Scan(const char *f, size_t n, size_t i, const char *args, size_t a)
+        {
+            return Conversion(f, n, Find(f, i, n), args, a);
+        }
+
+        template<size_t N>
+        constexpr bool Check(const char (&fmt)[N], const char *args)
+        {
+            return Scan(fmt, N - 1, 0, args, 0);
+        }
+
+        template<bool OK>
+        struct Checked
+        {
+            static_assert(OK, "the format string of ZCSERVER_LOG_FMT_* does not match the types or the number of its arguments");
+        };
+    }
+
+    // a typed key/value of a structured event
+    // the key and a string value are spans of the field text of the event
+    struct LogField
+    {
+        enum Type
+        {
+            INT = 1,
+            UINT = 2,
+            DOUBLE = 3,
+            BOOL = 4,
+            STRING = 5
+        };
+
+        Type type;
+        uint32_t key;
+        uint32_t keyLen;
+        union
+        {
+            int64_t i;
+            uint64_t u;
+            double d;
+            bool b;
+        } value;
+        uint32_t str = 0;
+        uint32_t strLen = 0;
+    };
+
+    /*
+        LogContext:
+            What the log statements of a thread know about it, kept in a thread-local
+            so that creating an event reads plain fields: the thread id (one gettid
+            per thread, again in the child after a fork), the name of
+            Thread::GetName() and the id of the running fiber.
+
+            The MDC (mapped diagnostic context) is a stack of key/value pairs of the
+            thread, such as a request id or a trace id, pushed by LogMDC scopes.
+            Each event takes a copy, %X{key} prints a value and %X all of them.
+    */
+    class LogContext
+    {
+    public:
+        uint32_t tid;
+        uint32_t fid = 0;
+        const std::string *name;            // Thread::GetName(), follows Thread::SetName()
+        // each pair as [uint32_t key length][key][uint32_t value length][value], innermost last
+        std::string mdc;
+
+        // the context of the calling thread
+        static LogContext &Get()
+        {
+            static thread_local LogContext t_context;
+            return t_context;
+        }
+
+        // the value of key in the pairs of an MDC, the innermost wins
+        // false if key is not there
+        static bool Find(const char *mdc, size_t size, const char *key, size_t keyLen, const char *&value, size_t &len);
+        // call f(key, keyLen, value, len) for each pair, the outermost first
+        template<class F>
+        static void ForEach(const char *mdc, size_t size, F f)
+        {
+            const char *end = mdc + size;
+            while (mdc < end)
+            {
+                uint32_t keyLen, len;
+                memcpy(&keyLen, mdc, sizeof(keyLen));
+                const char *key = mdc + sizeof(keyLen);
+                memcpy(&len, key + keyLen, sizeof(len));
+                const char *value = key + keyLen + sizeof(len);
+                f(key, keyLen, value, len);
+                mdc = value + len;
+            }
+        }
+
+    private:
+        LogContext();
+    };
+
+    // push key=value to the MDC of the calling thread for the lifetime of the scope
+    // scopes end in the reverse order they begin, as blocks do
+    class LogMDC
+    {
+    private:
+        size_t m_size;                      // of the MDC before the pair
+
+    public:
+        LogMDC(const char *key, size_t keyLen, const char *value, size_t len);
+        LogMDC(const std::string &key, const std::string &value) : LogMDC(key.data(), key.size(), value.data(), value.size()) {}
+        ~LogMDC();
+
+        LogMDC(const LogMDC &) = delete;
+        LogMDC &operator=(const LogMDC &) = delete;
+    };
+
     // a wrapper for the information of a log event
     class LogEvent
     {
     private:
         std::string m_threadName;         // thread name
-        std::stringstream m_ss;           // thread information
+        LogStream m_ss;                   // log content
         std::shared_ptr<Logger> m_logger; // related Logger
         LogLevel::Level m_level;          // log level
         const char *m_file = nullptr;
@@ -93,10 +472,23 @@ namespace zcserver
         uint32_t m_tid = 0;               // thread id
         uint32_t m_fid = 0;               // fiber id
         uint64_t m_time = 0;              // time
+        uint32_t m_nsec = 0;              // nanoseconds in the second of m_time
+        // structured fields, kept with their types until a formatter writes them
+        std::vector<LogField> m_fields;
+        std::string m_fieldText;
+        std::string m_mdc;                // the MDC of the thread, see LogContext
 
+        LogField &addField(LogField::Type type, const char *key);
 
     public:
-        LogEvent(std::shared_ptr<Logger> logger, LogLevel::Level level, const char *file, int32_t line, uint32_t elapse, uint32_t tid, uint32_t fid, uint64_t time);
+        LogEvent(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *file, int32_t line, uint32_t elapse, uint32_t tid, uint32_t fid, uint64_t time, uint32_t nsec = 0);
+
+        // take an event from the pool of the calling thread, stamped with the current time
+        // an event is back in the pool as soon as the last shared_ptr to it is released
+        // the thread name and the MDC are those of the calling thread
+        static std::shared_ptr<LogEvent> Create(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *file, int32_t line, uint32_t elapse, uint32_t tid, uint32_t fid);
+        // with the thread and the fiber of the calling thread from its LogContext
+        static std::shared_ptr<LogEvent> Create(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *file, int32_t line);
 
         const char *getFile() const { return m_file; }
         int32_t getLine() const { return m_line; }
@@ -104,14 +496,52 @@ namespace zcserver
         uint32_t getThreadId() const { return m_tid; }
         uint32_t getFiberId() const { return m_fid; }
         uint64_t getTime() const { return m_time; }
+        uint32_t getNanoseconds() const { return m_nsec; }
         const std::string &getThreadName() const { return m_threadName; }
-        std::string getContent() const { return m_ss.str(); }
-        std::shared_ptr<Logger> getLogger() const { return m_logger; }
+        std::string getContent() const { return std::string(m_ss.data(), m_ss.size()); }
+        // the content without a copy
+        const char *getContentData() const { return m_ss.data(); }
+        size_t getContentSize() const { return m_ss.size(); }
+        const std::shared_ptr<Logger> &getLogger() const { return m_logger; }
         LogLevel::Level getLevel() const { return m_level; }
-        std::stringstream &getSS() { return m_ss; }
+        LogStream &getSS() { return m_ss; }
+        const std::vector<LogField> &getFields() const { return m_fields; }
+        const char *getFieldText() const { return m_fieldText.data(); }
+        size_t getFieldTextSize() const { return m_fieldText.size(); }
+        const std::string &getMdc() const { return m_mdc; }
+
+        template<class T>
+        typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type addField(const char *key, T v)
+        {
+            if (std::is_signed<T>::value)
+                addField(LogField::INT, key).value.i = (int64_t)v;
+            else
+                addField(LogField::UINT, key).value.u = (uint64_t)v;
+        }
+        template<class T>
+        typename std::enable_if<std::is_floating_point<T>::value>::type addField(const char *key, T v)
+        {
+            addField(LogField::DOUBLE, key).value.d = (double)v;
+        }
+        void addField(const char *key, bool v) { addField(LogField::BOOL, key).value.b = v; }
+        void addField(const char *key, const char *v, size_t len);
+        void addField(const char *key, const char *v) { addField(key, v ? v : "(null)", strlen(v ? v : "(null)")); }
+        void addField(const char *key, const std::string &v) { addField(key, v.data(), v.size()); }
 
-        void format(const char *fmt, ...);
+        // printf style, see logfmt
+        template<class... Args>
+        void format(const char *fmt, const Args &... args)
+        {
+            const logfmt::Arg list[sizeof...(Args) + 1] = {logfmt::Arg(args)..., logfmt::Arg()};
+            logfmt::Format(m_ss, fmt, list, sizeof...(Args));
+        }
         void format(const char *fmt, va_list al);
+
+    private:
+        friend class AsyncLogAppender;
+
+        // reinitialize a pooled event
+        void reset(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *file, int32_t line, uint32_t elapse, uint32_t tid, uint32_t fid, uint64_t time, uint32_t nsec);
     };
 
     /*
@@ -122,16 +552,23 @@ namespace zcserver
             %d output a time
                 The time format string is optional. For example, a valid format string is 
                 {%Y-%m-%d %H:%M:%S}
+                %3N, %6N and %9N print the milliseconds, microseconds and nanoseconds
+                {%Y-%m-%d %H:%M:%S.%3N}
             %T symbol Tab
             %t thread id
             %N thread name
             %F fiber id
+            %X all the pairs of the MDC as key=value separated by spaces
+            %X{key} the value of key in the MDC, nothing if it is not there
             %p log level
             %c log name
             %f file name
             %l line number
             %m log content
             %n symbol \n
+            %J the event as a JSON object, with the structured fields
+                The time format is optional, {%Y-%m-%dT%H:%M:%S.%6N} by default
+            %K the structured fields as logfmt, key=value separated by spaces
     */
     class LogFormatter
     {
@@ -145,117 +582,1078 @@ namespace zcserver
         public:
             virtual ~FormatItem() {}
             // stream-oriented output
-            virtual void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event) = 0;
+            virtual void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) = 0;
         };
 
+        typedef std::function<std::shared_ptr<FormatItem>(const std::string &fmt)> ItemFactory;
+
     private:
+        /*
+            The pattern is also compiled into a flat program.
+            Built-in items become opcodes run by a switch, adjacent literals
+            (including %T and %n) are merged into one span of m_literals.
+            Custom items registered by AddFormatItem() are called through m_items.
+        */
+        enum OpCode
+        {
+            OP_LITERAL = 0,     // arg/len: span of m_literals
+            OP_MESSAGE,
+            OP_LEVEL,
+            OP_ELAPSE,
+            OP_NAME,
+            OP_THREAD_ID,
+            OP_FIBER_ID,
+            OP_DATETIME,        // arg: index of the DateTimeFormatItem in m_items
+            OP_FILENAME,
+            OP_LINE,
+            OP_JSON,            // arg: index of the JsonFormatItem in m_items
+            OP_LOGFMT,
+            OP_THREAD_NAME,
+            OP_MDC,             // arg: index of the MdcFormatItem in m_items
+            OP_CUSTOM           // arg: index of the item in m_items
+        };
+
+        struct Op
+        {
+            uint32_t code;
+            uint32_t arg;
+            uint32_t len;
+        };
+
         std::string m_pattern;                            // format pattern
         std::vector<std::shared_ptr<FormatItem>> m_items; // store items
+        std::vector<Op> m_program;                        // compiled pattern
+        std::string m_literals;                           // text of the OP_LITERAL spans
 
         bool m_error = false;
 
         // parse the m_pattern
         // used in the constructor
         void init();
+        // append an opcode, merge the literals
+        void emit(uint32_t code, uint32_t arg = 0, const std::string &literal = "");
+
+        static std::map<std::string, ItemFactory> &GetCustomItems();
 
     public:
         LogFormatter(const std::string &pattern);
+        virtual ~LogFormatter() {}
 
         // for each format item(m_items), use subclass method format() to output
-        std::string format(std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event);
+        std::string format(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event);
+        // same as above, output to os instead of a new string
+        void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event);
+        // run the compiled program, append to the buffer of out
+        virtual void format(LogStream &out, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event);
 
         bool isError() const { return m_error; }
-        const std::string getPattern() const { return m_pattern; }
+        const std::string &getPattern() const { return m_pattern; }
+
+        // register a custom item for %key, used by the formatters created afterwards
+        // a built-in key can be overridden as well
+        static void AddFormatItem(const std::string &key, ItemFactory factory);
     };
 
     // LogAppender defines the places to receive outputs
+    /*
+        LogCounter:
+            A counter striped over cache lines. A thread adds to the stripe it is
+            assigned to when it first counts, so threads rarely share a line, and
+            a read sums the stripes. For the counters of the logging hot path.
+    */
+    class LogCounter
+    {
+    public:
+        static const size_t STRIPES = 16;
+
+        void add(uint64_t n = 1) { m_stripes[Stripe()].value.fetch_add(n, std::memory_order_relaxed); }
+        // keep the largest value seen, read with getMax()
+        void max(uint64_t v)
+        {
+            std::atomic<uint64_t> &value = m_stripes[Stripe()].value;
+            uint64_t old = value.load(std::memory_order_relaxed);
+            while (v > old && !value.compare_exchange_weak(old, v, std::memory_order_relaxed))
+                ;
+        }
+        uint64_t get() const;
+        uint64_t getMax() const;
+
+    private:
+        static size_t Stripe()
+        {
+            static std::atomic<size_t> s_next{0};
+            static thread_local size_t t_stripe = s_next++ % STRIPES;
+            return t_stripe;
+        }
+
+        // padded to a cache line, alignas(64) would need the aligned new of c++17
+        struct Padded
+        {
+            std::atomic<uint64_t> value{0};
+            char pad[64 - sizeof(std::atomic<uint64_t>)];
+        };
+        Padded m_stripes[STRIPES];
+    };
+
+    // counts of durations by powers of two of microseconds, bucket i holds [2^(i-1), 2^i) us
+    class LogHistogram
+    {
+    public:
+        static const size_t BUCKETS = 24;
+
+        void record(uint64_t ns);
+        std::vector<uint64_t> get() const;
+
+    private:
+        std::atomic<uint64_t> m_buckets[BUCKETS] = {};
+    };
+
+    // a snapshot of the counters of an appender, see LogAppender::getMetrics()
+    struct LogAppenderMetrics
+    {
+        std::string type;                       // as in the config
+        std::string file;                       // empty if the appender has none
+        uint64_t events = 0;                    // events formatted
+        uint64_t bytesFormatted = 0;
+        uint64_t bytesWritten = 0;              // to the destination
+        uint64_t writeCalls = 0;                // write(2) and writev(2) calls
+        uint64_t dropped = 0;                   // by a full queue
+        uint64_t queueHighWatermark = 0;        // bytes queued at most
+        std::vector<uint64_t> flushLatency;     // see LogHistogram
+        std::vector<LogAppenderMetrics> wrapped;// of the appender a wrapper writes to
+    };
+
+    // a snapshot of the counters of a logger, see Logger::getMetrics()
+    struct LoggerMetrics
+    {
+        std::string name;
+        uint64_t events = 0;                    // at or above the level, passed to the appenders
+        uint64_t filtered = 0;                  // below the level
+        uint64_t dropped = 0;                   // by full queues
+        std::vector<LogAppenderMetrics> appenders;  // own appenders
+    };
+
+    /*
+        LogTimer:
+            One thread for the appenders that act on time rather than on a line,
+            like the interval flush of FileLogAppender or the count of the repeated
+            lines of CoalescingLogAppender. An owner registers a callback with its
+            period (ms), the callbacks run once per the shortest period and are
+            given the monotonic milliseconds, they check their own deadlines.
+    */
+    class LogTimer
+    {
+    public:
+        LogTimer();
+        ~LogTimer();
+
+        // register or replace the callback of owner, a period of 0 never runs it
+        void add(const void *owner, uint32_t period, std::function<void(uint64_t now)> cb);
+        // no callback of owner runs after this returns
+        void del(const void *owner);
+
+    private:
+        struct Entry
+        {
+            const void *owner;
+            uint32_t period;
+            std::function<void(uint64_t now)> cb;
+        };
+
+        void run();
+
+        Mutex m_mutex;                      // protect m_entries and m_stop, held while the callbacks run
+        std::vector<Entry> m_entries;
+        bool m_stop = false;
+        Semaphore m_semaphore;
+        Thread::ptr m_thread;
+    };
+
     class LogAppender
     {
     friend class Logger;
     protected:
         LogLevel::Level m_level = LogLevel::DEBUG;
-        bool m_hasFormatter = false;
+        std::atomic<bool> m_hasFormatter{false};
+        // owns the formatter in use, replaced under m_formatterMutex
         std::shared_ptr<LogFormatter> m_formatter;
+        // what the logging threads read, without a lock and inside an Epoch::ReadGuard
+        std::atomic<LogFormatter *> m_format{nullptr};
+        mutable Mutex m_formatterMutex;
+        // added to a logger once, a new formatter is published to the snapshots of the loggers then
+        std::atomic<bool> m_attached{false};
+
+        // updated by the subclasses where they format, write and flush
+        struct Counters
+        {
+            LogCounter events;
+            LogCounter bytesFormatted;
+            LogCounter bytesWritten;
+            LogCounter writeCalls;
+            LogCounter queueDepth;
+            LogHistogram flushLatency;
+        };
+        Counters m_counters;
+
+        void formatted(size_t len)
+        {
+            m_counters.events.add();
+            m_counters.bytesFormatted.add(len);
+        }
+
+        // the formatter in use, valid until the Epoch::ReadGuard of the caller ends
+        LogFormatter *formatter() const { return m_format.load(std::memory_order_acquire); }
+        // publish val, own tells if it was set on the appender rather than inherited,
+        // the replaced formatter is returned to be retired by the caller
+        std::shared_ptr<LogFormatter> swapFormatter(std::shared_ptr<LogFormatter> val, bool own);
 
     public:
         virtual ~LogAppender() {}
-        std::shared_ptr<LogFormatter> getFormatter() const { return m_formatter; }
+        std::shared_ptr<LogFormatter> getFormatter() const;
+        // the old formatter is freed once no logging thread may use it
         void setFormatter(std::shared_ptr<LogFormatter> val);
+        bool hasFormatter() const { return m_hasFormatter.load(std::memory_order_relaxed); }
+        LogLevel::Level getLevel() const { return m_level; }
         void setLevel(LogLevel::Level val) { m_level = val; }
         // pure virtual function
         // for StdoutLogAppender and FileLogAppender to realize
-        virtual void log(std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event) = 0;
+        virtual void log(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) = 0;
+        // output bytes that are already formatted
+        // level is the most severe level among the lines in data
+        virtual void write(LogLevel::Level level, const char *data, size_t len) = 0;
+        // push everything buffered to the destination
+        virtual void flush() {}
+        // for the crash handler: write out what is buffered, then len bytes of data
+        // only async-signal-safe calls, no lock and no allocation
+        virtual void drainUnsafe(const char *data, size_t len) {}
+        // a record of ZCSERVER_LOG_BIN_FMT_*, decoded and passed to log() by default
+        virtual void logBinary(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const BinLogSite &site, const char *data, size_t len);
+        // true if log() of the events of logger is formatter()->format() and write() of the line,
+        // the logger then formats an event once for all the appenders with the same formatter
+        // and hands the line to logFormatted() instead of calling log()
+        virtual bool sharesFormat(const Logger &logger) const { return false; }
+        virtual void logFormatted(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *data, size_t len)
+        {
+            formatted(len);
+            write(level, data, len);
+        }
 
         virtual std::string toYamlString() = 0;
+        // the type and the file are taken from toYamlString()
+        virtual LogAppenderMetrics getMetrics();
     };
 
     // std out
     class StdoutLogAppender : public LogAppender
     {
     public:
-        void log(std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event);
+        void log(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event);
+        bool sharesFormat(const Logger &logger) const override { return true; }
+        void write(LogLevel::Level level, const char *data, size_t len) override;
+        void flush() override;
+        void drainUnsafe(const char *data, size_t len) override;
         std::string toYamlString() override;
     };
 
-    // file out
+    /*
+        FileLogAppender:
+            Buffer the lines in user space and write them to a raw fd with writev.
+            The flush policy trades durability against the number of syscalls:
+                bytes           write the buffer once it holds this many bytes
+                interval        write the buffer if the last write is older (ms),
+                                checked when a line is appended and by the LogTimer
+                level           write the buffer at once after a line of this level
+    */
     class FileLogAppender : public LogAppender
     {
-    private:
+    protected:
         std::string m_filename;
-        std::ofstream m_filestream;
+        int m_fd = -1;
+        Mutex m_mutex;
+        std::string m_buffer;
+        uint64_t m_size = 0;                // bytes of the file, including the buffer
+
+        size_t m_flushBytes = 64 * 1024;
+        uint32_t m_flushInterval = 1000;
+        LogLevel::Level m_flushLevel = LogLevel::ERROR;
+        uint64_t m_lastFlush = 0;           // monotonic milliseconds
+        std::shared_ptr<LogTimer> m_timer;
+
+        // write the buffer if it is older than the interval, called by the LogTimer
+        void expire(uint64_t now);
+
+        // the following helpers expect m_mutex to be held
+        // write the buffer followed by len bytes of data
+        void flushLocked(const char *data = nullptr, size_t len = 0);
+        void writeLocked(LogLevel::Level level, const char *data, size_t len);
+        bool reopenLocked();
+
+        // for the subclasses, which register with the LogCrashHandler at the end of
+        // their own constructor and unregister first thing in their destructor, so the
+        // handler never calls them while they are partly constructed or destroyed
+        struct Derived {};
+        FileLogAppender(const std::string &filename, Derived);
 
     public:
         FileLogAppender(const std::string& filename);
-        void log(std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event);
+        ~FileLogAppender();
+        void log(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event);
+        bool sharesFormat(const Logger &logger) const override { return true; }
+        void write(LogLevel::Level level, const char *data, size_t len) override;
+        void flush() override;
+        void drainUnsafe(const char *data, size_t len) override;
         bool reopen();
         std::string toYamlString() override;
+
+        void setFlushPolicy(size_t bytes, uint32_t interval, LogLevel::Level level);
+        size_t getFlushBytes() const { return m_flushBytes; }
+        uint32_t getFlushInterval() const { return m_flushInterval; }
+        LogLevel::Level getFlushLevel() const { return m_flushLevel; }
+    };
+
+    /*
+        RollingFileLogAppender:
+            Write to filename and move it aside when it grows over max_size bytes
+            or when the period of the archive pattern ends. The pattern is expanded
+            with strftime at the start of the period, %i is the index in the period:
+                log/root-%Y%m%d-%i.txt    roll daily
+                log/root-%Y%m%d%H-%i.txt  roll hourly
+            The smallest of %M, %H and %d (%j, %F) in the pattern decides the period.
+            The roll itself is a rename, compressing the archive and removing the
+            ones over max_archives is done by a background thread.
+    */
+    class RollingFileLogAppender : public FileLogAppender
+    {
+    public:
+        enum Period
+        {
+            NONE = 0,
+            MINUTE = 1,
+            HOUR = 2,
+            DAY = 3
+        };
+
+    private:
+        std::string m_pattern;
+        uint64_t m_maxSize;                 // 0 no size limit
+        uint32_t m_maxArchives;             // 0 keep all archives
+        bool m_compress;
+        Period m_period = NONE;
+        time_t m_periodStart = 0;
+        time_t m_nextRoll = 0;              // precomputed boundary of the period
+        uint32_t m_index = 0;
+
+        Mutex m_taskMutex;
+        std::vector<std::string> m_tasks;   // archives to compress
+        bool m_stop = false;
+        Semaphore m_semaphore;
+        Thread::ptr m_thread;
+
+        time_t periodStart(time_t t) const;
+        time_t nextBoundary(time_t t) const;
+        std::string archiveName(uint32_t index) const;
+        void rollLocked(time_t now);
+        void prune();
+        void run();
+
+    public:
+        RollingFileLogAppender(const std::string &filename, const std::string &pattern, uint64_t max_size = 0, uint32_t max_archives = 0, bool compress = true);
+        ~RollingFileLogAppender();
+        void write(LogLevel::Level level, const char *data, size_t len) override;
+        std::string toYamlString() override;
+
+        const std::string &getPattern() const { return m_pattern; }
+        uint64_t getMaxSize() const { return m_maxSize; }
+        uint32_t getMaxArchives() const { return m_maxArchives; }
+        bool getCompress() const { return m_compress; }
+        Period getPeriod() const { return m_period; }
+    };
+
+    /*
+        MmapFileLogAppender:
+            Append to a file through shared mappings of preallocated segments.
+            Writing a line is a fetch_add on the cursor of the current segment and
+            a memcpy, without a lock or a syscall. The line crossing the end of a
+            segment is split, and its writer moves everybody to the next segment,
+            which the background thread has already allocated with fallocate and
+            mapped. The background thread also msyncs asynchronously and unmaps the
+            old segments once no writer is inside them.
+            The writers that reserved past the end meanwhile sleep on a condition
+            until the switch is done. When no segment can be mapped the lines are
+            dropped and counted, and the background thread tries again.
+            The lines are in the page cache as soon as they are copied, a crash of
+            the process loses none of them. The file is cut to the end of the lines
+            when the appender is destroyed, when a segment cannot be mapped and the
+            lines are dropped, or when the file is opened again after a crash.
+    */
+    class MmapFileLogAppender : public LogAppender
+    {
+    public:
+        static const size_t DEFAULT_SEGMENT_SIZE = 16 * 1024 * 1024;
+
+        MmapFileLogAppender(const std::string &filename, size_t segment_size = DEFAULT_SEGMENT_SIZE);
+        ~MmapFileLogAppender();
+
+        void log(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override;
+        bool sharesFormat(const Logger &logger) const override { return true; }
+        void write(LogLevel::Level level, const char *data, size_t len) override;
+        // msync the current segment asynchronously
+        void flush() override;
+        // data is copied if it fits into the current segment
+        void drainUnsafe(const char *data, size_t len) override;
+        std::string toYamlString() override;
+        LogAppenderMetrics getMetrics() override;
+
+        size_t getSegmentSize() const { return m_segmentSize; }
+        // lines lost while no segment could be mapped
+        uint64_t getDropped() const { return m_dropped.load(std::memory_order_relaxed); }
+
+    private:
+        struct Segment
+        {
+            char *base;
+            uint64_t offset;                // in the file, page aligned
+            std::atomic<size_t> cursor;     // bytes reserved, may run past the end
+        };
+
+        // allocate and map the segment at offset, nullptr on error
+        Segment *mapSegment(uint64_t offset, size_t cursor = 0);
+        void unmapSegment(Segment *seg);
+        // cut off the preallocated bytes after m_end
+        void truncate();
+        // called by the writer of the line crossing the end of seg at pos
+        void switchSegment(Segment *seg, size_t pos, const char *data, size_t len);
+        // map the segment at m_end again after a map failed, on the background thread
+        void remap();
+        // background thread main loop
+        void run();
+
+        std::string m_filename;
+        int m_fd = -1;
+        size_t m_segmentSize;
+        std::atomic<Segment *> m_segment{nullptr};
+
+        std::atomic<uint64_t> m_dropped{0};
+
+        Mutex m_mutex;                      // protect the following, serialize switches
+        Condition m_switched;               // m_segment changed, under m_mutex
+        Segment *m_next = nullptr;          // mapped ahead by the background thread
+        std::vector<Segment *> m_retired;   // to unmap when the writers left them
+        bool m_stop = false;
+        uint64_t m_end = 0;                 // end of the lines once m_segment is nullptr
+
+        Semaphore m_semaphore;
+        Thread::ptr m_thread;
     };
 
+    /*
+        LogRing:
+            A single-producer single-consumer byte ring owned by one thread.
+            The owner thread pushes formatted records, LogRingConsumer pops them.
+            Producer and consumer only share m_head and m_tail, each written by
+            one side, so pushing never writes an atomic that another producer
+            touches. Records that do not fit are dropped and counted.
+    */
+    class LogRing
+    {
+    public:
+        // record layout in the ring, followed by len bytes of text
+        struct Record
+        {
+            uint64_t time;          // monotonic nanoseconds, used to merge the rings
+            LogAppender *sink;      // destination appender
+            uint32_t len;
+            uint32_t level;
+
+            const char *data() const { return (const char *)(this + 1); }
+        };
+
+        LogRing(size_t capacity, pid_t tid);
+        ~LogRing();
+
+        // producer side
+        // false if the ring is full, the caller decides to retry or to drop()
+        bool push(LogAppender *sink, LogLevel::Level level, uint64_t time, const char *data, size_t len);
+        // count a record dropped, the consumer reports it in the output
+        void drop() { m_dropped.store(m_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed); }
+        // the owner thread exits, the consumer frees the ring once it is empty
+        void retire() { m_retired.store(true, std::memory_order_release); }
+        // a record of len bytes fits into the empty ring
+        bool fits(size_t len) const;
+        // a full ring: announce the wait, try push() once more, then wait() until
+        // the consumer has drained the ring
+        void prepareWait();
+        void wait() { m_space.wait(); }
+
+        // consumer side
+        // return the oldest record, or nullptr if the ring is empty
+        const Record *front();
+        void pop();
+        // after the ring was drained, wake up its producer if it waits for room
+        void wakeup();
+
+        // bytes in use as the producer last saw the consumer, at least what is in use now
+        size_t getUsed() const { return m_head.load(std::memory_order_relaxed) - m_cachedTail; }
+        bool isRetired() const { return m_retired.load(std::memory_order_acquire); }
+        uint64_t getDropped() const { return m_dropped.load(std::memory_order_relaxed); }
+        pid_t getThreadId() const { return m_tid; }
+
+    private:
+        LogRing(const LogRing &) = delete;
+        LogRing &operator=(const LogRing &) = delete;
+
+        char *m_buffer;
+        size_t m_capacity;                      // power of 2
+        pid_t m_tid;
+
+        // padding keeps the producer and the consumer fields on different cache lines
+        char m_pad0[64];
+        // written by the producer
+        std::atomic<uint64_t> m_head;
+        uint64_t m_cachedTail = 0;              // last m_tail seen by the producer
+        std::atomic<uint64_t> m_dropped;
+        std::atomic<bool> m_retired;
+        std::atomic<bool> m_waiting{false};     // cleared by the consumer that wakes it up
+        Semaphore m_space;
+
+        char m_pad1[64];
+        // written by the consumer
+        std::atomic<uint64_t> m_tail;
+        uint64_t m_cachedHead = 0;              // last m_head seen by the consumer
+        uint64_t m_reportedDrops = 0;
+
+        friend class LogRingConsumer;
+    };
+
+    /*
+        LogRingConsumer:
+            Own the registry of the per-thread rings and the thread draining them.
+            Records of all rings are merged by time before being written.
+            Registration happens once per thread, off the logging hot path.
+    */
+    class LogRingConsumer
+    {
+    public:
+        LogRingConsumer();
+        ~LogRingConsumer();
+
+        // create a ring for the calling thread, see Thread::GetLogRing()
+        LogRing *registerRing(pid_t tid);
+        // drain every ring synchronously in the calling thread
+        void flush();
+        // write the records to their sinks without merging, for the crash handler
+        void drainUnsafe();
+        // wake up the consumer thread, for a producer waiting on a full ring
+        void notify() { m_semaphore.notify(); }
+        // rings registered and not freed yet
+        size_t getRingCount();
+
+    private:
+        void run();
+        // merge and write the pending records, return the number of records
+        size_t drain();
+        void flushSinks();
+
+        Mutex m_mutex;                          // protect m_rings and m_stop
+        std::vector<LogRing *> m_rings;
+        bool m_stop = false;
+
+        Mutex m_drainMutex;                     // only one consumer at a time
+        std::vector<LogRing *> m_active;        // snapshot of m_rings used by drain
+        std::vector<LogAppender *> m_sinks;     // sinks written in this drain
+        std::atomic<pid_t> m_drainer{0};        // the thread in drain(), 0 if none
+        std::atomic<bool> m_crashing{false};    // set by the crash handler, drain() stops
+
+        Semaphore m_semaphore;
+        Thread::ptr m_thread;
+    };
+
+    /*
+        LogCrashHandler:
+            On SIGSEGV, SIGABRT, SIGBUS and SIGFPE write out what the appenders still
+            buffer and a crash record, then let the signal go on to the previous or
+            the default action, so a core is still dumped.
+            The handler only makes async-signal-safe calls, write(2) and writev(2),
+            without locks or allocations. Another thread may be changing a buffer
+            at the same time, the drain is the best effort.
+            Appenders that buffer register themselves while they exist, a wrapper
+            is drained before the appenders it writes to.
+    */
+    class LogCrashHandler
+    {
+    public:
+        // install the handlers, by the application or with log.crash_handler: true,
+        // the signal dispositions of a program are left alone otherwise
+        static void Install();
+        // restore the previous handlers
+        static void Uninstall();
+
+        static void Register(LogAppender *appender, bool wrapper = false);
+        static void Unregister(LogAppender *appender);
+        static void SetRingConsumer(LogRingConsumer *consumer);
+
+        // flush the registered appenders synchronously, after a FATAL event
+        static void FlushAll();
+        // drain the appenders and write the crash record for sig
+        static void Drain(int sig);
+    };
+
+    /*
+        AsyncLogAppender:
+            Wrap another appender and move its I/O to a background writer thread.
+            Producers format the event and append the bytes to the front buffer.
+            The writer thread swaps the front buffer with the back buffer and
+            drains the back buffer into the wrapped appender. It is woken up by
+            the semaphore when the front buffer is full, or every flush interval.
+            The wrapped appender is only touched by one thread at a time.
+
+            With the RING queue, producers push into their own LogRing instead
+            and the shared LogRingConsumer thread writes the wrapped appender.
+
+            The events of a logger with Logger::CONSUMER are queued unformatted
+            and formatted by the writer thread. What the formatter reads, the
+            thread name and the fiber id included, is copied into the queue by
+            value, the content and the fields as raw bytes. A log call then costs
+            a lock and a copy, the writer does all the formatting. The RING queue
+            holds bytes only and always formats in the producer.
+
+            setOverflow() bounds the front buffer and decides what a producer does
+            when it is full, see Overflow. The RING queue is bounded by the ring
+            size, DROP_OLDEST is not possible there as only the consumer pops, it
+            drops the newest instead. Every dropped line is counted, per appender
+            and per Logger, and reported by the LogDropReporter.
+    */
+    class AsyncLogAppender : public LogAppender
+    {
+    public:
+        enum Queue
+        {
+            BUFFER = 0,     // shared double buffer, drained by a writer thread per appender
+            RING = 1        // per-thread rings, drained by the LogRingConsumer
+        };
+
+        // what a producer does when the queue is full
+        enum Overflow
+        {
+            BLOCK = 0,          // wait for the writer to make room
+            DROP_NEWEST = 1,    // drop the line being logged
+            DROP_OLDEST = 2,    // drop the oldest queued lines, an eighth of the bound at a time
+            DROP_BELOW = 3,     // drop the lines below the overflow level, queue the others anyway
+            SPILL = 4           // write the line to the overflow file in the producer thread
+        };
+        static const char *ToString(Overflow overflow);
+        // false if str is not a policy
+        static bool FromString(const std::string &str, Overflow &overflow);
+
+        AsyncLogAppender(std::shared_ptr<LogAppender> appender, size_t buffer_size = 4 * 1024 * 1024, uint32_t flush_interval = 1000, Queue queue = BUFFER);
+        ~AsyncLogAppender();
+
+        void log(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override;
+        // unless the events of logger are formatted by the writer
+        bool sharesFormat(const Logger &logger) const override;
+        void logFormatted(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *data, size_t len) override;
+        void write(LogLevel::Level level, const char *data, size_t len) override;
+        // drain the front buffer synchronously in the calling thread
+        void flush() override;
+        // the front buffer goes to the wrapped appender, data is left to it
+        void drainUnsafe(const char *data, size_t len) override;
+        std::string toYamlString() override;
+        // with the metrics of the wrapped appender
+        LogAppenderMetrics getMetrics() override;
+
+        std::shared_ptr<LogAppender> getAppender() const { return m_appender; }
+        size_t getBufferSize() const { return m_bufferSize; }
+        uint32_t getFlushInterval() const { return m_flushInterval; }
+        Queue getQueue() const { return m_queue; }
+
+        // max_bytes bounds the front buffer, 0 unbounded; level is for DROP_BELOW,
+        // file for SPILL. Set it before the appender is used
+        void setOverflow(size_t max_bytes, Overflow overflow, LogLevel::Level level = LogLevel::ERROR, const std::string &file = "");
+        size_t getMaxBytes() const { return m_maxBytes; }
+        Overflow getOverflow() const { return m_overflow; }
+        LogLevel::Level getOverflowLevel() const { return m_overflowLevel; }
+        const std::string &getOverflowFile() const { return m_overflowFile; }
+        // lines dropped and lines written to the overflow file
+        uint64_t getDropped() const { return m_dropped.load(std::memory_order_relaxed); }
+        uint64_t getSpilled() const { return m_spilled.load(std::memory_order_relaxed); }
+
+    private:
+        // writer thread main loop
+        void run();
+        // swap the buffers and write the back buffer to m_appender
+        void drain();
+        // queue formatted bytes, logger is null for write()
+        void push(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *data, size_t len);
+        // a line that does not fit the queue, spilled or dropped
+        void overflowed(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const char *data, size_t len);
+        void dropped(Logger *logger);
+        // make room for len more bytes by the policy, false if the line is not to be queued
+        bool reserveLocked(Mutex::Lock &lock, LogLevel::Level level, size_t len);
+        // remember where the line just queued ends, for DROP_OLDEST
+        void markLocked(const std::shared_ptr<Logger> &logger);
+        void dropOldestLocked(size_t len);
+        // the line just queued may wake up the writer, true if it should
+        bool queuedLocked(LogLevel::Level level);
+
+        std::shared_ptr<LogAppender> m_appender;
+        size_t m_bufferSize;                        // bytes to wake up the writer
+        uint32_t m_flushInterval;                   // milliseconds between two drains at most
+        Queue m_queue;
+        std::shared_ptr<LogRingConsumer> m_consumer;
+
+        // an event to be formatted by the writer, at an offset of the buffer
+        // the thread name, the content and the field text follow in the data buffer
+        struct Deferred
+        {
+            size_t offset;
+            std::shared_ptr<Logger> logger;
+            LogLevel::Level level;
+            const char *file;
+            int32_t line;
+            uint32_t elapse;
+            uint32_t tid;
+            uint32_t fid;
+            uint64_t time;
+            uint32_t nsec;
+            uint32_t nameLen;
+            uint32_t contentLen;
+            uint32_t fieldTextLen;
+            uint32_t fieldCount;
+            uint32_t mdcLen;
+        };
+        // the ends of a queued line in the parts of Queued
+        struct Mark
+        {
+            size_t bytes;
+            size_t events;
+            size_t data;
+            size_t fields;
+            Logger *logger;                         // kept alive by Queued::loggers
+        };
+        struct Queued
+        {
+            std::string bytes;                      // formatted lines
+            std::vector<Deferred> events;
+            std::string data;                       // the variable parts of the events
+            std::vector<LogField> fields;
+            std::vector<Mark> marks;                // only with DROP_OLDEST
+            std::vector<std::shared_ptr<Logger>> loggers;   // the loggers of the marks, each once
+
+            void swap(Queued &oth);
+            size_t size() const { return bytes.size() + data.size(); }
+        };
+
+        // format the deferred events of m_back into m_formatted, in order with the bytes
+        void formatDeferred();
+
+        Mutex m_mutex;                              // protect the front buffer
+        Queued m_front;
+        LogLevel::Level m_frontLevel = LogLevel::UNKNOWN;
+        bool m_notified = false;                    // writer has been woken up for this front buffer
+        bool m_stop = false;
+        size_t m_blocked = 0;                       // producers waiting for m_space
+
+        size_t m_maxBytes = 0;
+        Overflow m_overflow = DROP_NEWEST;
+        LogLevel::Level m_overflowLevel = LogLevel::ERROR;
+        std::string m_overflowFile;
+        std::shared_ptr<FileLogAppender> m_spill;
+        std::atomic<uint64_t> m_dropped{0};
+        std::atomic<uint64_t> m_spilled{0};
+
+        Mutex m_writeMutex;                         // serialize drains, keep the output in order
+        Queued m_back;
+        std::string m_formatted;
+        std::shared_ptr<LogEvent> m_event;          // rebuilt for each deferred event
+
+        Semaphore m_semaphore;
+        Semaphore m_space;                          // the writer has swapped the buffers
+        Thread::ptr m_thread;
+    };
+
+    /*
+        LogDropReporter:
+            Log a summary of the lines dropped by full queues through the "system"
+            logger, one WARN line per interval (log.drop_report_interval, ms) in
+            which lines were dropped, with the count of each logger.
+            The thread polls the drop counters of all the loggers, a drop only
+            increments a counter. It is started by the first AsyncLogAppender.
+    */
+    class LogDropReporter
+    {
+    public:
+        LogDropReporter();
+        ~LogDropReporter();
+
+        // log the drops since the last report now, return their number
+        uint64_t report();
+
+    private:
+        void run();
+
+        Mutex m_mutex;                              // protect m_lastReport and m_stop
+        uint64_t m_lastReport;                      // monotonic milliseconds
+        bool m_stop = false;
+        Semaphore m_semaphore;
+        Thread::ptr m_thread;
+    };
+
+    /*
+        CoalescingLogAppender:
+            Wrap another appender and collapse runs of the same message.
+            A message is known by its logger, level, call site and content, taken before
+            it is formatted, so a duplicate costs a hash and a compare and is never
+            formatted. The first one is written as usual, the duplicates that follow are
+            counted and written as one "last message repeated N times" line when another
+            message comes, when the window (ms) since the last line is over, or on flush().
+            A burst followed by silence is reported by the LogTimer.
+            Like AsyncLogAppender it formats with its own formatter and writes the bytes.
+    */
+    class CoalescingLogAppender : public LogAppender
+    {
+    public:
+        CoalescingLogAppender(std::shared_ptr<LogAppender> appender, uint32_t window = 1000);
+        ~CoalescingLogAppender();
+
+        void log(const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override;
+        void write(LogLevel::Level level, const char *data, size_t len) override;
+        // write the count of the duplicates so far, then flush the wrapped appender
+        void flush() override;
+        std::string toYamlString() override;
+        // with the metrics of the wrapped appender
+        LogAppenderMetrics getMetrics() override;
+
+        std::shared_ptr<LogAppender> getAppender() const { return m_appender; }
+        uint32_t getWindow() const { return m_window; }
+        // write the count of the duplicates if the window since the last line is over
+        void expire(uint64_t now);
+
+    private:
+        // write the line counting the duplicates of the last message if there are any, m_mutex held
+        void repeatedLocked();
+
+        std::shared_ptr<LogAppender> m_appender;
+        uint32_t m_window;
+        std::shared_ptr<LogTimer> m_timer;
+
+        Mutex m_mutex;
+        uint64_t m_hash = 0;                        // hash of m_key
+        std::string m_key;                          // the bytes that make the last message
+        uint64_t m_repeats = 0;                     // its duplicates not written yet
+        uint64_t m_lastWrite = 0;                   // monotonic ms of the last line of it
+        // the call site of the last message, for the repeat line
+        std::weak_ptr<Logger> m_logger;
+        std::string m_loggerName;
+        // named m_loggerName when the logger of the last message is gone
+        std::shared_ptr<Logger> m_nameLogger;
+        LogLevel::Level m_lastLevel = LogLevel::UNKNOWN;
+        const char *m_file = nullptr;
+        int32_t m_line = 0;
+    };
+
+    /*
+        LogLimiter:
+            Decides whether a statement logs this time, for the ZCSERVER_LOG_EVERY_N family
+            and the rate limit of a logger. The state is a few relaxed atomics, the threads
+            running the same statement share it without a lock.
+            suppressed is set to the number of times dropped since the last pass.
+    */
+    class LogLimiter
+    {
+    private:
+        std::atomic<uint64_t> m_count{0};
+        std::atomic<uint64_t> m_suppressed{0};
+        // monotonic ns, the last pass of everyMs, the theoretical arrival time of rate
+        std::atomic<uint64_t> m_time{0};
+
+    public:
+        bool everyN(uint64_t n, uint64_t &suppressed);
+        bool firstN(uint64_t n);
+        bool everyMs(uint64_t ms, uint64_t &suppressed);
+        // generic cell rate algorithm, per_sec on average, at most per_sec at once
+        bool rate(double per_sec, uint64_t &suppressed);
+    };
+
+    // "[suppressed N] " in front of a message, nothing when N is 0
+    struct LogSuppressed
+    {
+        uint64_t count;
+    };
+
+    inline std::ostream &operator<<(std::ostream &os, const LogSuppressed &v)
+    {
+        if (ZCSERVER_UNLIKELY(v.count))
+        {
+            os << "[suppressed " << v.count << "] ";
+        }
+        return os;
+    }
+
     /*
         Logger: log output assisstant
             A logger has its own LogFormatter. Use logger to output the log in the appointed LogAppenders. LogAppenders are in a list.
     */
+    /*
+        Logger:
+            Loggers form a tree by their dotted names, net.http.client is a child of
+            net.http, which is a child of net, the top level loggers are children of root.
+            A logger with the level UNKNOWN uses the level of its parent, a logger
+            without appenders uses the appenders of its parent.
+
+            The level and the appenders in effect are resolved when the tree changes,
+            not when logging, and the change is passed down to the children that
+            inherit it. The appenders in effect are an immutable snapshot behind an
+            atomic pointer, with the formatter of each appender and whether it takes
+            the line the logger formats. Logging reads the snapshot inside an
+            Epoch::ReadGuard without a lock, a change, a new formatter included,
+            publishes a new snapshot and retires the old one, so the logging threads
+            see either the old or the new set, never a mix of the two.
+    */
     class Logger : public std::enable_shared_from_this<Logger>
     {
     friend class LoggerManager;
+    friend class LogDropReporter;
+    friend class LogAppender;
+    friend class CoalescingLogAppender;
+    public:
+        typedef std::vector<std::shared_ptr<LogAppender>> Appenders;
+
+        // the thread an AsyncLogAppender formats the events of this logger in
+        enum FormatOn
+        {
+            PRODUCER = 0,   // the logging thread, the bytes are queued
+            CONSUMER = 1    // the writer thread, the events are queued
+        };
+
     private:
         // log name
         std::string m_name;
-        // log level, Logger will output those log whose level is higher or equal than the m_level
+        // configured level, UNKNOWN inherits the level of the parent
         LogLevel::Level m_level;
-        std::list<std::shared_ptr<LogAppender>> m_appenders;
+        // Logger will output those log whose level is higher or equal than the level in effect
+        std::atomic<LogLevel::Level> m_effectiveLevel;
+        // own appenders
+        Appenders m_appenders;
+        // what an event is logged with, read once per event
+        struct Snapshot
+        {
+            // own appenders, or those in effect of the parent if there are none
+            Appenders appenders;
+            // the formatter of each appender, kept alive as long as the snapshot
+            std::vector<std::shared_ptr<LogFormatter>> formatters;
+            // each appender takes the line formatted by the logger, see LogAppender::sharesFormat
+            std::vector<bool> shares;
+        };
+        std::atomic<const Snapshot *> m_effective;
         std::shared_ptr<LogFormatter> m_formatter;
-        std::shared_ptr<Logger> m_root;
+        std::shared_ptr<Logger> m_parent;
+        // a child keeps its parent alive and leaves the list when it is destroyed
+        std::vector<Logger *> m_children;
+        // the generation of the tree this logger was last resolved in
+        std::atomic<uint64_t> m_generation;
+        // messages per second of this logger, 0 unlimited
+        std::atomic<uint32_t> m_rateLimit;
+        LogLimiter m_limiter;
+        std::atomic<FormatOn> m_formatOn;
+        std::atomic<uint64_t> m_dropped;
+        uint64_t m_reported = 0;                    // m_dropped at the last drop report, mutex held
+        LogCounter m_events;
+        mutable LogCounter m_filtered;
+        static std::atomic<bool> s_countFiltered;
+
+        // what a change replaced, retired in one grace period once the mutex is released
+        struct Retired
+        {
+            std::vector<const Snapshot *> snapshots;
+            std::vector<std::shared_ptr<LogFormatter>> formatters;
+        };
+
+        // all loggers change under one mutex, as a change is passed down the tree
+        static Mutex &GetMutex();
+        // every logger alive, mutex held
+        static std::vector<Logger *> &GetLoggers();
+        // wait for the readers of retired, then free it, mutex not held
+        static void Retire(Retired &retired);
+        // resolve the level and the appenders in effect of this logger and the children, mutex held
+        void resolveLocked(uint64_t generation, Retired &retired);
+        // resolve after a change of this logger, mutex held
+        void changedLocked(Retired &retired);
+        // resolve every logger after the formatter of an appender in use changed
+        static void Refresh();
+        // attach to the parent and inherit from it, once, before the logger is shared
+        void setParent(std::shared_ptr<Logger> parent);
+        // an appender before i formats the events of level with the same formatter
+        static bool Shared(const Snapshot &snapshot, size_t i, LogLevel::Level level);
+
+        // only carries a name for the formatters, not registered, see CoalescingLogAppender
+        struct NameOnly {};
+        Logger(const std::string &name, NameOnly);
 
     public:
         Logger(const std::string &name = "root");
+        ~Logger();
 
         // writing log and assigning the level
-        void log(LogLevel::Level level, std::shared_ptr<LogEvent> event);
+        void log(LogLevel::Level level, const std::shared_ptr<LogEvent> &event);
+        // writing a record of ZCSERVER_LOG_BIN_FMT_*, self is the pointer this logger is held by
+        void logBinary(const std::shared_ptr<Logger> &self, LogLevel::Level level, const BinLogSite &site, const char *data, size_t len);
         // writing debug log
-        void debug(std::shared_ptr<LogEvent> event);
+        void debug(const std::shared_ptr<LogEvent> &event);
         // writing info log
-        void info(std::shared_ptr<LogEvent> event);
+        void info(const std::shared_ptr<LogEvent> &event);
         // writing warn log
-        void warn(std::shared_ptr<LogEvent> event);
+        void warn(const std::shared_ptr<LogEvent> &event);
         // writing error log
-        void error(std::shared_ptr<LogEvent> event);
+        void error(const std::shared_ptr<LogEvent> &event);
         // writing fatal log
-        void fatal(std::shared_ptr<LogEvent> event);
+        void fatal(const std::shared_ptr<LogEvent> &event);
         // add appender
         void addAppender(std::shared_ptr<LogAppender> appender);
         // delete appender
         void delAppender(std::shared_ptr<LogAppender> appender);
-        // clear all appenders
+        // clear all appenders, the logger uses those of the parent then
         void clearAppenders();
+        // replace the appenders, and the formatter if it is given, in one step
+        void setAppenders(const Appenders &appenders, std::shared_ptr<LogFormatter> formatter = nullptr);
 
-        // get logger level
-        LogLevel::Level getLevel() const { return m_level; }
-        const std::string getName() const { return m_name; }
+        // get the level in effect
+        LogLevel::Level getLevel() const { return m_effectiveLevel.load(std::memory_order_relaxed); }
+        // true if level is below the level in effect, the statement is counted as filtered
+        // only while counting is on, a disabled statement is otherwise a load and a compare
+        bool filter(LogLevel::Level level) const
+        {
+            if (getLevel() > level)
+            {
+                if (ZCSERVER_UNLIKELY(s_countFiltered.load(std::memory_order_relaxed)))
+                {
+                    m_filtered.add();
+                }
+                return true;
+            }
+            return false;
+        }
+        // log.count_filtered
+        static void SetCountFiltered(bool val) { s_countFiltered.store(val, std::memory_order_relaxed); }
+        const std::string &getName() const { return m_name; }
+        const std::shared_ptr<Logger> &getParent() const { return m_parent; }
+        // changes whenever the level or the appenders in effect may have changed
+        uint64_t getGeneration() const { return m_generation.load(std::memory_order_relaxed); }
 
-        void setLevel(LogLevel::Level val) { m_level = val; }
+        // UNKNOWN inherits the level of the parent
+        void setLevel(LogLevel::Level val);
         void setFormatter(std::shared_ptr<LogFormatter> val);
         void setFormatter(const std::string &val);
+        // messages per second of this logger over all statements, 0 unlimited
+        void setRateLimit(uint32_t per_sec) { m_rateLimit.store(per_sec, std::memory_order_relaxed); }
+        uint32_t getRateLimit() const { return m_rateLimit.load(std::memory_order_relaxed); }
+        // not inherited by the children, like the rate limit
+        void setFormatOn(FormatOn val);
+        FormatOn getFormatOn() const { return m_formatOn.load(std::memory_order_relaxed); }
+        // lines of this logger dropped by full queues, see AsyncLogAppender::Overflow
+        uint64_t getDropped() const { return m_dropped.load(std::memory_order_relaxed); }
+        void addDropped(uint64_t count);
+        // the counters of this logger and of its own appenders
+        LoggerMetrics getMetrics();
 
         std::shared_ptr<LogFormatter> getFormatter();
 
@@ -271,11 +1669,40 @@ namespace zcserver
         std::shared_ptr<LogEvent> m_event;
 
     public:
-        LogEventWrap(std::shared_ptr<LogEvent> event);
+        LogEventWrap(const std::shared_ptr<LogEvent> &event);
         ~LogEventWrap();
 
-        std::shared_ptr<LogEvent> getEvent() const { return m_event; }
-        std::stringstream &getSS();
+        const std::shared_ptr<LogEvent> &getEvent() const { return m_event; }
+        LogStream &getSS();
+
+        // a structured field, e.g. ZCSERVER_LOG_INFO(logger).kv("user", id) << "login"
+        template<class T>
+        LogEventWrap &kv(const char *key, const T &v)
+        {
+            m_event->addField(key, v);
+            return *this;
+        }
+
+        // the message after the fields
+        template<class T>
+        LogStream &operator<<(const T &v)
+        {
+            LogStream &ss = m_event->getSS();
+            ss << v;
+            return ss;
+        }
+        LogStream &operator<<(std::ostream &(*manip)(std::ostream &))
+        {
+            LogStream &ss = m_event->getSS();
+            manip(ss);
+            return ss;
+        }
+        LogStream &operator<<(std::ios_base &(*manip)(std::ios_base &))
+        {
+            LogStream &ss = m_event->getSS();
+            manip(ss);
+            return ss;
+        }
     };
 
     // public succeeded class from LogFormatter::FormatItem
@@ -283,9 +1710,9 @@ namespace zcserver
     {
     public:
         MessageFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event) override
+        void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override
         {
-            os << event->getContent();
+            os.write(event->getContentData(), event->getContentSize());
         }
     };
 
@@ -293,7 +1720,7 @@ namespace zcserver
     {
     public:
         LevelFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event) override
+        void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override
         {
             os << LogLevel::ToString(level);
         }
@@ -303,7 +1730,7 @@ namespace zcserver
     {
     public:
         ElapseFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event) override
+        void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override
         {
             os << event->getElapse();
         }
@@ -313,7 +1740,7 @@ namespace zcserver
     {
     public:
         NameFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event) override
+        void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override
         {
             // we are probably using root as the logger, in this case we do not output the root but the event logger
             os << event->getLogger()->getName();
@@ -324,7 +1751,7 @@ namespace zcserver
     {
     public:
         ThreadIdFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event) override
+        void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override
         {
             os << event->getThreadId();
         }
@@ -334,42 +1761,126 @@ namespace zcserver
     {
     public:
         FiberIdFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event) override
+        void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override
         {
             os << event->getFiberId();
         }
     };
 
+    class ThreadNameFormatItem : public LogFormatter::FormatItem
+    {
+    public:
+        ThreadNameFormatItem(const std::string &str = "") {}
+        void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override
+        {
+            os << event->getThreadName();
+        }
+    };
+
+    // %X{key} or %X, see LogContext
+    class MdcFormatItem : public LogFormatter::FormatItem
+    {
+    private:
+        std::string m_key;
+
+    public:
+        MdcFormatItem(const std::string &str = "") : m_key(str) {}
+        void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override;
+        void append(LogStream &out, const LogEvent &event);
+    };
+
+    /*
+        DateTimeFormatItem:
+            The format is given to strftime, plus %N for the sub-second digits:
+            %3N milliseconds, %6N microseconds, %9N or %N nanoseconds.
+            localtime_r and strftime run once per second per thread, the text
+            is cached and only the sub-second digits are rendered per event.
+    */
     class DateTimeFormatItem : public LogFormatter::FormatItem
     {
     private:
+        // a piece of the format, either given to strftime or sub-second digits
+        struct Part
+        {
+            std::string strftime;
+            int digits = 0;
+        };
+
         std::string m_format;
+        std::vector<Part> m_parts;
+        uint64_t m_id;                  // key of the per-thread cache
+
+        void init();
 
     public:
+        static const size_t MAX_SIZE = 128;
+
         DateTimeFormatItem(const std::string &format = "%Y-%m-%d %H:%M:%S") : m_format(format)
         {
             if (m_format.empty())
             {
                 m_format = "%Y-%m-%d %H:%M:%S";
             }
+            init();
+        }
+
+        void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override
+        {
+            char buf[MAX_SIZE];
+            os.write(buf, render(buf, event->getTime(), event->getNanoseconds()));
+        }
+
+        // used by the compiled formatters
+        void append(LogStream &out, const LogEvent &event) const
+        {
+            out.commit(render(out.prepare(MAX_SIZE), event.getTime(), event.getNanoseconds()));
+        }
+
+        // write at most MAX_SIZE bytes to buf, return the size
+        size_t render(char *buf, time_t sec, uint32_t nsec) const;
+    };
+
+    // %J: {"time":...,"level":...,"logger":...,"thread":...,"fiber":...,"file":...,"line":...,"msg":..., fields}
+    class JsonFormatItem : public LogFormatter::FormatItem
+    {
+    private:
+        DateTimeFormatItem m_time;
+
+    public:
+        JsonFormatItem(const std::string &format = "") : m_time(format.empty() ? "%Y-%m-%dT%H:%M:%S.%6N" : format) {}
+
+        void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override
+        {
+            LogStream out;
+            append(out, level, *event);
+            os.write(out.data(), out.size());
         }
 
-        void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event) override
+        // used by the compiled formatters
+        void append(LogStream &out, LogLevel::Level level, const LogEvent &event) const;
+    };
+
+    // %K: the structured fields as key=value, a value is quoted if it needs to be
+    class LogfmtFormatItem : public LogFormatter::FormatItem
+    {
+    public:
+        LogfmtFormatItem(const std::string &str = "") {}
+
+        void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override
         {
-            struct tm tm;
-            time_t time = event->getTime();
-            localtime_r(&time, &tm);
-            char buf[64];
-            strftime(buf, sizeof(buf), m_format.c_str(), &tm);
-            os << buf;
+            LogStream out;
+            Append(out, *event);
+            os.write(out.data(), out.size());
         }
+
+        static void Append(LogStream &out, const LogEvent &event);
     };
 
     class FilenameFormatItem : public LogFormatter::FormatItem
     {
     public:
         FilenameFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event) override
+        void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override
         {
             os << event->getFile();
         }
@@ -379,7 +1890,7 @@ namespace zcserver
     {
     public:
         LineFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event) override
+        void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override
         {
             os << event->getLine();
         }
@@ -389,7 +1900,7 @@ namespace zcserver
     {
     public:
         NewLineFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event) override
+        void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override
         {
             os << std::endl;
         }
@@ -402,7 +1913,7 @@ namespace zcserver
 
     public:
         StringFormatItem(const std::string &str) : m_string(str) {}
-        void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event) override
+        void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override
         {
             os << m_string;
         }
@@ -415,31 +1926,214 @@ namespace zcserver
 
     public:
         TabFormatItem(const std::string &str = "") {}
-        void format(std::ostream &os, std::shared_ptr<Logger> logger, LogLevel::Level level, std::shared_ptr<LogEvent> event) override
+        void format(std::ostream &os, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override
         {
             os << "\t";
         }
     };
 
+    /*
+        Items of StaticLogFormatter.
+        Each item appends itself to the buffer and gives its pattern.
+    */
+    namespace pattern
+    {
+        struct Message
+        {
+            static const char *Pattern() { return "%m"; }
+            static void Append(LogStream &out, const Logger &logger, LogLevel::Level level, const LogEvent &event)
+            {
+                out.append(event.getContentData(), event.getContentSize());
+            }
+        };
+
+        struct Level
+        {
+            static const char *Pattern() { return "%p"; }
+            static void Append(LogStream &out, const Logger &logger, LogLevel::Level level, const LogEvent &event)
+            {
+                out.append(LogLevel::ToString(level));
+            }
+        };
+
+        struct Elapse
+        {
+            static const char *Pattern() { return "%r"; }
+            static void Append(LogStream &out, const Logger &logger, LogLevel::Level level, const LogEvent &event)
+            {
+                out.appendUInt(event.getElapse());
+            }
+        };
+
+        struct Name
+        {
+            static const char *Pattern() { return "%c"; }
+            static void Append(LogStream &out, const Logger &logger, LogLevel::Level level, const LogEvent &event);
+        };
+
+        struct ThreadId
+        {
+            static const char *Pattern() { return "%t"; }
+            static void Append(LogStream &out, const Logger &logger, LogLevel::Level level, const LogEvent &event)
+            {
+                out.appendUInt(event.getThreadId());
+            }
+        };
+
+        struct FiberId
+        {
+            static const char *Pattern() { return "%F"; }
+            static void Append(LogStream &out, const Logger &logger, LogLevel::Level level, const LogEvent &event)
+            {
+                out.appendUInt(event.getFiberId());
+            }
+        };
+
+        // %d{%Y-%m-%d %H:%M:%S}
+        struct DateTime
+        {
+            static const char *Pattern() { return "%d{%Y-%m-%d %H:%M:%S}"; }
+            static void Append(LogStream &out, const Logger &logger, LogLevel::Level level, const LogEvent &event)
+            {
+                static const DateTimeFormatItem s_item;
+                s_item.append(out, event);
+            }
+        };
+
+        struct Filename
+        {
+            static const char *Pattern() { return "%f"; }
+            static void Append(LogStream &out, const Logger &logger, LogLevel::Level level, const LogEvent &event)
+            {
+                out.append(event.getFile());
+            }
+        };
+
+        struct Line
+        {
+            static const char *Pattern() { return "%l"; }
+            static void Append(LogStream &out, const Logger &logger, LogLevel::Level level, const LogEvent &event)
+            {
+                out.appendInt(event.getLine());
+            }
+        };
+
+        struct Tab
+        {
+            static const char *Pattern() { return "%T"; }
+            static void Append(LogStream &out, const Logger &logger, LogLevel::Level level, const LogEvent &event)
+            {
+                out.append("\t", 1);
+            }
+        };
+
+        struct NewLine
+        {
+            static const char *Pattern() { return "%n"; }
+            static void Append(LogStream &out, const Logger &logger, LogLevel::Level level, const LogEvent &event)
+            {
+                out.append("\n", 1);
+            }
+        };
+
+        // a literal character, '%' is not supported
+        template <char C>
+        struct Char
+        {
+            static const char *Pattern()
+            {
+                static const char s_str[] = {C, '\0'};
+                return s_str;
+            }
+            static void Append(LogStream &out, const Logger &logger, LogLevel::Level level, const LogEvent &event)
+            {
+                out.append(Pattern(), 1);
+            }
+        };
+    }
+
+    /*
+        StaticLogFormatter:
+            A formatter whose pattern is fixed at compile time.
+            The items are template parameters, the whole pattern is inlined
+            into one function without parsing, opcodes or virtual calls.
+            For example the default pattern of Logger is DefaultLogFormatter.
+    */
+    template <class... Items>
+    class StaticLogFormatter : public LogFormatter
+    {
+    public:
+        StaticLogFormatter() : LogFormatter(MakePattern()) {}
+
+        using LogFormatter::format;
+
+        void format(LogStream &out, const std::shared_ptr<Logger> &logger, LogLevel::Level level, const std::shared_ptr<LogEvent> &event) override
+        {
+            // expand Items::Append in order
+            int expand[] = {0, (Items::Append(out, *logger, level, *event), 0)...};
+            (void)expand;
+        }
+
+        static std::string MakePattern()
+        {
+            std::string pattern;
+            int expand[] = {0, (pattern.append(Items::Pattern()), 0)...};
+            (void)expand;
+            return pattern;
+        }
+    };
+
+    // %d{%Y-%m-%d %H:%M:%S}%T%t%T%F%T[%p]%T[%c]%T%f:%l%T%m%n
+    typedef StaticLogFormatter<pattern::DateTime, pattern::Tab, pattern::ThreadId, pattern::Tab, pattern::FiberId, pattern::Tab,
+                               pattern::Char<'['>, pattern::Level, pattern::Char<']'>, pattern::Tab,
+                               pattern::Char<'['>, pattern::Name, pattern::Char<']'>, pattern::Tab,
+                               pattern::Filename, pattern::Char<':'>, pattern::Line, pattern::Tab, pattern::Message, pattern::NewLine>
+        DefaultLogFormatter;
+
     // manager for all loggers
     // setting the level, format, appender
+    // the loggers are spread over shards by the hash of their names,
+    // a lookup takes the read lock of one shard, only a new logger takes its write lock
+    // a logger is never removed, so a handle to it stays valid
     class LoggerManager
     {
     private:
-        std::map<std::string, std::shared_ptr<Logger>> m_loggers;
+        static const size_t SHARD_COUNT = 16;
+
+        struct Shard
+        {
+            RWMutex mutex;
+            std::unordered_map<std::string, std::shared_ptr<Logger>> loggers;
+        };
+
+        Shard m_shards[SHARD_COUNT];
         std::shared_ptr<Logger> m_root;
 
+        Shard &getShard(const std::string &name) { return m_shards[std::hash<std::string>()(name) % SHARD_COUNT]; }
+
     public:
         // using Singleton to create a single object
         LoggerManager();
         std::shared_ptr<Logger> getLogger(const std::string &name);
-        std::shared_ptr<Logger> getRoot() const { return m_root; }
+        const std::shared_ptr<Logger> &getRoot() const { return m_root; }
         void init();
         std::string toYamlString();
+        // the counters of all loggers, by name
+        std::vector<LoggerMetrics> getMetrics();
+        // getMetrics() as yaml, a list like toYamlString()
+        std::string metricsToYamlString();
     };
 
     // LoggerManager Singleton Pattern
     typedef zcserver::Singleton<LoggerManager> LoggerMgr;
+    // shared by the ring mode AsyncLogAppenders, which keep it alive until they are destroyed
+    typedef zcserver::SingletonPtr<LogRingConsumer> LogRingConsumerMgr;
+    typedef zcserver::SingletonPtr<LogDropReporter> LogDropReporterMgr;
+    typedef zcserver::SingletonPtr<LogTimer> LogTimerMgr;
 }
 
+#ifdef ZCSERVER_LOG_BINARY
+#include "binlog.h"
+#endif
+
 #endif
\ No newline at end of file
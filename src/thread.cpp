@@ -1,3 +1,7 @@
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <vector>
 #include "thread.h"
 #include "log.h"
 
@@ -7,9 +11,179 @@ namespace zcserver
     static thread_local Thread* t_thread = nullptr;
     // although each thread has the attribute "m_name", visit a static variable is more efficient
     static thread_local std::string t_thread_name = "UNKNOWN";
+    // ring of the asynchronous logs produced by this thread, created lazily
+    // retired when the thread exits, a std::thread or a raw pthread as well
+    struct LogRingHolder
+    {
+        LogRing *ring = nullptr;
+
+        ~LogRingHolder()
+        {
+            if (ring)
+            {
+                // hand the ring over to the consumer, which frees it once drained
+                ring->retire();
+                ring = nullptr;
+            }
+        }
+    };
+    static thread_local LogRingHolder t_log_ring;
 
     static std::shared_ptr<Logger> g_logger = ZCSERVER_LOG_NAME("system");
 
+    /*********************************
+     * class Epoch
+     *********************************/
+
+    struct Epoch::Record
+    {
+        // the global epoch when the reader entered, 0 outside of a ReadGuard
+        std::atomic<uint64_t> epoch{0};
+        uint32_t nest = 0;
+        std::atomic<bool> used{true};
+        Record *next = nullptr;
+    };
+
+    // the records are never freed, a thread that exits gives its record to the next one
+    static std::atomic<uint64_t> s_epoch{1};
+    static std::atomic<Epoch::Record *> s_epoch_records{nullptr};
+
+    struct EpochRecordHolder
+    {
+        Epoch::Record *record = nullptr;
+        ~EpochRecordHolder()
+        {
+            if (record)
+            {
+                record->used.store(false, std::memory_order_release);
+            }
+        }
+    };
+    static thread_local EpochRecordHolder t_epoch_record;
+
+    struct RetiredItem
+    {
+        uint64_t epoch;
+        std::function<void()> deleter;
+    };
+
+    // deleters retired from inside a ReadGuard
+    static Mutex &GetRetiredMutex()
+    {
+        static Mutex s_mutex;
+        return s_mutex;
+    }
+
+    static std::vector<RetiredItem> &GetRetired()
+    {
+        static std::vector<RetiredItem> s_retired;
+        return s_retired;
+    }
+
+    Epoch::Record *Epoch::GetRecord()
+    {
+        Record *record = t_epoch_record.record;
+        if (record)
+        {
+            return record;
+        }
+        for (Record *i = s_epoch_records.load(std::memory_order_acquire); i; i = i->next)
+        {
+            bool used = false;
+            if (!i->used.load(std::memory_order_relaxed) && i->used.compare_exchange_strong(used, true, std::memory_order_acquire))
+            {
+                record = i;
+                break;
+            }
+        }
+        if (!record)
+        {
+            record = new Record;
+            record->next = s_epoch_records.load(std::memory_order_relaxed);
+            while (!s_epoch_records.compare_exchange_weak(record->next, record, std::memory_order_release))
+                ;
+        }
+        t_epoch_record.record = record;
+        return record;
+    }
+
+    Epoch::ReadGuard::ReadGuard() : m_record(GetRecord())
+    {
+        if (m_record->nest++ == 0)
+        {
+            m_record->epoch.store(s_epoch.load(std::memory_order_acquire), std::memory_order_relaxed);
+            // the epoch must be visible before the reads of the published pointers
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+    }
+
+    Epoch::ReadGuard::~ReadGuard()
+    {
+        if (--m_record->nest == 0)
+        {
+            m_record->epoch.store(0, std::memory_order_release);
+        }
+    }
+
+    uint64_t Epoch::MinActive()
+    {
+        uint64_t min = UINT64_MAX;
+        for (Record *i = s_epoch_records.load(std::memory_order_acquire); i; i = i->next)
+        {
+            uint64_t e = i->epoch.load(std::memory_order_seq_cst);
+            if (e && e < min)
+            {
+                min = e;
+            }
+        }
+        return min;
+    }
+
+    void Epoch::Retire(std::function<void()> deleter)
+    {
+        // readers entering from now on see the epoch after e and the new pointer
+        uint64_t e = s_epoch.fetch_add(1, std::memory_order_seq_cst);
+        Record *self = t_epoch_record.record;
+        if (self && self->nest)
+        {
+            Mutex::Lock lock(GetRetiredMutex());
+            GetRetired().push_back(RetiredItem{e, deleter});
+            return;
+        }
+        while (MinActive() <= e)
+        {
+            sched_yield();
+        }
+        deleter();
+
+        std::vector<RetiredItem> ready;
+        {
+            Mutex::Lock lock(GetRetiredMutex());
+            auto &retired = GetRetired();
+            if (retired.empty())
+            {
+                return;
+            }
+            uint64_t min = MinActive();
+            for (auto it = retired.begin(); it != retired.end();)
+            {
+                if (it->epoch < min)
+                {
+                    ready.push_back(*it);
+                    it = retired.erase(it);
+                }
+                else
+                {
+                    ++it;
+                }
+            }
+        }
+        for (auto &i : ready)
+        {
+            i.deleter();
+        }
+    }
+
     Semaphore::Semaphore(uint32_t count)
     {
         // Initialize semaphore object
@@ -35,6 +209,32 @@ namespace zcserver
         }
     }
 
+    bool Semaphore::timedWait(uint64_t timeout_ms)
+    {
+        // sem_timedwait() takes an absolute CLOCK_REALTIME deadline
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout_ms / 1000;
+        ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000)
+        {
+            ts.tv_sec += 1;
+            ts.tv_nsec -= 1000000000;
+        }
+        while (sem_timedwait(&m_semaphore, &ts))
+        {
+            if (errno == ETIMEDOUT)
+            {
+                return false;
+            }
+            if (errno != EINTR)
+            {
+                throw std::logic_error("semaphore timedwait error");
+            }
+        }
+        return true;
+    }
+
     void Semaphore::notify()
     {
         // increments (unlocks) the semaphore pointed to by m_semaphore
@@ -108,6 +308,15 @@ namespace zcserver
         t_thread_name = name;
     }
 
+    LogRing *Thread::GetLogRing()
+    {
+        if (!t_log_ring.ring)
+        {
+            t_log_ring.ring = LogRingConsumerMgr::GetInstance()->registerRing(GetThreadId());
+        }
+        return t_log_ring.ring;
+    }
+
     void* Thread::run(void *arg)
     {
         Thread* thread = (Thread*)arg;
@@ -122,8 +331,17 @@ namespace zcserver
         // reduce the reference of shared_ptr
         std::function<void()> cb;
         cb.swap(thread->m_cb);
-        cb();
+        // the constructor is blocked until the thread is really running
+        // release it before the call back, otherwise a long-running call back
+        // (e.g. a background writer) would never let the constructor return
         thread->m_semaphore.notify();
+        cb();
+        if (t_log_ring.ring)
+        {
+            // before the join returns, not at the end of the thread
+            t_log_ring.ring->retire();
+            t_log_ring.ring = nullptr;
+        }
         return 0;
     }
 }
\ No newline at end of file
@@ -2,13 +2,17 @@
 #define __ZCSERVER_THREAD_H__
 
 #include <thread>
+#include <atomic>
 #include <functional>
 #include <memory>
+#include <string>
 #include <pthread.h>
 #include <semaphore.h>
 
 namespace zcserver
 {
+    class LogRing;
+
     // lock_guard template
     template <class T>
     class ScopedLockImpl
@@ -57,6 +61,9 @@ namespace zcserver
         // count minus one
         // if count equals zero, block the thread
         void wait();
+        // same as wait(), but give up after timeout_ms milliseconds
+        // return false if the count is still zero when timed out
+        bool timedWait(uint64_t timeout_ms);
         // count add one
         // if a thread is waiting, wake up the thread
         void notify();
@@ -180,6 +187,117 @@ namespace zcserver
         pthread_rwlock_t m_lock;
     };
 
+    // mutual exclusion lock
+    class Mutex
+    {
+    friend class Condition;
+    public:
+        typedef ScopedLockImpl<Mutex> Lock;
+
+    public:
+        Mutex()
+        {
+            pthread_mutex_init(&m_mutex, nullptr);
+        }
+
+        ~Mutex()
+        {
+            pthread_mutex_destroy(&m_mutex);
+        }
+
+        void lock()
+        {
+            pthread_mutex_lock(&m_mutex);
+        }
+
+        void unlock()
+        {
+            pthread_mutex_unlock(&m_mutex);
+        }
+
+    private:
+        Mutex(const Mutex &) = delete;
+        Mutex &operator=(const Mutex &) = delete;
+
+        pthread_mutex_t m_mutex;
+    };
+
+    // condition variable, waited on with a Mutex held
+    class Condition
+    {
+    public:
+        Condition()
+        {
+            pthread_cond_init(&m_cond, nullptr);
+        }
+
+        ~Condition()
+        {
+            pthread_cond_destroy(&m_cond);
+        }
+
+        // release mutex, sleep until notified, lock mutex again
+        // may return without a notify, the caller checks its condition again
+        void wait(Mutex &mutex)
+        {
+            pthread_cond_wait(&m_cond, &mutex.m_mutex);
+        }
+
+        // wake up all the waiting threads
+        void notifyAll()
+        {
+            pthread_cond_broadcast(&m_cond);
+        }
+
+    private:
+        Condition(const Condition &) = delete;
+        Condition &operator=(const Condition &) = delete;
+
+        pthread_cond_t m_cond;
+    };
+
+    /*
+        Epoch:
+            Reclamation for data that is read without locks, in the way of RCU.
+            A reader holds a ReadGuard while it uses a published pointer, which
+            costs no lock and no reference count. A writer publishes the new
+            pointer first and retires the old one, its deleter runs after every
+            reader that might still see it has left.
+    */
+    class Epoch
+    {
+    public:
+        struct Record;
+
+        class ReadGuard
+        {
+        public:
+            ReadGuard();
+            ~ReadGuard();
+
+        private:
+            ReadGuard(const ReadGuard &) = delete;
+            ReadGuard &operator=(const ReadGuard &) = delete;
+
+            Record *m_record;
+        };
+
+        // wait for the readers and run deleter
+        // a thread inside a ReadGuard cannot wait for itself, its deleter runs on a later Retire
+        static void Retire(std::function<void()> deleter);
+
+        template <class T>
+        static void Retire(const T *p)
+        {
+            Retire([p]() { delete p; });
+        }
+
+    private:
+        static Record *GetRecord();
+        // the smallest epoch of the readers inside a ReadGuard
+        static uint64_t MinActive();
+    };
+
     class Thread
     {
     public:
@@ -206,6 +324,9 @@ namespace zcserver
         // mainly set for the main thread which is not created by users
         static void SetName(const std::string &name);
 
+        // the log ring of present running thread, registered on the first call
+        static LogRing *GetLogRing();
+
     private:
         // delete copy constructor
         Thread(const Thread&) = delete;
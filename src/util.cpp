@@ -1,4 +1,5 @@
 #include "util.h"
+#include "fiber.h"
 
 namespace zcserver
 {
@@ -10,6 +11,6 @@ namespace zcserver
 
     uint32_t GetFiberId()
     {
-        return 0;
+        return Fiber::GetFiberId();
     }
 }
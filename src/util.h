@@ -8,6 +8,15 @@
 #include <stdio.h>
 #include <stdint.h>
 
+// hint the compiler which way a branch usually goes
+#if defined(__GNUC__) || defined(__clang__)
+#define ZCSERVER_LIKELY(x) __builtin_expect(!!(x), 1)
+#define ZCSERVER_UNLIKELY(x) __builtin_expect(!!(x), 0)
+#else
+#define ZCSERVER_LIKELY(x) (x)
+#define ZCSERVER_UNLIKELY(x) (x)
+#endif
+
 namespace zcserver
 {
     pid_t GetThreadId();
@@ -0,0 +1,68 @@
+#include "../src/log.h"
+#include <time.h>
+
+// per-event cost of rendering %d, before and after the per-thread cache
+
+static const int s_loops = 1000000;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+// the former DateTimeFormatItem: localtime_r + strftime on every event
+static double bench_uncached(const char *format)
+{
+    char buf[128];
+    size_t total = 0;
+    time_t base = time(0);
+    uint64_t begin = now_ns();
+    for (int i = 0; i < s_loops; i++)
+    {
+        // a new second every 1000 events
+        time_t sec = base + i / 1000;
+        struct tm tm;
+        localtime_r(&sec, &tm);
+        total += strftime(buf, sizeof(buf), format, &tm);
+    }
+    uint64_t end = now_ns();
+    if (total == 0)
+    {
+        std::cout << "nothing rendered" << std::endl;
+    }
+    return (double)(end - begin) / s_loops;
+}
+
+static double bench_cached(const char *format)
+{
+    zcserver::DateTimeFormatItem item(format);
+    char buf[zcserver::DateTimeFormatItem::MAX_SIZE];
+    size_t total = 0;
+    time_t base = time(0);
+    uint64_t begin = now_ns();
+    for (int i = 0; i < s_loops; i++)
+    {
+        total += item.render(buf, base + i / 1000, i * 1000);
+    }
+    uint64_t end = now_ns();
+    if (total == 0)
+    {
+        std::cout << "nothing rendered" << std::endl;
+    }
+    return (double)(end - begin) / s_loops;
+}
+
+int main()
+{
+    std::cout << "format\tuncached_ns\tcached_ns" << std::endl;
+    std::cout << "%Y-%m-%d %H:%M:%S\t" << bench_uncached("%Y-%m-%d %H:%M:%S")
+              << "\t" << bench_cached("%Y-%m-%d %H:%M:%S") << std::endl;
+    // the uncached version cannot print the sub-second part, it renders the seconds only
+    std::cout << "%Y-%m-%d %H:%M:%S.%3N\t" << bench_uncached("%Y-%m-%d %H:%M:%S")
+              << "\t" << bench_cached("%Y-%m-%d %H:%M:%S.%3N") << std::endl;
+    std::cout << "%H:%M:%S.%9N\t" << bench_uncached("%H:%M:%S")
+              << "\t" << bench_cached("%H:%M:%S.%9N") << std::endl;
+    return 0;
+}
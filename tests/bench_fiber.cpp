@@ -0,0 +1,103 @@
+#include "../src/fiber.h"
+#include "../src/log.h"
+#include <ucontext.h>
+#include <stdlib.h>
+
+/*
+    cost of the fiber primitives
+
+    usage: bench_fiber [loops]
+
+    one tab separated line per case:
+        case        switch (one swapIn or swapOut), create (construct, run to
+                    the end and destroy a fiber, the stack from the pool),
+                    create_unpooled (the same with a stack of another size,
+                    mmap'd and unmapped each time) or swapcontext (one
+                    swapcontext, the switch of the portable fallback)
+        ns_per_op   wall time of the run divided by the operations
+*/
+
+static int s_loops = 1000000;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static void report(const char *name, uint64_t ns, uint64_t ops)
+{
+    std::cout << name << "\t" << (double)ns / ops << std::endl;
+}
+
+static void bench_switch()
+{
+    zcserver::Fiber::ptr fiber(new zcserver::Fiber([]()
+    {
+        while (true)
+        {
+            zcserver::Fiber::YieldToHold();
+        }
+    }));
+    uint64_t begin = now_ns();
+    for (int i = 0; i < s_loops; i++)
+    {
+        fiber->swapIn();
+    }
+    report("switch", now_ns() - begin, 2ul * s_loops);
+    // never finishes, leave it suspended for the process to clean up
+    new zcserver::Fiber::ptr(fiber);
+}
+
+static void bench_create(const char *name, size_t stacksize, int loops)
+{
+    uint64_t begin = now_ns();
+    for (int i = 0; i < loops; i++)
+    {
+        zcserver::Fiber::ptr fiber(new zcserver::Fiber([]() {}, stacksize));
+        fiber->swapIn();
+    }
+    report(name, now_ns() - begin, loops);
+}
+
+static ucontext_t s_main_ctx;
+static ucontext_t s_fiber_ctx;
+
+static void context_main()
+{
+    while (true)
+    {
+        swapcontext(&s_fiber_ctx, &s_main_ctx);
+    }
+}
+
+static void bench_swapcontext()
+{
+    std::vector<char> stack(128 * 1024);
+    getcontext(&s_fiber_ctx);
+    s_fiber_ctx.uc_link = nullptr;
+    s_fiber_ctx.uc_stack.ss_sp = stack.data();
+    s_fiber_ctx.uc_stack.ss_size = stack.size();
+    makecontext(&s_fiber_ctx, &context_main, 0);
+    uint64_t begin = now_ns();
+    for (int i = 0; i < s_loops; i++)
+    {
+        swapcontext(&s_main_ctx, &s_fiber_ctx);
+    }
+    report("swapcontext", now_ns() - begin, 2ul * s_loops);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+    {
+        s_loops = atoi(argv[1]);
+    }
+    zcserver::Fiber::GetThis();
+    bench_switch();
+    bench_create("create", 0, s_loops);
+    bench_create("create_unpooled", 256 * 1024, s_loops / 10);
+    bench_swapcontext();
+    return 0;
+}
@@ -0,0 +1,266 @@
+#include "../src/log.h"
+#include "../src/binlog.h"
+#include "../src/thread.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <algorithm>
+
+/*
+    throughput and latency of a log statement
+
+    usage: bench_log [loops per thread] [max threads]
+
+    one tab separated line per case:
+        case        what is measured, the appender or the formatter pattern
+        macro       stream, fmt, bin (binary records) or disabled (filtered DEBUG)
+        threads     number of logging threads, each runs the loops
+        ns_per_op   wall time of the run divided by the statements of one thread
+        msgs_per_s  statements of all threads per second
+        p50/p99/p999_ns
+                    latency of single statements, including two clock reads
+    the async appenders are measured on the producer side only, except the
+    format_on cases marked "drained": their ns_per_op and msgs_per_s include
+    writing out the queue, so the writer thread shows when it is the bottleneck
+*/
+
+static int s_loops = 100000;
+static int s_max_threads = 4;
+static const char *s_file = "./bench_log.txt";
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+// formats every event and throws the result away
+class NullLogAppender : public zcserver::LogAppender
+{
+public:
+    void log(const std::shared_ptr<zcserver::Logger> &logger, zcserver::LogLevel::Level level, const std::shared_ptr<zcserver::LogEvent> &event) override
+    {
+        if (level >= m_level)
+        {
+            static thread_local zcserver::LogStream t_out;
+            t_out.reset();
+            formatter()->format(t_out, logger, level, event);
+        }
+    }
+    // alone it formats in log(), with others sharing the formatter the logger formats once
+    bool sharesFormat(const zcserver::Logger &logger) const override { return true; }
+    void write(zcserver::LogLevel::Level level, const char *data, size_t len) override {}
+    std::string toYamlString() override { return "type: NullLogAppender"; }
+};
+
+typedef void (*Call)(const std::shared_ptr<zcserver::Logger> &logger, int i);
+
+static void stream_call(const std::shared_ptr<zcserver::Logger> &logger, int i)
+{
+    ZCSERVER_LOG_INFO(logger) << "request " << i << " took " << 0.5 * i << " ms from " << "127.0.0.1";
+}
+
+static void fmt_call(const std::shared_ptr<zcserver::Logger> &logger, int i)
+{
+    ZCSERVER_LOG_FMT_INFO(logger, "request %d took %f ms from %s", i, 0.5 * i, "127.0.0.1");
+}
+
+static void bin_call(const std::shared_ptr<zcserver::Logger> &logger, int i)
+{
+    ZCSERVER_LOG_BIN_FMT_INFO(logger, "request %d took %f ms from %s", i, 0.5 * i, "127.0.0.1");
+}
+
+static void disabled_call(const std::shared_ptr<zcserver::Logger> &logger, int i)
+{
+    ZCSERVER_LOG_DEBUG(logger) << "request " << i << " took " << 0.5 * i << " ms from " << "127.0.0.1";
+}
+
+static std::string run(const std::string &name, const char *macro, Call call, std::shared_ptr<zcserver::LogAppender> appender,
+                       int threads, const std::string &pattern = "", zcserver::LogLevel::Level level = zcserver::LogLevel::DEBUG,
+                       zcserver::Logger::FormatOn format_on = zcserver::Logger::PRODUCER, bool drained = false, int copies = 1)
+{
+    std::shared_ptr<zcserver::Logger> logger(new zcserver::Logger("bench"));
+    logger->setLevel(level);
+    logger->setFormatOn(format_on);
+    if (!pattern.empty())
+    {
+        logger->setFormatter(pattern);
+    }
+    logger->addAppender(appender);
+    // more appenders with the formatter of the logger
+    for (int i = 1; i < copies; i++)
+    {
+        logger->addAppender(std::make_shared<NullLogAppender>());
+    }
+    if (!drained)
+    {
+        appender.reset();
+    }
+
+    std::vector<std::vector<uint32_t>> samples(threads);
+    std::atomic<int> ready{0};
+    std::atomic<bool> go{false};
+    std::vector<zcserver::Thread::ptr> thrs;
+    for (int t = 0; t < threads; t++)
+    {
+        thrs.push_back(zcserver::Thread::ptr(new zcserver::Thread([&, t]() {
+            std::vector<uint32_t> &s = samples[t];
+            s.resize(s_loops);
+            ++ready;
+            while (!go)
+                ;
+            for (int i = 0; i < s_loops; i++)
+            {
+                uint64_t begin = now_ns();
+                call(logger, i);
+                s[i] = now_ns() - begin;
+            }
+        }, "bench_" + std::to_string(t))));
+    }
+    while (ready < threads)
+        ;
+    uint64_t begin = now_ns();
+    go = true;
+    for (auto &i : thrs)
+    {
+        i->join();
+    }
+    if (drained)
+    {
+        appender->flush();
+        appender.reset();
+    }
+    uint64_t end = now_ns();
+    // the appenders drain and flush when they are destroyed
+    logger->clearAppenders();
+    unlink(s_file);
+
+    std::vector<uint32_t> all;
+    all.reserve((size_t)threads * s_loops);
+    for (auto &i : samples)
+    {
+        all.insert(all.end(), i.begin(), i.end());
+    }
+    std::sort(all.begin(), all.end());
+    double wall = end - begin;
+    std::stringstream ss;
+    ss << name << "\t" << macro << "\t" << threads
+       << "\t" << wall / s_loops
+       << "\t" << (uint64_t)(all.size() / (wall / 1e9))
+       << "\t" << all[all.size() * 50 / 100]
+       << "\t" << all[all.size() * 99 / 100]
+       << "\t" << all[all.size() * 999 / 1000];
+    return ss.str();
+}
+
+// the stdout appender writes to /dev/null, the results still go to stdout
+static std::string run_stdout(const char *macro, Call call, int threads)
+{
+    std::cout.flush();
+    int saved = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+    std::string result = run("stdout", macro, call, std::make_shared<zcserver::StdoutLogAppender>(), threads);
+    std::cout.flush();
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+    {
+        s_loops = atoi(argv[1]);
+    }
+    if (argc > 2)
+    {
+        s_max_threads = atoi(argv[2]);
+    }
+    if (s_loops <= 0 || s_max_threads <= 0)
+    {
+        std::cout << "usage: " << argv[0] << " [loops per thread] [max threads]" << std::endl;
+        return 1;
+    }
+
+    std::vector<int> threads;
+    for (int t = 1; t < s_max_threads; t *= 2)
+    {
+        threads.push_back(t);
+    }
+    threads.push_back(s_max_threads);
+
+    std::cout << "case\tmacro\tthreads\tns_per_op\tmsgs_per_s\tp50_ns\tp99_ns\tp999_ns" << std::endl;
+
+    // appenders with the default pattern
+    struct Macro
+    {
+        const char *name;
+        Call call;
+    } macros[] = {{"stream", stream_call}, {"fmt", fmt_call}};
+    for (auto &m : macros)
+    {
+        for (int t : threads)
+        {
+            std::cout << run("null", m.name, m.call, std::make_shared<NullLogAppender>(), t) << std::endl;
+            std::cout << run_stdout(m.name, m.call, t) << std::endl;
+            std::cout << run("file", m.name, m.call, std::make_shared<zcserver::FileLogAppender>(s_file), t) << std::endl;
+            std::cout << run("mmap_file", m.name, m.call, std::make_shared<zcserver::MmapFileLogAppender>(s_file), t) << std::endl;
+            std::cout << run("async_buffer", m.name, m.call, std::make_shared<zcserver::AsyncLogAppender>(
+                std::make_shared<zcserver::FileLogAppender>(s_file)), t) << std::endl;
+            std::cout << run("async_ring", m.name, m.call, std::make_shared<zcserver::AsyncLogAppender>(
+                std::make_shared<zcserver::FileLogAppender>(s_file), 0, 0, zcserver::AsyncLogAppender::RING), t) << std::endl;
+        }
+    }
+    for (int t : threads)
+    {
+        std::cout << run("null", "bin", bin_call, std::make_shared<NullLogAppender>(), t) << std::endl;
+        std::cout << run("binary_file", "bin", bin_call, std::make_shared<zcserver::BinaryLogAppender>(s_file), t) << std::endl;
+    }
+
+    // the cost of the formatter patterns
+    const char *patterns[] = {
+        "%m%n",
+        "%d{%Y-%m-%d %H:%M:%S}%T%t%T%F%T[%p]%T[%c]%T%f:%l%T%m%n",
+        "%d{%Y-%m-%d %H:%M:%S.%6N} [%p] %c %f:%l %m%n",
+    };
+    for (auto p : patterns)
+    {
+        for (auto &m : macros)
+        {
+            std::cout << run(std::string("pattern ") + p, m.name, m.call, std::make_shared<NullLogAppender>(), 1, p) << std::endl;
+        }
+    }
+
+    // formatting in the logging threads or in the writer thread
+    // consumer wins on the latency of a call, producer on throughput once
+    // the writer thread has more to format than the threads can hand over
+    const char *heavy = "%d{%Y-%m-%d %H:%M:%S.%6N}%T%t%T%F%T[%p]%T[%c]%T%f:%l%T%m%n";
+    for (int t : threads)
+    {
+        for (auto format_on : {zcserver::Logger::PRODUCER, zcserver::Logger::CONSUMER})
+        {
+            std::string mode = format_on == zcserver::Logger::PRODUCER ? "producer" : "consumer";
+            std::cout << run("format_on " + mode, "stream", stream_call, std::make_shared<zcserver::AsyncLogAppender>(
+                std::make_shared<NullLogAppender>()), t, heavy, zcserver::LogLevel::DEBUG, format_on) << std::endl;
+            std::cout << run("format_on " + mode + " drained", "stream", stream_call, std::make_shared<zcserver::AsyncLogAppender>(
+                std::make_shared<NullLogAppender>()), t, heavy, zcserver::LogLevel::DEBUG, format_on, true) << std::endl;
+        }
+    }
+
+    // appenders sharing the formatter of the logger, formatted once per event
+    for (int copies : {1, 2, 4})
+    {
+        std::cout << run("fanout x" + std::to_string(copies), "stream", stream_call, std::make_shared<NullLogAppender>(), 1,
+                         "", zcserver::LogLevel::DEBUG, zcserver::Logger::PRODUCER, false, copies) << std::endl;
+    }
+
+    // a statement below the level of the logger
+    for (int t : threads)
+    {
+        std::cout << run("filtered", "disabled", disabled_call, std::make_shared<NullLogAppender>(), t, "", zcserver::LogLevel::INFO) << std::endl;
+    }
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include <iostream>
 #include <thread>
 #include "../src/log.h"
+#include "../src/config.h"
 
 int main() 
 {
@@ -33,8 +34,133 @@ int main()
     ZCSERVER_LOG_FMT_INFO(logger, "test macro fmt error %s%s", "abc", "def");
     ZCSERVER_LOG_FMT_ERROR(logger, "test macro fmt error %s%s", "abc", "def");
     ZCSERVER_LOG_FMT_ERROR(logger, "test macro fmt error %s%s", "abc", "def");
+    // 参数按类型转换，格式串在编译期检查，长度修饰符可以省略
+    ZCSERVER_LOG_FMT_INFO(logger, "test macro fmt types [%5d] [%-6s] [%08.3f] [%#x] [%zu] [%c]",
+                          -42, std::string("ab"), 3.14159, 255u, sizeof(int), 'z');
 
     auto l = zcserver::LoggerMgr::GetInstance()->getLogger("xx");
     ZCSERVER_LOG_INFO(l) << "xxx";
+    // 调用处缓存的logger
+    ZCSERVER_LOG_INFO(ZCSERVER_LOG_STATIC("xx")) << "xxx cached";
+
+    // 测试分层日志器
+    // xx.yy没有配置，继承xx的级别和root的appender
+    auto child = ZCSERVER_LOG_NAME("xx.yy");
+    l->setLevel(zcserver::LogLevel::WARN);
+    ZCSERVER_LOG_INFO(child) << "xx.yy info filtered";
+    ZCSERVER_LOG_WARN(child) << "xx.yy warn";
+    std::cout << "xx.yy parent=" << child->getParent()->getName()
+              << " level=" << zcserver::LogLevel::ToString(child->getLevel()) << std::endl;
+    l->setLevel(zcserver::LogLevel::UNKNOWN);
+
+    // 测试采样和限速
+    // 每3次输出一次，之后的行带上被丢弃的条数
+    for (int i = 0; i < 10; i++)
+    {
+        ZCSERVER_LOG_EVERY_N(l, zcserver::LogLevel::INFO, 3) << "every 3 " << i;
+        ZCSERVER_LOG_FIRST_N(l, zcserver::LogLevel::INFO, 2) << "first 2 " << i;
+        ZCSERVER_LOG_RATE_LIMITED(l, zcserver::LogLevel::INFO, 4) << "rate 4/s " << i;
+    }
+    // 整个日志器每秒最多2条
+    l->setRateLimit(2);
+    for (int i = 0; i < 5; i++)
+    {
+        ZCSERVER_LOG_INFO(l) << "logger rate 2/s " << i;
+    }
+    l->setRateLimit(0);
+    ZCSERVER_LOG_INFO(l) << "logger unlimited";
+
+    // 测试结构化日志
+    // kv字段按类型保存在LogEvent中，%J输出JSON对象，%K输出logfmt
+    std::shared_ptr<zcserver::Logger> kv_logger(new zcserver::Logger("kv"));
+    kv_logger->setFormatter("%J%n");
+    kv_logger->addAppender(std::shared_ptr<zcserver::LogAppender>(new zcserver::StdoutLogAppender));
+    std::shared_ptr<zcserver::LogAppender> kv_appender(new zcserver::StdoutLogAppender);
+    kv_appender->setFormatter(std::make_shared<zcserver::LogFormatter>("%p %m %K%n"));
+    kv_logger->addAppender(kv_appender);
+    ZCSERVER_LOG_INFO(kv_logger).kv("user", 42).kv("latency_us", 12.5).kv("ok", true).kv("path", "/a b\"c") << "done";
+
+    // 测试线程上下文
+    // %N输出线程名，%X{key}输出MDC中key的值，%X输出全部
+    std::shared_ptr<zcserver::Logger> mdc_logger(new zcserver::Logger("mdc"));
+    mdc_logger->setFormatter("%t %N [%X{request_id}] [%X] %m%n");
+    mdc_logger->addAppender(std::shared_ptr<zcserver::LogAppender>(new zcserver::StdoutLogAppender));
+    ZCSERVER_LOG_INFO(mdc_logger) << "no mdc";
+    {
+        zcserver::LogMDC request("request_id", "r-1001");
+        ZCSERVER_LOG_INFO(mdc_logger) << "in request";
+        {
+            zcserver::LogMDC trace("trace_id", "t-42");
+            zcserver::LogMDC inner("request_id", "r-1002");
+            ZCSERVER_LOG_FMT_INFO(mdc_logger, "in %s", "trace");
+        }
+        ZCSERVER_LOG_INFO(mdc_logger) << "trace ended";
+    }
+    ZCSERVER_LOG_INFO(mdc_logger) << "request ended";
+
+    // 测试合并重复日志
+    // 连续相同的日志只输出第一条，其余合并为一条"last message repeated N times"
+    std::shared_ptr<zcserver::Logger> co_logger(new zcserver::Logger("coalesce"));
+    co_logger->addAppender(std::shared_ptr<zcserver::LogAppender>(new zcserver::CoalescingLogAppender(
+        std::shared_ptr<zcserver::LogAppender>(new zcserver::StdoutLogAppender))));
+    for (int i = 0; i < 5; i++)
+    {
+        ZCSERVER_LOG_ERROR(co_logger) << "connect failed";
+    }
+    ZCSERVER_LOG_INFO(co_logger) << "connected";
+    // 之后没有新日志时，窗口结束后由后台线程输出重复条数
+    for (int i = 0; i < 3; i++)
+    {
+        ZCSERVER_LOG_WARN(co_logger) << "retrying";
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    // 日志器已销毁时，重复条数那一行仍带原日志器的名字
+    std::shared_ptr<zcserver::LogAppender> co_appender(new zcserver::CoalescingLogAppender(
+        std::shared_ptr<zcserver::LogAppender>(new zcserver::StdoutLogAppender)));
+    {
+        std::shared_ptr<zcserver::Logger> gone_logger(new zcserver::Logger("coalesce_gone"));
+        gone_logger->addAppender(co_appender);
+        for (int i = 0; i < 3; i++)
+        {
+            ZCSERVER_LOG_ERROR(gone_logger) << "disk full";
+        }
+    }
+    co_appender->flush();
+    std::cout << "end coalesce" << std::endl;
+
+    // 测试异步输出
+    // 用AsyncLogAppender包装文件输出，由后台线程写文件
+    std::shared_ptr<zcserver::Logger> async_logger(new zcserver::Logger("async"));
+    std::shared_ptr<zcserver::LogAppender> async_file(new zcserver::FileLogAppender("./async.txt"));
+    async_logger->addAppender(std::shared_ptr<zcserver::LogAppender>(new zcserver::AsyncLogAppender(async_file, 4096, 100)));
+    for (int i = 0; i < 100; i++)
+    {
+        ZCSERVER_LOG_INFO(async_logger) << "test async " << i;
+    }
+    std::cout << async_logger->toYamlString() << std::endl;
+
+    // 测试滚动输出
+    // 文件超过4KB时改名为roll-日期-序号.txt，后台线程压缩，最多保留3个归档
+    std::shared_ptr<zcserver::Logger> roll_logger(new zcserver::Logger("roll"));
+    roll_logger->addAppender(std::shared_ptr<zcserver::LogAppender>(new zcserver::RollingFileLogAppender("./roll.txt", "./roll-%Y%m%d-%i.txt", 4096, 3)));
+    for (int i = 0; i < 1000; i++)
+    {
+        ZCSERVER_LOG_INFO(roll_logger) << "test rolling " << i;
+    }
+    std::cout << roll_logger->toYamlString() << std::endl;
+
+    // 测试运行指标
+    // 每个日志器的事件数、过滤数，每个输出器的字节数、写调用次数、队列高水位和刷新耗时
+    roll_logger->setLevel(zcserver::LogLevel::INFO);
+    // 被过滤的语句默认不计数
+    zcserver::Config::Lookup<bool>("log.count_filtered")->setValue(true);
+    ZCSERVER_LOG_DEBUG(roll_logger) << "filtered";
+    std::cout << zcserver::LoggerMgr::GetInstance()->metricsToYamlString() << std::endl;
+    for (auto &i : {async_logger, roll_logger, co_logger})
+    {
+        zcserver::LoggerMetrics m = i->getMetrics();
+        std::cout << m.name << ": events=" << m.events << " filtered=" << m.filtered
+                  << " bytes_formatted=" << m.appenders.front().bytesFormatted << std::endl;
+    }
     return 0;
 }
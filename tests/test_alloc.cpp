@@ -0,0 +1,158 @@
+#include "../src/log.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <new>
+
+// count the heap allocations made by the measuring thread
+static thread_local bool t_counting = false;
+static size_t s_allocs = 0;
+
+void *operator new(size_t size)
+{
+    if (t_counting)
+    {
+        ++s_allocs;
+    }
+    void *p = malloc(size ? size : 1);
+    if (!p)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept
+{
+    free(p);
+}
+
+static const std::string s_content = "a std::string longer than the small string buffer";
+
+void log_once(const std::shared_ptr<zcserver::Logger> &logger, int i)
+{
+    ZCSERVER_LOG_INFO(logger) << "zero alloc " << i << " " << 3.14 * i << " " << s_content;
+    ZCSERVER_LOG_FMT_ERROR(logger, "zero alloc fmt %d %s %.3f", i, "abc", 2.5 * i);
+}
+
+// run the steady state logging path, return the number of allocations
+size_t count_allocs(const std::shared_ptr<zcserver::Logger> &logger)
+{
+    // warm up: the pooled events, the formatter output and the streams get their storage
+    for (int i = 0; i < 100; i++)
+    {
+        log_once(logger, i);
+    }
+    s_allocs = 0;
+    t_counting = true;
+    for (int i = 0; i < 10000; i++)
+    {
+        log_once(logger, i);
+    }
+    t_counting = false;
+    return s_allocs;
+}
+
+// holds the writer while blocked, so the queue in front of it fills up and drops
+class BlockedLogAppender : public zcserver::LogAppender
+{
+public:
+    void log(const std::shared_ptr<zcserver::Logger> &logger, zcserver::LogLevel::Level level, const std::shared_ptr<zcserver::LogEvent> &event) override {}
+    void write(zcserver::LogLevel::Level level, const char *data, size_t len) override
+    {
+        while (s_blocked)
+        {
+            usleep(1000);
+        }
+    }
+    std::string toYamlString() override { return "type: BlockedLogAppender"; }
+
+    static std::atomic<bool> s_blocked;
+};
+
+std::atomic<bool> BlockedLogAppender::s_blocked{false};
+
+// the first drops of the logger happen while counting, return the number of allocations
+size_t count_drop_allocs(const std::shared_ptr<zcserver::Logger> &logger)
+{
+    for (int i = 0; i < 100; i++)
+    {
+        log_once(logger, i);
+    }
+    // let the writer take the warm up lines before it blocks
+    usleep(100 * 1000);
+    BlockedLogAppender::s_blocked = true;
+    s_allocs = 0;
+    t_counting = true;
+    for (int i = 0; i < 10000; i++)
+    {
+        log_once(logger, i);
+    }
+    t_counting = false;
+    BlockedLogAppender::s_blocked = false;
+    return s_allocs;
+}
+
+int main()
+{
+    int failed = 0;
+
+    std::shared_ptr<zcserver::Logger> file_logger(new zcserver::Logger("alloc_file"));
+    file_logger->addAppender(std::shared_ptr<zcserver::LogAppender>(new zcserver::FileLogAppender("/dev/null")));
+    size_t n = count_allocs(file_logger);
+    std::cout << "FileLogAppender: " << n << " allocations" << std::endl;
+    failed += n != 0;
+
+    std::shared_ptr<zcserver::Logger> async_logger(new zcserver::Logger("alloc_async"));
+    std::shared_ptr<zcserver::LogAppender> async_file(new zcserver::FileLogAppender("/dev/null"));
+    async_logger->addAppender(std::shared_ptr<zcserver::LogAppender>(new zcserver::AsyncLogAppender(async_file, 16 * 1024 * 1024)));
+    n = count_allocs(async_logger);
+    std::cout << "AsyncLogAppender: " << n << " allocations" << std::endl;
+    failed += n != 0;
+
+    std::shared_ptr<zcserver::Logger> ring_logger(new zcserver::Logger("alloc_ring"));
+    std::shared_ptr<zcserver::LogAppender> ring_file(new zcserver::FileLogAppender("/dev/null"));
+    ring_logger->addAppender(std::shared_ptr<zcserver::LogAppender>(new zcserver::AsyncLogAppender(ring_file, 0, 0, zcserver::AsyncLogAppender::RING)));
+    n = count_allocs(ring_logger);
+    std::cout << "AsyncLogAppender ring: " << n << " allocations" << std::endl;
+    failed += n != 0;
+
+    // a full queue drops without allocating
+    std::shared_ptr<zcserver::Logger> drop_logger(new zcserver::Logger("alloc_drop"));
+    std::shared_ptr<zcserver::AsyncLogAppender> drop_async(
+        new zcserver::AsyncLogAppender(std::make_shared<BlockedLogAppender>(), 64 * 1024, 10));
+    drop_async->setOverflow(64 * 1024, zcserver::AsyncLogAppender::DROP_NEWEST);
+    drop_logger->addAppender(drop_async);
+    n = count_drop_allocs(drop_logger);
+    std::cout << "AsyncLogAppender drop_newest: " << n << " allocations, " << drop_logger->getDropped() << " dropped" << std::endl;
+    failed += n != 0 || drop_logger->getDropped() == 0;
+
+    std::shared_ptr<zcserver::Logger> ring_drop_logger(new zcserver::Logger("alloc_ring_drop"));
+    ring_drop_logger->addAppender(std::shared_ptr<zcserver::LogAppender>(
+        new zcserver::AsyncLogAppender(std::make_shared<BlockedLogAppender>(), 0, 10, zcserver::AsyncLogAppender::RING)));
+    n = count_drop_allocs(ring_drop_logger);
+    std::cout << "AsyncLogAppender ring full: " << n << " allocations, " << ring_drop_logger->getDropped() << " dropped" << std::endl;
+    failed += n != 0 || ring_drop_logger->getDropped() == 0;
+
+    std::cout << (failed ? "FAILED" : "PASSED") << std::endl;
+    return failed;
+}
@@ -0,0 +1,132 @@
+#include "../src/binlog.h"
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+// log the same call with the binary and the printf macros on one line
+#define LOG_BOTH(fmt, ...)                                      \
+    ZCSERVER_LOG_BIN_FMT_INFO(bin_logger, fmt, __VA_ARGS__);    \
+    ZCSERVER_LOG_FMT_INFO(txt_logger, fmt, __VA_ARGS__)
+
+static const char *s_pattern = "%p%T%f:%l%T%m%n";
+// the appenders append, the output of an earlier run is removed first
+static const char *s_files[] = {"./binlog.bin", "./binlog.txt", "./binlog_mixed.txt"};
+
+static void remove_files()
+{
+    for (auto i : s_files)
+    {
+        unlink(i);
+    }
+}
+
+uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+std::string read_file(const std::string &name)
+{
+    std::ifstream in(name);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+int main()
+{
+    int failed = 0;
+    remove_files();
+    std::shared_ptr<zcserver::LogFormatter> fmt(new zcserver::LogFormatter(s_pattern));
+
+    std::shared_ptr<zcserver::Logger> bin_logger(new zcserver::Logger("bin"));
+    std::shared_ptr<zcserver::BinaryLogAppender> bin_appender(new zcserver::BinaryLogAppender("./binlog.bin"));
+    bin_logger->addAppender(bin_appender);
+    std::shared_ptr<zcserver::Logger> txt_logger(new zcserver::Logger("txt"));
+    std::shared_ptr<zcserver::FileLogAppender> txt_appender(new zcserver::FileLogAppender("./binlog.txt"));
+    txt_appender->setFormatter(fmt);
+    txt_logger->addAppender(txt_appender);
+
+    std::string str = "std::string";
+    int64_t big = -1234567890123ll;
+    LOG_BOTH("int %d unsigned %u negative %d", 42, 7u, -5);
+    LOG_BOTH("int64 %ld uint64 %lu", big, (uint64_t)-1);
+    LOG_BOTH("hex %x %08X char %c", 255, 0xbeefu, 'z');
+    LOG_BOTH("double %f %.3f %10.2e %g", 3.14159, 2.5, 12345.678, 0.0001);
+    LOG_BOTH("string %s %-8s| %.3s %s", "abc", "left", "truncated", str.c_str());
+    LOG_BOTH("width %*d precision %.*f", 6, 12, 2, 1.23456);
+    LOG_BOTH("percent %% %d%%", 100);
+    LOG_BOTH("bool %d short %hd", true, (short)-3);
+    ZCSERVER_LOG_INFO(bin_logger) << "stream line " << 1;
+    bin_appender->flush();
+    txt_appender->flush();
+
+    // the binary file, decoded with the same pattern
+    std::shared_ptr<zcserver::LogFormatter> decode_fmt(new zcserver::LogFormatter(s_pattern));
+    zcserver::BinLogDecoder decoder(decode_fmt);
+    std::ifstream in("./binlog.bin", std::ios::binary);
+    std::stringstream decoded;
+    if (!decoder.decode(in, decoded))
+    {
+        std::cout << "decode FAILED" << std::endl;
+        ++failed;
+    }
+    std::string expected = read_file("./binlog.txt");
+    std::string lines = decoded.str();
+    std::string last = lines.substr(lines.rfind('\n', lines.size() - 2) + 1);
+    lines = lines.substr(0, lines.size() - last.size());
+    std::cout << lines << last;
+    if (lines != expected)
+    {
+        std::cout << "decoded lines differ from printf:" << std::endl << expected;
+        ++failed;
+    }
+    if (last.find("stream line 1") == std::string::npos)
+    {
+        std::cout << "text record FAILED" << std::endl;
+        ++failed;
+    }
+
+    // a text appender receives the decoded line
+    std::stringstream fallback;
+    std::shared_ptr<zcserver::Logger> mixed_logger(new zcserver::Logger("mixed"));
+    std::shared_ptr<zcserver::FileLogAppender> mixed_appender(new zcserver::FileLogAppender("./binlog_mixed.txt"));
+    mixed_appender->setFormatter(fmt);
+    mixed_logger->addAppender(mixed_appender);
+    ZCSERVER_LOG_BIN_FMT_WARN(mixed_logger, "decoded in process %d %s", 1, "ok");
+    mixed_appender->flush();
+    if (read_file("./binlog_mixed.txt").find("WARN\t") != 0 || read_file("./binlog_mixed.txt").find("decoded in process 1 ok") == std::string::npos)
+    {
+        std::cout << "text appender FAILED" << std::endl;
+        ++failed;
+    }
+
+    remove_files();
+
+    // cost of a call, the files are written to /dev/null
+    const int n = 200000;
+    std::shared_ptr<zcserver::Logger> bench_bin(new zcserver::Logger("bench_bin"));
+    bench_bin->addAppender(std::shared_ptr<zcserver::LogAppender>(new zcserver::BinaryLogAppender("/dev/null")));
+    std::shared_ptr<zcserver::Logger> bench_txt(new zcserver::Logger("bench_txt"));
+    bench_txt->addAppender(std::shared_ptr<zcserver::LogAppender>(new zcserver::FileLogAppender("/dev/null")));
+    uint64_t start = now_ns();
+    for (int i = 0; i < n; i++)
+    {
+        ZCSERVER_LOG_BIN_FMT_INFO(bench_bin, "request %d took %f ms from %s", i, 0.5 * i, "127.0.0.1");
+    }
+    uint64_t bin_ns = (now_ns() - start) / n;
+    start = now_ns();
+    for (int i = 0; i < n; i++)
+    {
+        ZCSERVER_LOG_FMT_INFO(bench_txt, "request %d took %f ms from %s", i, 0.5 * i, "127.0.0.1");
+    }
+    uint64_t txt_ns = (now_ns() - start) / n;
+    std::cout << "mode\tns/call" << std::endl;
+    std::cout << "binary\t" << bin_ns << std::endl;
+    std::cout << "text\t" << txt_ns << std::endl;
+
+    std::cout << (failed ? "FAILED" : "PASSED") << std::endl;
+    return failed;
+}
@@ -0,0 +1,202 @@
+#include "../src/log.h"
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fstream>
+#include <sstream>
+
+// the lines each appender holds in its buffer when the child dies
+static const int s_lines = 1000;
+
+// a file appender that writes only when it is told to
+static std::shared_ptr<zcserver::FileLogAppender> buffered(const std::string &filename)
+{
+    std::shared_ptr<zcserver::FileLogAppender> file(new zcserver::FileLogAppender(filename));
+    file->setFlushPolicy(16 * 1024 * 1024, 3600 * 1000, zcserver::LogLevel::UNKNOWN);
+    return file;
+}
+
+static void log_lines(const std::string &name, std::shared_ptr<zcserver::LogAppender> appender)
+{
+    auto logger = ZCSERVER_LOG_NAME(name);
+    logger->setFormatter("%p %m%n");
+    logger->addAppender(appender);
+    for (int i = 0; i < s_lines; i++)
+    {
+        ZCSERVER_LOG_INFO(logger) << name << " line " << i;
+    }
+}
+
+// log to a plain, a double buffered and a ring buffered file, then die with how()
+static void child(const std::string &prefix, void (*how)())
+{
+    log_lines(prefix + "_file", buffered(prefix + "_file.txt"));
+    log_lines(prefix + "_async", std::make_shared<zcserver::AsyncLogAppender>(buffered(prefix + "_async.txt"), 16 * 1024 * 1024, 3600 * 1000));
+    log_lines(prefix + "_ring", std::make_shared<zcserver::AsyncLogAppender>(buffered(prefix + "_ring.txt"), 0, 3600 * 1000,
+                                                                              zcserver::AsyncLogAppender::RING));
+    how();
+    _exit(0);
+}
+
+static void segv()
+{
+    volatile int *p = nullptr;
+    *p = 1;
+}
+
+static void fatal()
+{
+    ZCSERVER_LOG_FATAL(ZCSERVER_LOG_NAME("fatal_file")) << "fatal_file last words";
+    // no destructors, no atexit
+    _exit(0);
+}
+
+// every line of the child and the crash record
+static int check(const std::string &filename, const std::string &name, const std::string &record)
+{
+    std::ifstream in(filename);
+    std::string line;
+    int next = 0;
+    bool found = record.empty();
+    while (std::getline(in, line))
+    {
+        if (line == "INFO " + name + " line " + std::to_string(next))
+        {
+            ++next;
+        }
+        else if (!record.empty() && line.find(record) != std::string::npos)
+        {
+            found = true;
+        }
+    }
+    unlink(filename.c_str());
+    bool ok = next == s_lines && found;
+    std::cout << filename << ": " << next << " lines, record " << (found ? "found" : "missing") << (ok ? "" : " FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
+
+static int run(const std::string &prefix, void (*how)(), int sig, const std::string &record)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        child(prefix, how);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    int failed = 0;
+    if (sig ? !(WIFSIGNALED(status) && WTERMSIG(status) == sig) : !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+    {
+        std::cout << prefix << ": unexpected status " << status << " FAILED" << std::endl;
+        ++failed;
+    }
+    failed += check(prefix + "_file.txt", prefix + "_file", record);
+    failed += check(prefix + "_async.txt", prefix + "_async", record);
+    failed += check(prefix + "_ring.txt", prefix + "_ring", record);
+    return failed;
+}
+
+// a burst, then nothing until SIGKILL, which no handler sees: the interval flush wrote the lines
+static int run_quiet()
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        std::shared_ptr<zcserver::FileLogAppender> file(new zcserver::FileLogAppender("quiet_file.txt"));
+        file->setFlushPolicy(16 * 1024 * 1024, 100, zcserver::LogLevel::UNKNOWN);
+        log_lines("quiet_file", file);
+        usleep(500 * 1000);
+        kill(getpid(), SIGKILL);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    int failed = 0;
+    if (!(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL))
+    {
+        std::cout << "quiet: unexpected status " << status << " FAILED" << std::endl;
+        ++failed;
+    }
+    return failed + check("quiet_file.txt", "quiet_file", "");
+}
+
+// the address space of the process
+static rlim_t address_space()
+{
+    std::ifstream in("/proc/self/status");
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (line.compare(0, 7, "VmSize:") == 0)
+        {
+            return strtoul(line.c_str() + 7, nullptr, 10) * 1024;
+        }
+    }
+    return 0;
+}
+
+// the segments after the first cannot be mapped, the file still ends with the lines
+static int run_mmap()
+{
+    const char *filename = "mmap_full.txt";
+    unlink(filename);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        auto logger = ZCSERVER_LOG_NAME("mmap_full");
+        logger->setFormatter("%m%n");
+        std::shared_ptr<zcserver::MmapFileLogAppender> appender(new zcserver::MmapFileLogAppender(filename, 64 * 1024));
+        logger->addAppender(appender);
+        ZCSERVER_LOG_INFO(logger) << "first";
+        // no room for another segment
+        struct rlimit rl;
+        getrlimit(RLIMIT_AS, &rl);
+        rlim_t limit = rl.rlim_cur;
+        rl.rlim_cur = address_space() + 16 * 1024;
+        setrlimit(RLIMIT_AS, &rl);
+        for (int i = 0; i < 10000; i++)
+        {
+            ZCSERVER_LOG_INFO(logger) << "mmap_full line " << i;
+        }
+        // the background thread maps it again once there is room
+        rl.rlim_cur = limit;
+        setrlimit(RLIMIT_AS, &rl);
+        uint64_t dropped = appender->getMetrics().dropped;
+        usleep(1500 * 1000);
+        ZCSERVER_LOG_INFO(logger) << "last";
+        logger->clearAppenders();
+        appender.reset();
+        _exit(dropped > 0 ? 0 : 2);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    std::ifstream in(filename, std::ios::binary);
+    std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    unlink(filename);
+    // the line crossing the end of the segment is dropped as a whole
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0
+              && content.compare(0, 6, "first\n") == 0 && content.find('\0') == std::string::npos
+              && content.size() >= 5 && content.compare(content.size() - 5, 5, "last\n") == 0;
+    std::stringstream lines(content);
+    std::string line;
+    while (ok && std::getline(lines, line))
+    {
+        ok = line == "first" || line == "last" || line.compare(0, 15, "mmap_full line ") == 0;
+    }
+    std::cout << filename << ": " << content.size() << " bytes" << (ok ? "" : " FAILED") << std::endl;
+    return ok ? 0 : 1;
+}
+
+int main()
+{
+    int failed = 0;
+    zcserver::LogCrashHandler::Install();
+    failed += run("segv", segv, SIGSEGV, "[FATAL]\t[crash]\tsignal 11 (SIGSEGV)");
+    failed += run("abort", abort, SIGABRT, "[FATAL]\t[crash]\tsignal 6 (SIGABRT)");
+    failed += run("fatal", fatal, 0, "");
+    failed += run_quiet();
+    failed += run_mmap();
+    std::cout << (failed ? "FAILED" : "PASSED") << std::endl;
+    return failed;
+}
@@ -0,0 +1,176 @@
+#include "../src/fiber.h"
+#include "../src/log.h"
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fstream>
+#include <stdexcept>
+
+static int s_failed = 0;
+
+static void expect(bool ok, const std::string &what)
+{
+    std::cout << what << (ok ? "" : " FAILED") << std::endl;
+    if (!ok)
+    {
+        ++s_failed;
+    }
+}
+
+// two fibers interleaved with the main fiber, each with its own MDC
+static void test_switch()
+{
+    auto logger = ZCSERVER_LOG_NAME("fiber");
+    logger->setFormatter("%F %X %m%n");
+    std::shared_ptr<zcserver::FileLogAppender> file(new zcserver::FileLogAppender("fiber.txt"));
+    logger->addAppender(file);
+
+    zcserver::LogMDC main_mdc("who", "main");
+    std::vector<zcserver::Fiber::ptr> fibers;
+    for (int i = 0; i < 2; i++)
+    {
+        fibers.push_back(std::make_shared<zcserver::Fiber>([logger, i]()
+        {
+            zcserver::LogMDC mdc("who", "fiber" + std::to_string(i));
+            ZCSERVER_LOG_INFO(logger) << "step 1";
+            zcserver::Fiber::YieldToHold();
+            ZCSERVER_LOG_INFO(logger) << "step 2";
+        }));
+    }
+    for (int step = 0; step < 2; step++)
+    {
+        for (auto &i : fibers)
+        {
+            i->swapIn();
+            ZCSERVER_LOG_INFO(logger) << "back";
+        }
+    }
+    file->flush();
+    logger->clearAppenders();
+
+    std::string expected;
+    for (int step = 1; step <= 2; step++)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            expected += std::to_string(fibers[i]->getId()) + " who=fiber" + std::to_string(i) + " step " + std::to_string(step) + "\n";
+            expected += "0 who=main back\n";
+        }
+    }
+    std::ifstream in("fiber.txt");
+    std::string content((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    unlink("fiber.txt");
+    expect(content == expected, "switch: fiber ids and MDC follow the running fiber");
+    expect(fibers[0]->getId() != 0 && fibers[0]->getId() != fibers[1]->getId(), "switch: fiber ids are distinct");
+    expect(fibers[0]->getState() == zcserver::Fiber::TERM && fibers[1]->getState() == zcserver::Fiber::TERM, "switch: fibers TERM");
+    expect(zcserver::Fiber::GetFiberId() == 0, "switch: main fiber id 0");
+}
+
+static void test_state()
+{
+    zcserver::Fiber::ptr fiber(new zcserver::Fiber([]()
+    {
+        zcserver::Fiber::YieldToReady();
+        throw std::runtime_error("expected exception");
+    }));
+    expect(fiber->getState() == zcserver::Fiber::INIT, "state: INIT");
+    fiber->swapIn();
+    expect(fiber->getState() == zcserver::Fiber::READY, "state: READY");
+    fiber->swapIn();
+    expect(fiber->getState() == zcserver::Fiber::EXCEPT, "state: EXCEPT");
+
+    // the stack is reused by the next callback
+    int runs = 0;
+    fiber->reset([&runs]() { ++runs; });
+    expect(fiber->getState() == zcserver::Fiber::INIT, "reset: INIT");
+    fiber->swapIn();
+    expect(runs == 1 && fiber->getState() == zcserver::Fiber::TERM, "reset: TERM");
+}
+
+struct Counted
+{
+    Counted() { ++s_alive; }
+    ~Counted() { --s_alive; }
+    int value = 0;
+    static int s_alive;
+};
+
+int Counted::s_alive = 0;
+
+static void test_local()
+{
+    static zcserver::FiberLocal<Counted> s_local;
+    s_local.get().value = -1;
+    std::vector<int> seen;
+    {
+        std::vector<zcserver::Fiber::ptr> fibers;
+        for (int i = 0; i < 3; i++)
+        {
+            fibers.push_back(std::make_shared<zcserver::Fiber>([&seen, i]()
+            {
+                s_local.get().value = i;
+                zcserver::Fiber::YieldToHold();
+                seen.push_back(s_local.get().value);
+            }));
+        }
+        for (int step = 0; step < 2; step++)
+        {
+            for (auto &i : fibers)
+            {
+                i->swapIn();
+            }
+        }
+        expect(Counted::s_alive == 4, "local: one value for each fiber and the main fiber");
+    }
+    expect(seen == std::vector<int>({0, 1, 2}) && s_local.get().value == -1, "local: values are per fiber");
+    expect(Counted::s_alive == 1, "local: values destroyed with their fibers");
+}
+
+static void test_count()
+{
+    uint64_t before = zcserver::Fiber::TotalFibers();
+    {
+        zcserver::Fiber::ptr fiber(new zcserver::Fiber([]() {}));
+        expect(zcserver::Fiber::TotalFibers() == before + 1, "count: created");
+        fiber->swapIn();
+    }
+    expect(zcserver::Fiber::TotalFibers() == before, "count: destroyed");
+}
+
+static int recurse(int depth)
+{
+    if (depth > (1 << 30))
+    {
+        return 0;
+    }
+    volatile char buf[1024];
+    buf[0] = (char)depth;
+    return buf[0] + recurse(depth + 1);
+}
+
+// overflowing the stack of a fiber hits the guard page, the crash handler reports it
+static void test_guard()
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        zcserver::Fiber::ptr fiber(new zcserver::Fiber([]() { recurse(0); }, 64 * 1024));
+        fiber->swapIn();
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    expect(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV, "guard: stack overflow is a SIGSEGV");
+}
+
+int main()
+{
+    zcserver::LogCrashHandler::Install();
+    test_switch();
+    test_state();
+    test_local();
+    test_count();
+    test_guard();
+    std::cout << (s_failed ? "FAILED" : "PASSED") << std::endl;
+    return s_failed;
+}
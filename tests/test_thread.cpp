@@ -1,6 +1,10 @@
 #include "../src/log.h"
 #include "../src/thread.h"
+#include "../src/config.h"
 #include <iostream>
+#include <fstream>
+#include <thread>
+#include <unistd.h>
 
 void fun1();
 void fun2();
@@ -27,6 +31,240 @@ int main()
 
     ZCSERVER_LOG_INFO(g_logger) << "thread test end";
     ZCSERVER_LOG_INFO(g_logger) << "count = " << count;
+
+    // every thread logs into its own ring, the records are merged into one file
+    std::shared_ptr<zcserver::Logger> ring_logger(new zcserver::Logger("ring"));
+    std::shared_ptr<zcserver::LogAppender> ring_file(new zcserver::FileLogAppender("./ring.txt"));
+    ring_logger->addAppender(std::shared_ptr<zcserver::LogAppender>(new zcserver::AsyncLogAppender(ring_file, 0, 0, zcserver::AsyncLogAppender::RING)));
+    thrs.clear();
+    for (int i = 0; i < 5; i++)
+    {
+        zcserver::Thread::ptr thr(new zcserver::Thread([ring_logger]() {
+            for (int j = 0; j < 1000; j++)
+            {
+                ZCSERVER_LOG_INFO(ring_logger) << zcserver::Thread::GetName() << " " << j;
+            }
+        }, "ring_" + std::to_string(i)));
+        thrs.push_back(thr);
+    }
+    for (auto &i : thrs)
+    {
+        i->join();
+    }
+    // threads not started by zcserver::Thread give their rings back when they exit
+    size_t rings = zcserver::LogRingConsumerMgr::GetInstance()->getRingCount();
+    for (int i = 0; i < 50; i++)
+    {
+        std::thread thr([ring_logger]() {
+            ZCSERVER_LOG_INFO(ring_logger) << "std::thread";
+        });
+        thr.join();
+    }
+    zcserver::LogRingConsumerMgr::GetInstance()->flush();
+    size_t left = zcserver::LogRingConsumerMgr::GetInstance()->getRingCount();
+    ZCSERVER_LOG_INFO(g_logger) << "ring churn: rings " << rings << " -> " << left << (left <= rings ? " ok" : " FAILED");
+    ring_logger->clearAppenders();
+    ZCSERVER_LOG_INFO(g_logger) << "ring test end";
+
+    // replace the appenders while other threads are logging
+    std::shared_ptr<zcserver::Logger> reload_logger(new zcserver::Logger("reload"));
+    std::atomic<bool> stop{false};
+    thrs.clear();
+    for (int i = 0; i < 4; i++)
+    {
+        zcserver::Thread::ptr thr(new zcserver::Thread([reload_logger, &stop]() {
+            while (!stop)
+            {
+                ZCSERVER_LOG_INFO(reload_logger) << zcserver::Thread::GetName();
+            }
+        }, "reload_" + std::to_string(i)));
+        thrs.push_back(thr);
+    }
+    for (int i = 0; i < 200; i++)
+    {
+        zcserver::Logger::Appenders appenders;
+        appenders.push_back(std::make_shared<zcserver::FileLogAppender>("./reload_a.txt"));
+        appenders.push_back(std::make_shared<zcserver::FileLogAppender>("./reload_b.txt"));
+        reload_logger->setAppenders(appenders);
+        // the appenders inherit the formatter, it is replaced under the logging threads
+        reload_logger->setFormatter(i % 2 ? "%t%T%m%n" : "%p%T%t%T%m%n");
+    }
+    stop = true;
+    for (auto &i : thrs)
+    {
+        i->join();
+    }
+    reload_logger->clearAppenders();
+
+    // replace the formatter the appenders share, every line reaches each appender once
+    std::shared_ptr<zcserver::FileLogAppender> shared_a(new zcserver::FileLogAppender("./shared_a.txt"));
+    std::shared_ptr<zcserver::FileLogAppender> shared_b(new zcserver::FileLogAppender("./shared_b.txt"));
+    reload_logger->addAppender(shared_a);
+    reload_logger->addAppender(shared_b);
+    thrs.clear();
+    for (int i = 0; i < 4; i++)
+    {
+        zcserver::Thread::ptr thr(new zcserver::Thread([reload_logger]() {
+            for (int j = 0; j < 20000; j++)
+            {
+                ZCSERVER_LOG_INFO(reload_logger) << j;
+            }
+        }, "shared_" + std::to_string(i)));
+        thrs.push_back(thr);
+    }
+    for (int i = 0; i < 200; i++)
+    {
+        reload_logger->setFormatter(i % 2 ? "%m%n" : "%p%T%m%n");
+    }
+    for (auto &i : thrs)
+    {
+        i->join();
+    }
+    reload_logger->clearAppenders();
+    shared_a->flush();
+    shared_b->flush();
+    size_t lines_a = 0;
+    size_t lines_b = 0;
+    {
+        std::string line;
+        std::ifstream file_a("./shared_a.txt");
+        while (std::getline(file_a, line))
+            ++lines_a;
+        std::ifstream file_b("./shared_b.txt");
+        while (std::getline(file_b, line))
+            ++lines_b;
+    }
+    unlink("./shared_a.txt");
+    unlink("./shared_b.txt");
+    ZCSERVER_LOG_INFO(g_logger) << "shared formatter: a " << lines_a << " b " << lines_b
+                                << (lines_a == 80000 && lines_b == 80000 ? " ok" : " FAILED");
+    ZCSERVER_LOG_INFO(g_logger) << "reload test end";
+
+    // threads copy into the mapped segments, small segments make them switch often
+    std::shared_ptr<zcserver::Logger> mmap_logger(new zcserver::Logger("mmap"));
+    mmap_logger->addAppender(std::make_shared<zcserver::MmapFileLogAppender>("./mmap.txt", 64 * 1024));
+    thrs.clear();
+    for (int i = 0; i < 5; i++)
+    {
+        zcserver::Thread::ptr thr(new zcserver::Thread([mmap_logger]() {
+            for (int j = 0; j < 10000; j++)
+            {
+                ZCSERVER_LOG_INFO(mmap_logger) << zcserver::Thread::GetName() << " " << j;
+            }
+        }, "mmap_" + std::to_string(i)));
+        thrs.push_back(thr);
+    }
+    for (auto &i : thrs)
+    {
+        i->join();
+    }
+    mmap_logger->clearAppenders();
+    ZCSERVER_LOG_INFO(g_logger) << "mmap test end";
+
+    // the writer thread formats the events, with the fields copied from the threads
+    std::shared_ptr<zcserver::Logger> consumer_logger(new zcserver::Logger("consumer"));
+    consumer_logger->setFormatOn(zcserver::Logger::CONSUMER);
+    consumer_logger->setFormatter("%d%T%t%T%N%T%F%T[%p]%T[%c]%T%f:%l%T%K%T%X%T%m%n");
+    consumer_logger->addAppender(std::make_shared<zcserver::AsyncLogAppender>(std::make_shared<zcserver::FileLogAppender>("./consumer.txt")));
+    thrs.clear();
+    for (int i = 0; i < 5; i++)
+    {
+        zcserver::Thread::ptr thr(new zcserver::Thread([consumer_logger]() {
+            zcserver::LogMDC request("request", zcserver::Thread::GetName());
+            for (int j = 0; j < 1000; j++)
+            {
+                ZCSERVER_LOG_INFO(consumer_logger).kv("j", j) << zcserver::Thread::GetName() << " " << j;
+            }
+        }, "consumer_" + std::to_string(i)));
+        thrs.push_back(thr);
+    }
+    for (auto &i : thrs)
+    {
+        i->join();
+    }
+    consumer_logger->clearAppenders();
+    ZCSERVER_LOG_INFO(g_logger) << "consumer test end";
+
+    // a small bound overflows, every line is written, dropped or spilled
+    const char *policies[] = {"block", "drop_newest", "drop_oldest", "drop_below", "spill"};
+    for (auto policy : policies)
+    {
+        zcserver::AsyncLogAppender::Overflow overflow;
+        zcserver::AsyncLogAppender::FromString(policy, overflow);
+        std::shared_ptr<zcserver::Logger> overflow_logger(new zcserver::Logger(std::string("overflow_") + policy));
+        overflow_logger->setFormatter("%m%n");
+        std::shared_ptr<zcserver::AsyncLogAppender> async(new zcserver::AsyncLogAppender(
+            std::make_shared<zcserver::FileLogAppender>("./overflow.txt"), 1024, 1));
+        async->setOverflow(4096, overflow, zcserver::LogLevel::ERROR, "./overflow_spill.txt");
+        overflow_logger->addAppender(async);
+        thrs.clear();
+        for (int i = 0; i < 5; i++)
+        {
+            zcserver::Thread::ptr thr(new zcserver::Thread([overflow_logger]() {
+                for (int j = 0; j < 10000; j++)
+                {
+                    ZCSERVER_LOG_INFO(overflow_logger) << zcserver::Thread::GetName() << " " << j;
+                }
+            }, "overflow_" + std::to_string(i)));
+            thrs.push_back(thr);
+        }
+        for (auto &i : thrs)
+        {
+            i->join();
+        }
+        overflow_logger->clearAppenders();
+        async->flush();
+        size_t lines = 0;
+        size_t spilled = 0;
+        std::string line;
+        std::ifstream file("./overflow.txt");
+        while (std::getline(file, line))
+            ++lines;
+        std::ifstream spill("./overflow_spill.txt");
+        while (std::getline(spill, line))
+            ++spilled;
+        unlink("./overflow.txt");
+        unlink("./overflow_spill.txt");
+        ZCSERVER_LOG_INFO(g_logger) << "overflow " << policy << ": written " << lines << " dropped " << overflow_logger->getDropped()
+                                    << " spilled " << spilled << (lines + overflow_logger->getDropped() + spilled == 50000 ? " ok" : " FAILED");
+    }
+
+    // a full ring blocks its producer until the consumer drained it
+    zcserver::Config::Lookup<uint32_t>("log.ring_size")->setValue(4096);
+    {
+        std::shared_ptr<zcserver::Logger> block_logger(new zcserver::Logger("ring_block"));
+        block_logger->setFormatter("%m%n");
+        std::shared_ptr<zcserver::AsyncLogAppender> async(new zcserver::AsyncLogAppender(
+            std::make_shared<zcserver::FileLogAppender>("./ring_block.txt"), 0, 0, zcserver::AsyncLogAppender::RING));
+        async->setOverflow(0, zcserver::AsyncLogAppender::BLOCK);
+        block_logger->addAppender(async);
+        thrs.clear();
+        for (int i = 0; i < 5; i++)
+        {
+            zcserver::Thread::ptr thr(new zcserver::Thread([block_logger]() {
+                for (int j = 0; j < 10000; j++)
+                {
+                    ZCSERVER_LOG_INFO(block_logger) << zcserver::Thread::GetName() << " " << j;
+                }
+            }, "ring_block_" + std::to_string(i)));
+            thrs.push_back(thr);
+        }
+        for (auto &i : thrs)
+        {
+            i->join();
+        }
+        block_logger->clearAppenders();
+        async->flush();
+        size_t lines = 0;
+        std::string line;
+        std::ifstream file("./ring_block.txt");
+        while (std::getline(file, line))
+            ++lines;
+        unlink("./ring_block.txt");
+        ZCSERVER_LOG_INFO(g_logger) << "overflow ring block: written " << lines << " dropped " << block_logger->getDropped()
+                                    << (lines == 50000 && block_logger->getDropped() == 0 ? " ok" : " FAILED");
+    }
+    ZCSERVER_LOG_INFO(g_logger) << "overflow test end";
     return 0;
 }
 
@@ -0,0 +1,51 @@
+/*
+    zclog-decode: print the files written by BinaryLogAppender as text
+
+    usage: zclog-decode [-p pattern] file...
+        -p  a LogFormatter pattern, the default pattern of Logger if omitted
+*/
+
+#include <string.h>
+#include <fstream>
+#include <iostream>
+#include "src/binlog.h"
+
+int main(int argc, char **argv)
+{
+    std::shared_ptr<zcserver::LogFormatter> formatter(new zcserver::DefaultLogFormatter);
+    int i = 1;
+    if (i + 1 < argc && strcmp(argv[i], "-p") == 0)
+    {
+        formatter.reset(new zcserver::LogFormatter(argv[i + 1]));
+        if (formatter->isError())
+        {
+            std::cerr << "invalid pattern: " << argv[i + 1] << std::endl;
+            return 1;
+        }
+        i += 2;
+    }
+    if (i >= argc)
+    {
+        std::cerr << "usage: " << argv[0] << " [-p pattern] file..." << std::endl;
+        return 1;
+    }
+
+    int rt = 0;
+    zcserver::BinLogDecoder decoder(formatter);
+    for (; i < argc; ++i)
+    {
+        std::ifstream in(argv[i], std::ios::binary);
+        if (!in)
+        {
+            std::cerr << argv[i] << ": cannot open" << std::endl;
+            rt = 1;
+            continue;
+        }
+        if (!decoder.decode(in, std::cout))
+        {
+            std::cerr << argv[i] << ": not a binary log or truncated" << std::endl;
+            rt = 1;
+        }
+    }
+    return rt;
+}